@@ -3,11 +3,32 @@
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <termios.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
 
 #define BUFFER_SIZE 1024
 #define INPUT_MAX 1024
+#define SCRIPT_WINDOW 128       // Script mode: commands in flight by default
+#define SCRIPT_STALL_MS 10000   // Script mode: give up after this long without a byte from the server
+
+// Binary protocol (see BinaryOp in echo_server.cpp), spoken in script mode:
+// every command carries a tag and the server's replies come back with it
+#define BINARY_MAGIC 0xFE
+#define BINARY_HEADER 8
+#define USER_ID_SIZE 8
+#define OP_HELLO 1
+#define OP_WELCOME 2
+#define OP_MESSAGE 3
+#define OP_DELIVER 5
+#define OP_USER 7
+#define OP_ERROR 9
+#define OP_ACK 10
+#define TAG_COUNT 65536
 
 char input_buffer[INPUT_MAX];
 int input_pos = 0;
@@ -17,6 +38,7 @@ pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;  // Mutex for state var
 struct termios orig_term, raw_term;
 char current_mode = 'e';  // 'e' -> echo, 'c' -> chat
 bool in_chat = false;
+bool in_room = false;
 
 // Reset terminal to original state
 void reset_terminal() {
@@ -39,7 +61,9 @@ void clear_current_line() {
 // Display the current input buffer
 void display_input_prompt() {
     pthread_mutex_lock(&state_mutex);
-    if (in_chat) {
+    if (in_room) {
+        printf("(Room) > %s", input_buffer);
+    } else if (in_chat) {
         printf("(Chat) > %s", input_buffer);
     } else {
         printf("(%s) > %s", current_mode == 'e' ? "Echo" : "Chat", input_buffer);
@@ -73,6 +97,12 @@ void* receive_messages(void* socket_ptr) {
         } else if (strstr(buffer, "Chat ended") != NULL || strstr(buffer, "has left the chat") != NULL) {
             in_chat = false;
         }
+        if (strstr(buffer, "Joined room") != NULL) {
+            in_room = true;
+            current_mode = 'c';
+        } else if (strstr(buffer, "Left room") != NULL || strstr(buffer, "Left the room") != NULL) {
+            in_room = false;
+        }
         pthread_mutex_unlock(&state_mutex);
         
         pthread_mutex_lock(&screen_mutex);
@@ -92,21 +122,268 @@ void send_message_to_server(int sock, const char* message) {
     send(sock, buffer, strlen(buffer), 0);
 }
 
+// A growable byte buffer for script mode's input, output and received bytes
+struct ByteBuf {
+    char* data;
+    size_t len;
+    size_t cap;
+};
+
+void buf_append(ByteBuf* b, const void* data, size_t len) {
+    if (b->len + len > b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 65536;
+        if (b->cap < b->len + len) b->cap = b->len + len;
+        b->data = (char*)realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+void buf_consume(ByteBuf* b, size_t len) {
+    memmove(b->data, b->data + len, b->len - len);
+    b->len -= len;
+}
+
+// A scripted command waiting for its first reply, indexed by its tag
+struct PendingCommand {
+    int seq;          // Script order, 0 while the tag is free
+    double sent_us;   // When the command was read and queued
+    char* text;
+};
+PendingCommand pending[TAG_COUNT];
+
+double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+void append_frame(ByteBuf* out, int op, unsigned tag, const char* data, size_t len) {
+    unsigned char header[BINARY_HEADER] = {
+        (unsigned char)op, 0, (unsigned char)(tag >> 8), (unsigned char)tag,
+        (unsigned char)(len >> 24), (unsigned char)(len >> 16), (unsigned char)(len >> 8), (unsigned char)len
+    };
+    buf_append(out, header, BINARY_HEADER);
+    buf_append(out, data, len);
+}
+
+// Print text on one line of the report: newlines and tabs escaped
+void print_escaped(const char* text, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (text[i] == '\n') fputs("\\n", stdout);
+        else if (text[i] == '\t') fputs("\\t", stdout);
+        else if (text[i] != '\r') putchar(text[i]);
+    }
+}
+
+void print_payload(int op, const char* body, size_t len) {
+    if (op == OP_ACK) {
+        fputs("(ok)", stdout);
+        return;
+    }
+    if (op == OP_ERROR) fputs("error: ", stdout);
+    if ((op == OP_WELCOME || op == OP_DELIVER || op == OP_USER) && len >= USER_ID_SIZE) {
+        unsigned long long id = 0;
+        for (int i = 0; i < USER_ID_SIZE; i++) id = id << 8 | (unsigned char)body[i];
+        printf("[%llu] ", id);
+        body += USER_ID_SIZE;
+        len -= USER_ID_SIZE;
+    }
+    print_escaped(body, len);
+}
+
+// Headless mode: log in over the binary protocol, then send the script's
+// lines as fast as they can be read, up to window of them unanswered, without
+// waiting for replies. One poll() loop reads the script, writes whatever is
+// queued in one send and matches replies to commands by tag. Prints a
+// tab-separated line per command: sequence number, round trip in
+// microseconds, command and its first reply; messages that answer nothing
+// (deliveries, room traffic, later parts of a reply) get "-" for the first
+// three columns. A summary goes to stderr.
+int run_script(int sock, const char* name, int in_fd, int window) {
+    ByteBuf in = {NULL, 0, 0}, out = {NULL, 0, 0}, rx = {NULL, 0, 0};
+    unsigned char magic = BINARY_MAGIC;
+    buf_append(&out, &magic, 1);
+    append_frame(&out, OP_HELLO, 0, name, strlen(name));
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    int nodelay = 1;  // Writes are already coalesced; Nagle would only hold back the tail of the script
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    bool logged_in = false, input_eof = false, closed = false;
+    int seq = 0, in_flight = 0;
+    unsigned tag = 0;
+    size_t rtt_count = 0, rtt_cap = 1024;
+    double* rtts = (double*)malloc(rtt_cap * sizeof(double));
+    double start_us = now_us(), last_rx_us = start_us;
+    char chunk[65536];
+
+    printf("seq\trtt_us\tcommand\treply\n");
+    while (!closed) {
+        // Frame every complete line the window has room for
+        while (logged_in && in_flight < window) {
+            char* newline = (char*)memchr(in.data, '\n', in.len);
+            if (!newline && !(input_eof && in.len)) break;
+            size_t used = newline ? newline - in.data + 1 : in.len;
+            size_t len = newline ? newline - in.data : in.len;
+            while (len > 0 && in.data[len - 1] == '\r') len--;
+            if (len > 0 && in.data[0] != '#') {
+                do tag = tag % (TAG_COUNT - 1) + 1; while (pending[tag].seq);
+                pending[tag].seq = ++seq;
+                pending[tag].sent_us = now_us();
+                pending[tag].text = strndup(in.data, len);
+                append_frame(&out, OP_MESSAGE, tag, in.data, len);
+                in_flight++;
+            }
+            buf_consume(&in, used);
+        }
+        if (logged_in && input_eof && in.len == 0 && in_flight == 0) break;
+
+        if (out.len) {
+            ssize_t n = send(sock, out.data, out.len, MSG_NOSIGNAL);
+            if (n > 0) buf_consume(&out, n);
+            else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("send");
+                break;
+            }
+        }
+
+        struct pollfd fds[2];
+        int nfds = 1;
+        fds[0].fd = sock;
+        fds[0].events = POLLIN | (out.len ? POLLOUT : 0);
+        if (logged_in && !input_eof && in_flight < window) {
+            fds[1].fd = in_fd;
+            fds[1].events = POLLIN;
+            nfds = 2;
+        }
+        int ready = poll(fds, nfds, 1000);
+        if (ready < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        double now = now_us();
+        if ((in_flight || !logged_in) && now - last_rx_us > SCRIPT_STALL_MS * 1000.0) {
+            fprintf(stderr, "No reply from the server for %d s\n", SCRIPT_STALL_MS / 1000);
+            break;
+        }
+        if (ready <= 0) continue;
+
+        if (nfds == 2 && fds[1].revents) {
+            ssize_t n = read(in_fd, chunk, sizeof(chunk));
+            if (n > 0) buf_append(&in, chunk, n);
+            else if (n == 0 || (errno != EAGAIN && errno != EINTR)) input_eof = true;
+        }
+        if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+        ssize_t n;
+        while ((n = recv(sock, chunk, sizeof(chunk), 0)) > 0) buf_append(&rx, chunk, n);
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) closed = true;
+        last_rx_us = now;
+
+        size_t pos = 0;
+        while (rx.len - pos >= BINARY_HEADER) {
+            const unsigned char* header = (const unsigned char*)rx.data + pos;
+            size_t len = (size_t)header[4] << 24 | header[5] << 16 | header[6] << 8 | header[7];
+            if (rx.len - pos < BINARY_HEADER + len) break;
+            int op = header[0];
+            unsigned reply_tag = header[2] << 8 | header[3];
+            const char* body = rx.data + pos + BINARY_HEADER;
+            pos += BINARY_HEADER + len;
+
+            if (!logged_in && op == OP_WELCOME) {
+                logged_in = true;
+                start_us = now;
+                continue;
+            }
+            if (!logged_in && op == OP_ERROR) {
+                fprintf(stderr, "Login failed: %.*s\n", (int)len, body);
+                closed = true;
+                break;
+            }
+            PendingCommand* cmd = &pending[reply_tag];
+            if (reply_tag && cmd->seq) {
+                double rtt = now - cmd->sent_us;
+                printf("%d\t%.1f\t", cmd->seq, rtt);
+                print_escaped(cmd->text, strlen(cmd->text));
+                putchar('\t');
+                if (rtt_count == rtt_cap) rtts = (double*)realloc(rtts, (rtt_cap *= 2) * sizeof(double));
+                rtts[rtt_count++] = rtt;
+                free(cmd->text);
+                cmd->seq = 0;
+                in_flight--;
+            } else {
+                fputs("-\t-\t-\t", stdout);
+            }
+            print_payload(op, body, len);
+            putchar('\n');
+        }
+        buf_consume(&rx, pos);
+    }
+    fflush(stdout);
+
+    double elapsed = (now_us() - start_us) / 1e6;
+    fprintf(stderr, "%d commands sent, %zu answered in %.3f s (%.0f commands/sec)\n",
+            seq, rtt_count, elapsed, elapsed > 0 ? rtt_count / elapsed : 0.0);
+    if (rtt_count) {
+        qsort(rtts, rtt_count, sizeof(double), compare_doubles);
+        double sum = 0;
+        for (size_t i = 0; i < rtt_count; i++) sum += rtts[i];
+        fprintf(stderr, "Round trip (us): mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n",
+                sum / rtt_count, rtts[rtt_count / 2], rtts[rtt_count * 90 / 100], rtts[rtt_count * 99 / 100],
+                rtts[rtt_count - 1]);
+    }
+    if (in_flight) fprintf(stderr, "%d commands unanswered\n", in_flight);
+    free(rtts);
+    free(in.data);
+    free(out.data);
+    free(rx.data);
+    return logged_in && input_eof && in_flight == 0 ? 0 : 1;
+}
+
 int main(int argc, char* argv[] ) {
     if(argc <= 1){
-        printf("Usage: %s <IP> <PORT>\n", argv[0]);
+        printf("Usage: %s <IP> [PORT] [--script FILE|-] [--name NAME] [--window N]\n", argv[0]);
         return 1;
     }
-    else if(argc == 3){
-        PORT=atoi(argv[2]);
+    const char* script = NULL;
+    const char* script_name = NULL;
+    int window = SCRIPT_WINDOW;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--script") == 0 && i + 1 < argc) {
+            script = argv[++i];
+        } else if (strcmp(argv[i], "--name") == 0 && i + 1 < argc) {
+            script_name = argv[++i];
+        } else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc) {
+            window = atoi(argv[++i]);
+            if (window < 1 || window > TAG_COUNT / 2) {
+                printf("--window must be between 1 and %d\n", TAG_COUNT / 2);
+                return 1;
+            }
+        } else if (argv[i][0] != '-') {
+            PORT=atoi(argv[i]);
+        } else {
+            printf("Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    int script_fd = -1;
+    if (script) {
+        script_fd = strcmp(script, "-") == 0 ? STDIN_FILENO : open(script, O_RDONLY);
+        if (script_fd < 0) {
+            perror(script);
+            return 1;
+        }
     }
     int sock;
     struct sockaddr_in server_addr;
     char name[50];
     pthread_t receive_thread;
     int c;
-    tcgetattr(STDIN_FILENO, &orig_term);
-    atexit(reset_terminal);
     
     sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock == -1) {
@@ -128,6 +405,16 @@ int main(int argc, char* argv[] ) {
         return -1;
     }
     
+    if (script) {
+        char default_name[32];
+        snprintf(default_name, sizeof(default_name), "script-%d", (int)getpid());
+        int status = run_script(sock, script_name ? script_name : default_name, script_fd, window);
+        close(sock);
+        return status;
+    }
+
+    tcgetattr(STDIN_FILENO, &orig_term);
+    atexit(reset_terminal);
     printf("Connected to server at %s\n", server_ip);
     
     // Get username
@@ -136,7 +423,7 @@ int main(int argc, char* argv[] ) {
         fgets(name, sizeof(name), stdin);
         name[strcspn(name, "\n")] = 0;
     
-        send(sock, name, strlen(name), 0);
+        send_message_to_server(sock, name);
     
         char response[BUFFER_SIZE];
         int res_bytes = recv(sock, response, BUFFER_SIZE - 1, 0);
@@ -169,7 +456,11 @@ int main(int argc, char* argv[] ) {
     printf("  /startecho - Switch to echo mode\n");
     printf("  /chat <name> - Request chat with another user\n");
     printf("  /exit - Leave chat\n");
+    printf("  /join <room> - Join a chat room\n");
+    printf("  /leave - Leave the room\n");
     printf("  /list - Show connected users and their modes\n");
+    printf("  /msg <name> <message> - Message a user, held for them if they are away\n");
+    printf("  /history <name> [n] - Show your last n messages with a user\n");
     printf("  /help - Show help\n");
     printf("  /quit - Quit application\n");
     
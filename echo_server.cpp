@@ -1,491 +1,4997 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <limits.h>
 #include <string.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include <time.h>
-#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <deque>
+#include <algorithm>
 #include <string>
+#include <atomic>
+#include <new>
 #include <iostream>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
 
 #define PORT 8989
-#define MAX_CLIENTS 5
+#define DEFAULT_MAX_CLIENTS 65536
 #define THREAD_POOL_SIZE 4
 #define BUFFER_SIZE 1024
+#define MAX_EVENTS 64
+#define DEFAULT_OUTPUT_HWM (4 << 20)  // Queued output bytes that trigger backpressure
+#define IOV_BATCH 64                 // Queued buffers handed to one sendmsg()
+#define URING_ENTRIES 1024           // Submission queue size per io_uring reactor
+#define URING_BUFS 1024              // Provided receive buffers per io_uring reactor
+#define URING_BUF_SIZE 4096
+#define SLAB_SHIFT 10                // 1024 connection slots per slab
+#define SLAB_SIZE (1 << SLAB_SHIFT)
+#define RESERVED_FDS 64              // Descriptors kept for listeners, epoll, logs
+#define DEFAULT_MAX_MESSAGE (1 << 20)  // Largest accepted message payload
+#define FRAME_HEADER 4               // Big-endian payload length in length-prefixed mode
+#define FRAME_LENGTH_MAGIC 0x00      // First byte that selects length-prefixed framing
+#define BINARY_MAGIC 0xFE            // First byte that selects the binary protocol (never starts UTF-8 text)
+#define BINARY_HEADER 8              // Opcode, flags, big-endian request tag and payload length
+#define BINARY_BATCH 0x01            // Header flag: payload is a run of (4-byte length, message) items
+#define BINARY_COMPRESSED 0x02       // Header flag: payload is the 4-byte raw length, then the compressed message
+#define DEFAULT_COMPRESS_MIN 512     // Smaller payloads are sent as they are
+#define ZSTD_LEVEL 1                 // Fastest zstd level: chat text still shrinks severalfold
+#define TLS_RECORD_MAX 16384         // Most plaintext one TLS record carries
+#define TLS_TICKET_KEYS 80           // Session ticket key material, as OpenSSL hands it out and takes it back
+#define USER_ID_SIZE 8               // Big-endian user id that some binary payloads start with
+#define MAX_ROOM_NAME 64             // Longest room name /join accepts
+#define NAME_SHARDS 64               // Name registry shards (power of two), each with its own lock
+#define SNAPSHOT_RETRIES 3           // Attempts at a point-in-time copy of the registry
+#define LIST_PAGE_SIZE 100           // Users per page of a filtered /list
+#define LOG_FILE "server_log.txt"
+#define LOG_RING_SIZE 4096           // Slots in the async log ring (power of two)
+#define LOG_LINE_MAX 1024            // Longer log lines are truncated
+#define LOG_BATCH_LINES 256          // Writer is woken after this many lines
+#define LOG_FLUSH_MS 50              // ...or after this long, whichever comes first
+#define DEFAULT_METRICS_PORT 8990    // Prometheus text endpoint, bound to 127.0.0.1
+#define METRIC_SLOTS 256             // Threads with private counters; later ones share the last
+#define SERVICE_BUCKETS 22           // Service-time histogram: 1us .. ~2s in powers of two
+#define TIMER_TICK_MS 100            // Timer wheel resolution
+#define WHEEL_BITS 8                 // Inner wheel: 256 ticks (25.6 s)...
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_OUTER_SLOTS 64         // ...outer wheel: 64 x 25.6 s; later timers wait in its last slot
+#define DEFAULT_HANDSHAKE_TIMEOUT 30 // Seconds a new connection has to send its name
+#define NAME_QUIET_MS 500            // An unterminated name is taken once this long passes with nothing more
+#define DEFAULT_IDLE_TIMEOUT 0       // Seconds without traffic before a client is dropped (0 = never)
+#define DEFAULT_WRITE_STALL_TIMEOUT 30  // Seconds queued output may sit without draining
+#define POOL_MIN_SHIFT 6             // Smallest pooled buffer: 64 bytes
+#define POOL_CLASSES 7               // Pooled buffer sizes 64 bytes .. 4 KiB, in powers of two
+#define POOL_MAIL POOL_CLASSES       // One more pool list, for mail items
+#define POOL_LISTS (POOL_CLASSES + 1)
+#define POOL_CACHE_MAX 256           // Free blocks a thread keeps per list...
+#define POOL_BATCH 64                // ...and moves to or from the shared depot at a time
+#define POOL_DEPOT_MAX 64            // Batches the depot keeps per list; more are freed
+#define IP_SHARDS 64                 // Per-address rate limit shards (power of two)
+#define BUSY_MESSAGE "Server busy, try again later.\n"  // Sent to connections shed at accept
+#define DEFAULT_HANDOFF_PATH "echo_server.handoff"  // Unix socket a new server connects to for a hot restart
+#define HANDOFF_MAGIC 0x45434834     // "ECH4": first word of a takeover request
+#define HANDOFF_FDS_PER_MSG 250      // Descriptors per SCM_RIGHTS message (the kernel allows 253)
+#define HANDOFF_TIMEOUT 10           // Seconds the old server waits on its successor before resuming
+#define HANDOFF_ACK 'A'              // New server: every session is restored
+#define HANDOFF_BYE 'B'              // Old server: the sockets are yours, exiting
+#define HISTORY_SEGMENT_SIZE (64 << 20)  // Bytes per memory-mapped history segment file
+#define HISTORY_MAGIC 0x52545348     // "HSTR": first word of every complete history record
+#define HISTORY_REPLAY_DEFAULT 20    // Messages /history shows when no count is given...
+#define HISTORY_REPLAY_MAX 1000      // ...and the most it shows at once
+#define HISTORY_PENDING_MAX 1000     // Offline messages held per user; more are refused until they connect
 
 using namespace std;
 
-sem_t client_semaphore;               // Semaphore to limit concurrent clients
+atomic<int> admitted_clients(0);     // Connections holding one of the max_clients slots
 pthread_mutex_t log_mutex;           // Mutex for thread-safe logging
-pthread_mutex_t name_mutex;          // Mutex for name access
-pthread_mutex_t clients_mutex;       // Mutex for clients array access
+pthread_mutex_t clients_mutex;       // Mutex for connection table access
+pthread_mutex_t rooms_mutex;         // Mutex for the room directory
+pthread_mutex_t history_mutex;       // Mutex for the history store
 
-int client_queue[100];               // Queue to hold client sockets
-int front = 0, rear = 0;             // Queue pointers
-pthread_mutex_t queue_mutex;         // Mutex for queue access
-pthread_cond_t queue_cond;           // Condition variable for queue
+// Payload compression a binary client can ask for with OP_COMPRESS. Which
+// codecs exist depends on the build: make COMPRESSION="lz4 zstd"
+enum Codec {
+    CODEC_NONE,
+    CODEC_LZ4,
+    CODEC_ZSTD,
+    CODEC_COUNT
+};
 
-// Structure to store client information
-typedef struct {
+const char* codec_names[CODEC_COUNT] = { "none", "lz4", "zstd" };
+
+// Immutable, reference-counted bytes; one copy can sit in many output queues
+struct SharedBuf {
+    atomic<int> refs;
+    int block;                       // Pool size class of the allocation, -1 if it was malloc'd to size
+    size_t len;
+    atomic<SharedBuf*> packed[CODEC_COUNT - 1];  // Compressed form per codec, made on first use
+    char data[1];                    // Allocated to len bytes
+};
+
+// How messages are delimited, chosen by the first byte the client sends
+enum Framing {
+    FRAMING_UNKNOWN,   // Nothing received yet
+    FRAMING_NEWLINE,   // Text lines ending in '\n' (interactive clients)
+    FRAMING_LENGTH,    // 4-byte big-endian length, then the payload
+    FRAMING_BINARY,    // Binary protocol: opcode, flags and length, see BinaryOp
+    FRAMING_COUNT
+};
+
+// Binary protocol opcodes (-> client to server, <- server to client). An id
+// is a user's ConnRef, 8 bytes big-endian: finding the user it names is a
+// slot lookup and a generation check, with no lock and no name hashing.
+enum BinaryOp {
+    OP_HELLO = 1,      // -> name        Log in; the first frame, instead of the name line
+    OP_WELCOME,        // <- id          Logged in, with the client's own id
+    OP_MESSAGE,        // <> text        A text-protocol line: echoed back, relayed, broadcast, or a command
+    OP_SEND,           // -> id, text    Message one user by id, in any mode
+    OP_DELIVER,        // <- id, text    A message from another user
+    OP_LOOKUP,         // -> name        Ask for a user's id...
+    OP_USER,           // <- id, name    ...id 0 if nobody has that name
+    OP_TEXT,           // <- text        Any other reply or notice
+    OP_ERROR,          // <- text        A request was refused
+    OP_ACK,            // <- (empty)     A tagged request was handled and had nothing else to say
+    OP_COMPRESS        // <> codecs      Before OP_HELLO: codec ids in order of preference; the reply
+                       //                holds the one chosen, or nothing if none is available
+};
+
+struct Room;
+
+// Message handed to another reactor for delivery on its own thread
+struct MailItem {
+    MailItem* next;
+    int socket;
+    uint32_t gen;                    // Connection generation the mail is meant for; for a new socket, 1 if it is TLS
+    SharedBuf* buf;                  // Already framed for the receiver; NULL hands over a new socket
+    Room* room;                      // Room broadcast to this reactor's members instead...
+    SharedBuf* framed[FRAMING_COUNT];  // ...each getting the copy for its framing
+};
+
+// Lock-free multi-producer, single-consumer mailbox (one per reactor)
+struct Mailbox {
+    atomic<MailItem*> head;
+};
+
+struct Connection;
+struct Uring;
+struct TimerWheel;
+struct Conversation;
+
+// How reactors wait for and perform socket I/O
+enum IoBackend {
+    IO_EPOLL,     // Readiness notification, non-blocking recv/sendmsg
+    IO_URING      // Completion-based: multishot accept/recv, batched sendmsg submissions
+};
+
+// One event loop thread: its epoll instance, optional listener and mailbox
+struct Reactor {
+    int index;
+    int epoll_fd;
+    int listen_fd;                   // -1 when main() accepts on its behalf
+    int wake_fd;                     // eventfd signalled when mail arrives
+    Mailbox mailbox;
+    vector<Connection*> dirty;       // Connections with output to flush this iteration
+    Uring* uring;                    // io_uring state when io_backend == IO_URING
+    TimerWheel* timers;              // Handshake, idle and write-stall timeouts of its connections
+    uint64_t now_ms;                 // Monotonic clock, read once per loop iteration
+    pthread_t thread;
+};
+
+Reactor* reactors;                   // All event loops
+int reactor_count = THREAD_POOL_SIZE;
+bool reuseport_mode = false;         // --reactors: each reactor accepts on its own socket
+bool pin_reactors = false;           // --pin: bind reactor i to CPU i
+int next_loop = 0;                   // Round-robin cursor for new connections
+__thread Reactor* current_reactor = NULL;  // Reactor owning the calling thread
+IoBackend io_backend = IO_EPOLL;     // --io epoll|uring
+
+// Hot restart: main() sets handoff_pending and waits until every reactor has
+// parked, hands the sockets over, then exits or releases the reactors
+const char* handoff_path = DEFAULT_HANDOFF_PATH;  // --handoff-path ("" disables)
+bool takeover = false;               // --takeover: start by taking over the server on handoff_path
+atomic<bool> handoff_pending(false);
+int parked_reactors = 0;             // Guarded by handoff_mutex
+pthread_mutex_t handoff_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t handoff_cond = PTHREAD_COND_INITIALIZER;
+uint64_t takeover_us = 0;            // How long the takeover that started this process kept clients waiting
+
+int max_clients = DEFAULT_MAX_CLIENTS;  // --max-clients: concurrent connection limit
+size_t max_message = DEFAULT_MAX_MESSAGE;  // --max-message: payload size limit
+bool echo_fast_path = false;         // --echo-path fast: echo straight from the input buffer
+size_t output_hwm = DEFAULT_OUTPUT_HWM;  // --output-hwm: per-connection output backpressure
+size_t compress_min = DEFAULT_COMPRESS_MIN;  // --compress-min: smallest payload worth compressing
+
+// TLS listener, in builds made with make TLS=1. main() accepts on it and
+// hands each socket to a reactor, which runs the handshake as the socket
+// becomes ready; after that a TLS client speaks every protocol a plaintext
+// one does.
+int tls_port = 0;                    // --tls-port: 0 leaves TLS off
+const char* tls_cert = NULL;         // --tls-cert, --tls-key: PEM files
+const char* tls_key = NULL;
+bool ktls_enabled = true;            // --ktls: let the kernel take over the record layer where it can
+int tls_listen_fd = -1;
+#ifdef HAVE_OPENSSL
+SSL_CTX* tls_ctx = NULL;             // Shared by every TLS client
+#endif
+
+// Rate limits, in units per second; 0 leaves that limit off
+double accept_rate = 0;              // --accept-rate: new connections, shared by the accepting threads
+double client_msg_rate = 0;          // --client-msg-rate: messages from one connection
+double client_byte_rate = 0;         // --client-byte-rate: bytes from one connection
+double ip_msg_rate = 0;              // --ip-msg-rate: messages from all connections of one address
+double ip_byte_rate = 0;             // --ip-byte-rate: bytes from all connections of one address
+
+// Connection states for the per-client state machine
+enum ConnState {
+    CONN_NAME,    // Waiting for the client to pick a unique name
+    CONN_ACTIVE   // Name registered; messages handled in echo or chat mode
+};
+
+// Growable receive buffer; bytes in [start, end) are not yet parsed
+struct InputBuffer {
+    char* data;                      // NULL while the connection is idle
+    size_t start;
+    size_t end;
+    size_t cap;
+    size_t scanned;                  // Bytes after start already searched for '\n'
+};
+
+// A complete message parsed in place; both views point into the input buffer
+struct MsgView {
+    const char* data;                // Payload
+    size_t len;
+    const char* frame;               // Payload with its framing, exactly as received; NULL inside a batch
+    size_t frame_len;                // Bytes the message took up in the input
+    int op;                          // BinaryOp; always OP_MESSAGE with the text framings
+    unsigned tag;                    // Binary request tag, 0 if untagged (batch items always are)
+};
+
+// Bytes borrowed from elsewhere, usually the input buffer. Commands are
+// matched on these, so a message is never copied just to be looked at.
+struct StrView {
+    const char* data;
+    size_t len;
+};
+
+inline StrView str_view(const char* data, size_t len) {
+    StrView v = { data, len };
+    return v;
+}
+
+inline StrView str_view(const string& s) {
+    return str_view(s.data(), s.size());
+}
+
+template <size_t N> inline StrView str_view(const char (&literal)[N]) {
+    return str_view(literal, N - 1);
+}
+
+// A message without its trailing whitespace
+inline StrView trimmed_view(const char* data, size_t len) {
+    while (len > 0 && (data[len - 1] == '\n' || data[len - 1] == '\r' || data[len - 1] == ' ' || data[len - 1] == '\t')) {
+        len--;
+    }
+    return str_view(data, len);
+}
+
+template <size_t N> inline bool view_is(StrView v, const char (&literal)[N]) {
+    return v.len == N - 1 && memcmp(v.data, literal, N - 1) == 0;
+}
+
+template <size_t N> inline bool view_starts(StrView v, const char (&prefix)[N]) {
+    return v.len >= N - 1 && memcmp(v.data, prefix, N - 1) == 0;
+}
+
+// "/cmd" alone or followed by a space and arguments
+template <size_t N> inline bool is_command(StrView v, const char (&name)[N]) {
+    return view_starts(v, name) && (v.len == N - 1 || v.data[N - 1] == ' ');
+}
+
+// Everything after the first n bytes; only the rarer commands keep a copy
+inline string view_tail(StrView v, size_t n) {
+    return n < v.len ? string(v.data + n, v.len - n) : string();
+}
+
+// A queued buffer and how much of it has already been written
+struct OutChunk {
+    SharedBuf* buf;
+    size_t offset;
+};
+
+// Per-connection output queue (ring of chunks), touched only by the owning reactor
+struct OutQueue {
+    OutChunk* items;
+    unsigned head;
+    unsigned count;
+    unsigned cap;
+    atomic<size_t> bytes;            // Unsent bytes; read by other reactors for backpressure
+};
+
+// A connection as (generation << 32) | socket; 0 means none. Slots are never
+// freed, so a ref can be resolved safely even after its client has left.
+typedef uint64_t ConnRef;
+
+// Timer wheel entry, embedded in each connection
+struct TimerNode {
+    TimerNode* prev;                 // NULL while not armed
+    TimerNode* next;
+    uint64_t expires;                // Tick it fires on
+    Connection* conn;
+};
+
+// Token bucket holding at most one second's worth of its rate. A charge may
+// overdraw it; the owner then stops reading until the debt is paid off.
+struct TokenBucket {
+    double tokens;
+    uint64_t stamp_ms;               // Clock at the last refill
+};
+
+// Refill for the time since the last charge, then take n tokens. Returns how
+// many milliseconds until the bucket is out of debt, 0 if it is not in debt.
+uint64_t bucket_charge(TokenBucket* b, double rate, uint64_t now_ms, double n) {
+    if (rate <= 0) return 0;
+    if (now_ms > b->stamp_ms) {
+        b->tokens = min(rate, b->tokens + rate * (now_ms - b->stamp_ms) / 1000);
+        b->stamp_ms = now_ms;
+    }
+    b->tokens -= n;
+    return b->tokens < 0 ? (uint64_t)(-b->tokens * 1000 / rate) + 1 : 0;
+}
+
+// Buckets shared by every connection from one source address
+struct IpLimit {
+    uint32_t addr;                   // IPv4, network byte order
+    int conns;                       // Connections holding this entry
+    TokenBucket msg_tokens;          // Guarded by the shard lock
+    TokenBucket byte_tokens;
+    atomic<uint64_t> paused_until;   // Clock at which the address is out of debt, read without the lock
+};
+
+// One shard of the per-address limits; charges and lookups take its lock
+struct alignas(64) IpShard {
+    pthread_mutex_t lock;
+    unordered_map<uint32_t, IpLimit*> addrs;
+};
+
+IpShard ip_shards[IP_SHARDS];
+
+// Per-connection state, owned by the event loop the socket is registered with
+struct Connection {
+    int socket;
+    uint32_t gen;                    // Bumped each time the slot is reused
+    bool in_use;
+    ConnState state;
+    atomic<char> mode;               // 'e' -> echo, 'c' -> chat; written only by the owning reactor
+    string name;
+    Reactor* reactor;
+    Framing framing;
+    int batch_op;                    // Binary batch being parsed: its opcode...
+    size_t batch_left;               // ...and bytes of it not yet parsed
+    Codec codec;                     // Negotiated with OP_COMPRESS; CODEC_NONE for most clients
+    void* codec_state;               // Its compression context, made on first use
+    struct ssl_st* tls;              // OpenSSL session of a --tls-port client; NULL for plaintext ones
+    bool tls_handshaking;            // TLS: no application data until the handshake finishes
+    bool tls_kernel_send;            // TLS: kTLS encrypts writes, so output goes out with plain sendmsg()
+    InputBuffer in;
+    OutQueue out;
+    bool flush_queued;               // Already on the reactor's dirty list
+    bool read_paused;                // Output above output_hwm; stop reading until it drains
+    bool recv_armed;                 // io_uring: multishot recv outstanding
+    bool send_inflight;              // io_uring: a sendmsg is outstanding
+    atomic<ConnRef> peer;            // Chat partner; claimed by either side with a CAS
+    Room* room;                      // Chat room joined with /join, or NULL
+    int room_slot;                   // Index in the room's member list for our reactor
+    TimerNode timer;                 // Armed for the earliest timeout that applies
+    uint64_t opened_ms;              // Reactor clock when the connection was registered...
+    uint64_t input_ms;               // ...when it last sent us anything...
+    uint64_t output_ms;              // ...and when its output last drained or started queueing
+    TokenBucket msg_tokens;          // --client-msg-rate
+    TokenBucket byte_tokens;         // --client-byte-rate
+    IpLimit* ip;                     // Shared buckets for the source address, or NULL
+    uint64_t throttled_until;        // Reads paused by a rate limit until then; 0 when not throttled
+    ConnRef history_peer;            // Chat partner the two fields below were looked up for
+    string history_partner;          // ...its name
+    Conversation* history_conv;      // ...and the conversation relays to it are recorded in
+};
+
+// Two-level hashed timer wheel, one per reactor. Arming, re-arming and
+// cancelling are O(1) list splices; each tick fires one inner slot, and
+// every 256 ticks one outer slot is spread back over the inner wheel.
+struct TimerWheel {
+    uint64_t now;                    // Last tick processed
+    int armed;                       // Timers in the wheel
+    TimerNode inner[WHEEL_SLOTS];    // List heads
+    TimerNode outer[WHEEL_OUTER_SLOTS];
+};
+
+// Why the timer wheel closed a connection
+enum TimeoutReason { TIMEOUT_HANDSHAKE, TIMEOUT_IDLE, TIMEOUT_WRITE_STALL, TIMEOUT_COUNT };
+const char* timeout_names[TIMEOUT_COUNT] = { "handshake", "idle", "write_stall" };
+
+uint64_t handshake_timeout_ms = DEFAULT_HANDSHAKE_TIMEOUT * 1000;      // --handshake-timeout
+uint64_t idle_timeout_ms = DEFAULT_IDLE_TIMEOUT * 1000;                // --idle-timeout
+uint64_t write_stall_timeout_ms = DEFAULT_WRITE_STALL_TIMEOUT * 1000;  // --write-stall-timeout
+
+// Connection slots indexed by socket, allocated one slab at a time.
+// Slabs never move once allocated, so a slot address stays valid for the
+// life of the server and lookups are a shift and a mask.
+struct ConnTable {
+    atomic<Connection*>* slabs;      // slab_count entries, NULL until first use
+    int slab_count;
+    int client_count;
+};
+
+ConnTable conn_table;
+uint32_t gen_floor = 0;              // Hot restart: generations start above the old server's, so a
+                                     // user id it handed out never names one of our clients
+
+// A room's members on one reactor, read and written only by that reactor
+struct RoomShard {
+    vector<Connection*> members;
+    atomic<int> count;               // members.size(), for other reactors deciding whether to post
+};
+
+// A chat room. Members are sharded by the reactor that owns them, so joining,
+// leaving and fan-out never take a lock. Every member and every broadcast
+// still in another reactor's mailbox holds a reference; the last one to go
+// frees the room.
+struct Room {
+    string name;
+    RoomShard* shards;               // One per reactor
+    atomic<int> refs;
+};
+
+unordered_map<string, Room*> rooms;  // Room directory, guarded by rooms_mutex
+
+// One shard of the name registry; a name lives in the shard its hash selects
+struct alignas(64) NameShard {
+    pthread_mutex_t lock;
+    unordered_map<string, ConnRef> names;
+};
+
+NameShard name_shards[NAME_SHARDS];
+atomic<uint64_t> registry_version(0);  // Bumped when a name comes or goes or a client switches mode
+
+// The /list reply as of one registry version, serialized once and shared by
+// every /list until something changes
+struct UserList {
+    atomic<int> refs;
+    uint64_t version;
+    vector<string> names;            // Sorted
+    vector<string> lines;            // "\n  name (mode)" for each of names
+    SharedBuf* full[FRAMING_COUNT];  // Complete reply, framed for each framing
+};
+
+UserList* user_list = NULL;          // Current snapshot, swapped under list_mutex
+atomic<bool> list_rebuilding(false); // One reactor rebuilds; the others serve the previous one
+pthread_mutex_t list_mutex;
+
+// How log_event() reaches server_log.txt
+enum LogMode {
+    LOG_ASYNC,    // Copy into a lock-free ring; a writer thread batches to disk
+    LOG_SYNC,     // Open, write and close the file under log_mutex on every event
+    LOG_OFF
+};
+
+// One queued log line; seq implements the bounded MPMC ring protocol
+struct LogSlot {
+    atomic<size_t> seq;
+    time_t when;
+    int len;
+    char text[LOG_LINE_MAX];
+};
+
+// Lock-free multi-producer ring drained by the log writer thread
+struct LogRing {
+    LogSlot* slots;
+    atomic<size_t> head;             // Next slot producers claim
+    size_t tail;                     // Next slot the writer reads (writer only)
+    atomic<size_t> flushed;          // Lines written and flushed to the file so far
+    atomic<unsigned long> dropped;   // Lines lost to a full ring in drop mode
+    int wake_fd;                     // eventfd that wakes the writer early
+    pthread_t writer;
+};
+
+LogMode log_mode = LOG_ASYNC;        // --log-mode async|sync|off
+bool log_block_when_full = false;    // --log-overflow block|drop
+LogRing log_ring;
+
+// Slash commands: indexes command_table and the per-command metrics
+enum MetricCommand {
+    CMD_LIST, CMD_HELP, CMD_STARTCHAT, CMD_STARTECHO, CMD_CHAT, CMD_EXIT, CMD_JOIN, CMD_LEAVE, CMD_MSG, CMD_HISTORY, CMD_COUNT
+};
+
+// What a client was doing when it sent a message
+enum MetricMode { MODE_NAME, MODE_ECHO, MODE_CHAT, MODE_ROOM, MODE_COUNT };
+const char* mode_names[MODE_COUNT] = { "name", "echo", "chat", "room" };
+
+// Mutexes whose contention is tracked
+enum MetricLock { LOCK_NAME, LOCK_CLIENTS, LOCK_LOG, LOCK_ROOMS, LOCK_LIST, LOCK_POOL, LOCK_IP, LOCK_HISTORY, LOCK_COUNT };
+const char* lock_names[LOCK_COUNT] = { "name_registry", "clients_mutex", "log_mutex", "rooms_mutex", "list_mutex", "buffer_pool",
+                                       "ip_limits", "history" };
+
+// Why admission control turned a new connection away
+enum RejectReason { REJECT_MAX_CLIENTS, REJECT_ACCEPT_RATE, REJECT_COUNT };
+const char* reject_names[REJECT_COUNT] = { "max_clients", "accept_rate" };
+
+// How a TLS handshake on --tls-port ended
+enum TlsResult { TLS_FULL, TLS_RESUMED, TLS_FAILED, TLS_RESULT_COUNT };
+const char* tls_result_names[TLS_RESULT_COUNT] = { "full", "resumed", "failed" };
+
+// Which rate limit paused a connection's reads
+enum ThrottleScope { THROTTLE_CLIENT, THROTTLE_IP, THROTTLE_COUNT };
+const char* throttle_names[THROTTLE_COUNT] = { "client", "ip" };
+
+// Counters owned by one thread and summed only when scraped. Each block
+// starts on its own cache line and has a single writer, so updates are a
+// plain load and store: no locked instructions and no shared lines.
+struct alignas(64) ThreadMetrics {
+    atomic<uint64_t> accepts;
+    atomic<uint64_t> rejects[REJECT_COUNT];      // Turned away by admission control
+    atomic<uint64_t> handoffs_posted;            // Sockets main() mailed to a reactor...
+    atomic<uint64_t> handoffs_taken;             // ...and reactors registered
+    atomic<uint64_t> opened;
+    atomic<uint64_t> closed;
+    atomic<uint64_t> bytes_in;
+    atomic<uint64_t> bytes_out;
+    atomic<uint64_t> room_deliveries;            // Room messages queued to a member
+    atomic<uint64_t> room_drops;                 // ...or skipped because the member is backlogged
+    atomic<uint64_t> heap_allocs;                // operator new plus the server's own malloc calls
+    atomic<uint64_t> timeouts[TIMEOUT_COUNT];    // Connections closed by the timer wheel
+    atomic<uint64_t> throttles[THROTTLE_COUNT];  // Times a rate limit paused a connection's reads
+    atomic<uint64_t> history_appends;            // Records written to the history store
+    atomic<uint64_t> history_replayed;           // Stored messages sent back by /history or on reconnect
+    atomic<uint64_t> packed_raw;                 // Payload bytes handed to a compressor...
+    atomic<uint64_t> packed_wire;                // ...and the bytes sent in their place
+    atomic<uint64_t> codec_ns[2];                // Time spent compressing and decompressing
+    atomic<uint64_t> tls_handshakes[TLS_RESULT_COUNT];
+    atomic<uint64_t> tls_handshake_ms;           // Accept to a finished TLS handshake, summed
+    atomic<uint64_t> ktls[2];                    // Handshakes after which the kernel took over sending, receiving
+    atomic<uint64_t> messages[MODE_COUNT];
+    atomic<uint64_t> commands[CMD_COUNT];
+    atomic<uint64_t> lock_acquired[LOCK_COUNT];
+    atomic<uint64_t> lock_contended[LOCK_COUNT];
+    atomic<uint64_t> lock_wait_ns[LOCK_COUNT];
+    atomic<uint64_t> service_ns[MODE_COUNT];
+    atomic<uint64_t> service_buckets[MODE_COUNT][SERVICE_BUCKETS + 1];  // Last one is +Inf
+};
+
+ThreadMetrics metric_slots[METRIC_SLOTS];
+atomic<int> metric_slot_count(0);
+__thread ThreadMetrics* thread_metrics = NULL;
+#ifdef ALLOC_COUNT
+__thread bool allocations_untracked = false;  // Set by the metrics thread, whose scrapes are not client work
+#endif
+int metrics_port = DEFAULT_METRICS_PORT;  // --metrics-port: 0 disables the endpoint
+
+// The calling thread's counters, claimed on first use
+ThreadMetrics* metrics() {
+    if (!thread_metrics) {
+        int slot = metric_slot_count.fetch_add(1, memory_order_relaxed);
+        thread_metrics = &metric_slots[slot < METRIC_SLOTS ? slot : METRIC_SLOTS - 1];
+    }
+    return thread_metrics;
+}
+
+// Add to one of the calling thread's counters. A private slot has a single
+// writer, so a plain load and store will do; the shared last slot needs a
+// real atomic add or its threads lose each other's updates.
+inline void metric_add(atomic<uint64_t>& counter, uint64_t n) {
+    if ((const char*)&counter >= (const char*)&metric_slots[METRIC_SLOTS - 1]) {
+        counter.fetch_add(n, memory_order_relaxed);
+    } else {
+        counter.store(counter.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+}
+
+inline void count_command(MetricCommand cmd) {
+    metric_add(metrics()->commands[cmd], 1);
+}
+
+// malloc() that shows up in echo_heap_allocations_total. Counting is for
+// checking the allocation-free paths (make ALLOC_COUNT=1); other builds
+// call malloc directly.
+inline void* counted_malloc(size_t bytes) {
+#ifdef ALLOC_COUNT
+    if (!allocations_untracked) metric_add(metrics()->heap_allocs, 1);
+#endif
+    return malloc(bytes);
+}
+
+inline void* counted_realloc(void* data, size_t bytes) {
+#ifdef ALLOC_COUNT
+    if (!allocations_untracked) metric_add(metrics()->heap_allocs, 1);
+#endif
+    return realloc(data, bytes);
+}
+
+#ifdef ALLOC_COUNT
+// Every std::string and container growth is counted too, so a message path
+// that allocates cannot hide behind the library
+void* operator new(size_t size) {
+    void* p = counted_malloc(size ? size : 1);
+    if (!p) throw bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+#endif
+
+uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Lock a tracked mutex; the clock is only read when someone else holds it
+void lock_mutex(pthread_mutex_t* mutex, MetricLock which) {
+    ThreadMetrics* m = metrics();
+    metric_add(m->lock_acquired[which], 1);
+    if (pthread_mutex_trylock(mutex) == 0) return;
+    uint64_t start = monotonic_ns();
+    pthread_mutex_lock(mutex);
+    metric_add(m->lock_contended[which], 1);
+    metric_add(m->lock_wait_ns[which], monotonic_ns() - start);
+}
+
+// Count a handled message and how long it took; bucket b holds times up to 2^b us
+void record_service(MetricMode mode, uint64_t ns) {
+    ThreadMetrics* m = metrics();
+    uint64_t us = (ns + 999) / 1000;
+    int bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if (bucket > SERVICE_BUCKETS) bucket = SERVICE_BUCKETS;
+    metric_add(m->messages[mode], 1);
+    metric_add(m->service_ns[mode], ns);
+    metric_add(m->service_buckets[mode][bucket], 1);
+}
+
+// Write one timestamped line the slow way (LOG_SYNC mode)
+void log_event_sync(const char* msg) {
+    lock_mutex(&log_mutex, LOCK_LOG);
+    FILE* log_file = fopen(LOG_FILE, "a");
+    if (log_file) {
+        time_t now = time(NULL);
+        char time_str[32];
+        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", localtime(&now));
+        fprintf(log_file, "[%s] %s\n", time_str, msg);
+        fclose(log_file);
+    }
+    pthread_mutex_unlock(&log_mutex);
+}
+
+void log_event(const char* msg) {
+    if (log_mode == LOG_OFF) return;
+    if (log_mode == LOG_SYNC) {
+        log_event_sync(msg);
+        return;
+    }
+
+    // Claim a slot; only the copy below happens on the caller's thread
+    LogSlot* slot;
+    size_t pos = log_ring.head.load(memory_order_relaxed);
+    while (1) {
+        slot = &log_ring.slots[pos & (LOG_RING_SIZE - 1)];
+        size_t seq = slot->seq.load(memory_order_acquire);
+        if (seq == pos) {
+            if (log_ring.head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+        } else if (seq < pos) {
+            // Ring is full
+            if (!log_block_when_full) {
+                log_ring.dropped.fetch_add(1, memory_order_relaxed);
+                return;
+            }
+            sched_yield();
+            pos = log_ring.head.load(memory_order_relaxed);
+        } else {
+            pos = log_ring.head.load(memory_order_relaxed);
+        }
+    }
+
+    slot->when = time(NULL);
+    size_t len = strlen(msg);
+    if (len >= LOG_LINE_MAX) len = LOG_LINE_MAX - 1;
+    memcpy(slot->text, msg, len);
+    slot->len = (int)len;
+    slot->seq.store(pos + 1, memory_order_release);
+
+    if ((pos & (LOG_BATCH_LINES - 1)) == LOG_BATCH_LINES - 1) {
+        uint64_t one = 1;
+        if (write(log_ring.wake_fd, &one, sizeof(one)) < 0) {}
+    }
+}
+
+// Background writer: keeps the log open and flushes in batches
+void* log_writer(void* arg) {
+    FILE* log_file = fopen(LOG_FILE, "a");
+    if (!log_file) {
+        perror("Could not open " LOG_FILE);
+        return NULL;
+    }
+    setvbuf(log_file, NULL, _IOFBF, 1 << 16);
+
+    time_t stamp_time = 0;
+    char time_str[32] = "";
+    unsigned long reported_drops = 0;
+    while (1) {
+        struct pollfd pfd = { log_ring.wake_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, LOG_FLUSH_MS) > 0) {
+            uint64_t count;
+            if (read(log_ring.wake_fd, &count, sizeof(count)) < 0) {}
+        }
+
+        while (1) {
+            LogSlot* slot = &log_ring.slots[log_ring.tail & (LOG_RING_SIZE - 1)];
+            if (slot->seq.load(memory_order_acquire) != log_ring.tail + 1) break;
+            if (slot->when != stamp_time) {
+                stamp_time = slot->when;
+                strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", localtime(&stamp_time));
+            }
+            fprintf(log_file, "[%s] %.*s\n", time_str, slot->len, slot->text);
+            slot->seq.store(log_ring.tail + LOG_RING_SIZE, memory_order_release);
+            log_ring.tail++;
+        }
+
+        unsigned long dropped = log_ring.dropped.load(memory_order_relaxed);
+        if (dropped != reported_drops) {
+            fprintf(log_file, "[%s] %lu log lines dropped (ring full)\n", time_str, dropped - reported_drops);
+            reported_drops = dropped;
+        }
+        fflush(log_file);
+        log_ring.flushed.store(log_ring.tail, memory_order_release);
+    }
+    return NULL;
+}
+
+// Allocate the log ring and start the writer thread (LOG_ASYNC mode)
+void start_logger() {
+    if (log_mode != LOG_ASYNC) return;
+    log_ring.slots = new LogSlot[LOG_RING_SIZE];
+    for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+        log_ring.slots[i].seq.store(i, memory_order_relaxed);
+    }
+    log_ring.head.store(0);
+    log_ring.tail = 0;
+    log_ring.dropped.store(0);
+    log_ring.flushed.store(0);
+    log_ring.wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (log_ring.wake_fd < 0 || pthread_create(&log_ring.writer, NULL, log_writer, NULL) != 0) {
+        perror("Log writer setup failed");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Wait until every line logged so far is in the file, before exiting
+void flush_log() {
+    if (log_mode != LOG_ASYNC) return;
+    size_t target = log_ring.head.load(memory_order_acquire);
+    uint64_t one = 1;
+    if (write(log_ring.wake_fd, &one, sizeof(one)) < 0) {}
+    while (log_ring.flushed.load(memory_order_acquire) < target) {
+        usleep(1000);
+    }
+}
+
+// Put a socket into non-blocking mode
+int set_nonblocking(int socket) {
+    int flags = fcntl(socket, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(socket, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Size the connection table for every descriptor the process may open
+void conn_table_init(int max_fds) {
+    conn_table.slab_count = (max_fds + SLAB_SIZE - 1) >> SLAB_SHIFT;
+    conn_table.slabs = new atomic<Connection*>[conn_table.slab_count];
+    for (int i = 0; i < conn_table.slab_count; i++) {
+        conn_table.slabs[i].store(NULL);
+    }
+    conn_table.client_count = 0;
+}
+
+// Slot for a socket, or NULL if its slab was never allocated
+Connection* conn_slot(int socket) {
+    if (socket < 0 || (socket >> SLAB_SHIFT) >= conn_table.slab_count) return NULL;
+    Connection* slab = conn_table.slabs[socket >> SLAB_SHIFT].load(memory_order_acquire);
+    if (!slab) return NULL;
+    return &slab[socket & (SLAB_SIZE - 1)];
+}
+
+// Claim the slot for a newly accepted socket, allocating its slab on first use
+Connection* add_client(int socket, Reactor* reactor) {
+    if (socket < 0 || (socket >> SLAB_SHIFT) >= conn_table.slab_count) return NULL;
+    lock_mutex(&clients_mutex, LOCK_CLIENTS);
+    atomic<Connection*>& entry = conn_table.slabs[socket >> SLAB_SHIFT];
+    Connection* slab = entry.load(memory_order_relaxed);
+    if (!slab) {
+        slab = new Connection[SLAB_SIZE];
+        for (int i = 0; i < SLAB_SIZE; i++) {
+            slab[i].gen = 0;
+            slab[i].in_use = false;
+            slab[i].out.items = NULL;
+            slab[i].out.cap = 0;
+            slab[i].codec_state = NULL;
+            slab[i].tls = NULL;
+            slab[i].timer.prev = slab[i].timer.next = NULL;
+            slab[i].timer.conn = &slab[i];
+        }
+        entry.store(slab, memory_order_release);
+    }
+    Connection* conn = &slab[socket & (SLAB_SIZE - 1)];
+    conn->socket = socket;
+    if (conn->gen < gen_floor) conn->gen = gen_floor;
+    if (++conn->gen == 0) conn->gen = 1;  // Generation 0 tags listeners and eventfds
+    conn->state = CONN_NAME;
+    conn->mode.store('e', memory_order_relaxed);  // Default to echo mode
+    conn->name = "Unknown";
+    conn->reactor = reactor;
+    conn->framing = FRAMING_UNKNOWN;
+    conn->batch_left = 0;
+    conn->codec = CODEC_NONE;
+    conn->tls = NULL;
+    conn->tls_handshaking = conn->tls_kernel_send = false;
+    memset(&conn->in, 0, sizeof(conn->in));
+    conn->out.head = conn->out.count = 0;
+    conn->out.bytes.store(0, memory_order_relaxed);
+    conn->flush_queued = false;
+    conn->read_paused = false;
+    conn->recv_armed = false;
+    conn->send_inflight = false;
+    conn->peer.store(0, memory_order_relaxed);
+    conn->room = NULL;
+    conn->opened_ms = conn->input_ms = conn->output_ms = reactor->now_ms;
+    conn->msg_tokens.tokens = client_msg_rate;
+    conn->byte_tokens.tokens = client_byte_rate;
+    conn->msg_tokens.stamp_ms = conn->byte_tokens.stamp_ms = reactor->now_ms;
+    conn->ip = NULL;
+    conn->throttled_until = 0;
+    conn->history_peer = 0;
+    conn->history_conv = NULL;
+    conn->in_use = true;
+    conn_table.client_count++;
+    metric_add(metrics()->opened, 1);
+    pthread_mutex_unlock(&clients_mutex);
+    return conn;
+}
+
+// Find the live connection for a socket in O(1)
+Connection* find_client(int socket) {
+    Connection* conn = conn_slot(socket);
+    return (conn && conn->in_use) ? conn : NULL;
+}
+
+ConnRef conn_ref(const Connection* conn) {
+    return ((uint64_t)conn->gen << 32) | (uint32_t)conn->socket;
+}
+
+// The live connection a ref names, or NULL once it has gone
+Connection* resolve_ref(ConnRef ref) {
+    if (!ref) return NULL;
+    Connection* conn = find_client((int)(uint32_t)ref);
+    return (conn && conn->gen == (uint32_t)(ref >> 32)) ? conn : NULL;
+}
+
+void codec_release(Connection* conn);
+void tls_release(Connection* conn);
+
+// Release a connection's slot; must happen before its socket is closed
+void remove_client(Connection* conn) {
+    tls_release(conn);
+    lock_mutex(&clients_mutex, LOCK_CLIENTS);
+    conn->in_use = false;
+    conn->name.clear();
+    free(conn->in.data);
+    conn->in.data = NULL;
+    codec_release(conn);
+    conn_table.client_count--;
+    metric_add(metrics()->closed, 1);
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+IpShard* ip_shard(uint32_t addr) {
+    return &ip_shards[((addr * 2654435761u) >> 16) & (IP_SHARDS - 1)];
+}
+
+// Take a reference to the shared limits of a socket's source address,
+// creating them with full buckets; NULL for peers that are not IPv4
+IpLimit* ip_acquire(int socket, uint64_t now_ms) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getpeername(socket, (struct sockaddr*)&addr, &len) < 0 || addr.sin_family != AF_INET) return NULL;
+    IpShard* shard = ip_shard(addr.sin_addr.s_addr);
+    lock_mutex(&shard->lock, LOCK_IP);
+    IpLimit*& limit = shard->addrs[addr.sin_addr.s_addr];
+    if (!limit) {
+        limit = new IpLimit();
+        limit->addr = addr.sin_addr.s_addr;
+        limit->conns = 0;
+        limit->msg_tokens.tokens = ip_msg_rate;
+        limit->byte_tokens.tokens = ip_byte_rate;
+        limit->msg_tokens.stamp_ms = limit->byte_tokens.stamp_ms = now_ms;
+    }
+    limit->conns++;
+    IpLimit* result = limit;
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+// Drop a connection's reference; the last one frees the entry
+void ip_release(IpLimit* limit) {
+    IpShard* shard = ip_shard(limit->addr);
+    lock_mutex(&shard->lock, LOCK_IP);
+    if (--limit->conns == 0) {
+        shard->addrs.erase(limit->addr);
+        delete limit;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+__thread TokenBucket accept_tokens;  // The calling thread's share of --accept-rate
+
+// Admission control for a freshly accepted socket: take one of the
+// max_clients slots, or shed the connection at once with a short notice when
+// the server is full or accepting faster than --accept-rate. A reject costs
+// one non-blocking send, so overload never backs up into the reactors.
+bool admit_client(int socket) {
+    RejectReason reason = REJECT_COUNT;
+    if (admitted_clients.fetch_add(1, memory_order_relaxed) >= max_clients) {
+        reason = REJECT_MAX_CLIENTS;
+    } else if (accept_rate > 0) {
+        // Every thread accepting on its own gets an equal share: the reactors
+        // in --reactors mode, and main() too when it accepts for --tls-port
+        int shares = reuseport_mode ? reactor_count + (tls_port > 0 ? 1 : 0) : 1;
+        double rate = accept_rate / shares;
+        if (bucket_charge(&accept_tokens, rate, monotonic_ns() / 1000000, 1)) {
+            accept_tokens.tokens += 1;   // Refused, so not charged
+            reason = REJECT_ACCEPT_RATE;
+        }
+    }
+    if (reason == REJECT_COUNT) return true;
+    admitted_clients.fetch_sub(1, memory_order_relaxed);
+    metric_add(metrics()->rejects[reason], 1);
+    send(socket, BUSY_MESSAGE, sizeof(BUSY_MESSAGE) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(socket);
+    return false;
+}
+
+// Give back the slot taken by admit_client()
+void release_client() {
+    admitted_clients.fetch_sub(1, memory_order_relaxed);
+}
+
+// Raise the descriptor limit to fit max_clients; returns the usable limit
+int raise_fd_limit(int wanted) {
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) < 0) return wanted;
+    if (lim.rlim_cur < (rlim_t)wanted) {
+        lim.rlim_cur = (lim.rlim_max == RLIM_INFINITY || lim.rlim_max >= (rlim_t)wanted) ? wanted : lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+        getrlimit(RLIMIT_NOFILE, &lim);
+    }
+    return lim.rlim_cur < (rlim_t)wanted ? (int)lim.rlim_cur : wanted;
+}
+
+// A free pooled block. In the depot, the first block of each batch also
+// links to the next batch.
+struct PoolNode {
+    PoolNode* next;
+    PoolNode* next_batch;
+};
+
+// Free blocks kept by one thread: one list per buffer size class, plus mail
+// items. Whichever thread drops the last reference keeps the block.
+struct PoolCache {
+    PoolNode* free[POOL_LISTS];      // Size class c holds blocks of 64 << c bytes
+    int count[POOL_LISTS];
+    bool grown[POOL_LISTS];          // This thread has allocated blocks for the list
+};
+
+// Whole batches passed from threads that free more blocks than they allocate
+// (a room speaker's listeners, say) to the ones that allocate more than they free
+struct PoolDepot {
+    pthread_mutex_t lock;
+    PoolNode* batches[POOL_LISTS];
+    int count[POOL_LISTS];
+};
+
+__thread PoolCache pool_cache;
+PoolDepot pool_depot = { PTHREAD_MUTEX_INITIALIZER, { NULL }, { 0 } };
+
+// A free block of the given size from the calling thread's cache, which is
+// refilled a batch at a time from the depot. When that is empty too, new
+// blocks are allocated. Every other thread can be sitting on up to a full
+// cache of blocks it freed, so a thread's first allocation for a list fills
+// its cache, and later ones add a batch: the pool outgrows that slack in a
+// few misses instead of one block at a time. NULL if out of memory.
+void* pool_get(int list, size_t bytes) {
+    PoolCache* cache = &pool_cache;
+    if (!cache->free[list]) {
+        lock_mutex(&pool_depot.lock, LOCK_POOL);
+        PoolNode* batch = pool_depot.batches[list];
+        if (batch) {
+            pool_depot.batches[list] = batch->next_batch;
+            pool_depot.count[list]--;
+        }
+        pthread_mutex_unlock(&pool_depot.lock);
+        int got = batch ? POOL_BATCH : 0;
+        int want = batch ? POOL_BATCH : cache->grown[list] ? POOL_BATCH : POOL_CACHE_MAX - 1;
+        if (!batch) cache->grown[list] = true;
+        for (; got < want; got++) {
+            PoolNode* node = (PoolNode*)counted_malloc(bytes);
+            if (!node) break;
+            node->next = batch;
+            batch = node;
+        }
+        if (!batch) return NULL;
+        cache->free[list] = batch;
+        cache->count[list] = got;
+    }
+    PoolNode* node = cache->free[list];
+    cache->free[list] = node->next;
+    cache->count[list]--;
+    return node;
+}
+
+// Return a block to the calling thread's cache; a full cache passes its
+// newest batch to the depot
+void pool_put(int list, void* block) {
+    PoolCache* cache = &pool_cache;
+    PoolNode* node = (PoolNode*)block;
+    node->next = cache->free[list];
+    cache->free[list] = node;
+    if (++cache->count[list] < POOL_CACHE_MAX) return;
+
+    PoolNode* batch = cache->free[list];
+    PoolNode* last = batch;
+    for (int i = 1; i < POOL_BATCH; i++) {
+        last = last->next;
+    }
+    cache->free[list] = last->next;
+    cache->count[list] -= POOL_BATCH;
+    last->next = NULL;
+    lock_mutex(&pool_depot.lock, LOCK_POOL);
+    bool kept = pool_depot.count[list] < POOL_DEPOT_MAX;
+    if (kept) {
+        batch->next_batch = pool_depot.batches[list];
+        pool_depot.batches[list] = batch;
+        pool_depot.count[list]++;
+    }
+    pthread_mutex_unlock(&pool_depot.lock);
+    while (!kept && batch) {
+        PoolNode* next = batch->next;
+        free(batch);
+        batch = next;
+    }
+}
+
+// Size class for a block of this many bytes, or -1 if it is too big to pool
+inline int pool_class(size_t bytes) {
+    if (bytes <= (1u << POOL_MIN_SHIFT)) return 0;
+    int c = 64 - __builtin_clzll(bytes - 1) - POOL_MIN_SHIFT;
+    return c < POOL_CLASSES ? c : -1;
+}
+
+// Allocate a buffer holding len bytes with one reference. Small buffers come
+// from the pool, so steady traffic never reaches malloc.
+SharedBuf* buf_alloc(size_t len) {
+    size_t bytes = offsetof(SharedBuf, data) + len;
+    int c = pool_class(bytes);
+    SharedBuf* buf = (SharedBuf*)(c >= 0 ? pool_get(c, (size_t)1 << (POOL_MIN_SHIFT + c)) : counted_malloc(bytes));
+    if (!buf) {
+        perror("Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    new (&buf->refs) atomic<int>(1);
+    buf->block = c;
+    buf->len = len;
+    for (int c = 0; c < CODEC_COUNT - 1; c++) {
+        new (&buf->packed[c]) atomic<SharedBuf*>(NULL);
+    }
+    return buf;
+}
+
+SharedBuf incompressible;  // Kept as the compressed form of a buffer compression would not shrink
+
+// Drop a reference. The block goes back to the class it was allocated from:
+// a buffer trimmed below a class boundary would otherwise drain the larger
+// class one block per message.
+void buf_release(SharedBuf* buf) {
+    if (buf->refs.fetch_sub(1, memory_order_acq_rel) != 1) return;
+    for (int c = 0; c < CODEC_COUNT - 1; c++) {
+        SharedBuf* packed = buf->packed[c].load(memory_order_acquire);
+        if (packed && packed != &incompressible) buf_release(packed);
+    }
+    if (buf->block < 0) {
+        free(buf);
+    } else {
+        pool_put(buf->block, buf);
+    }
+}
+
+MailItem* mail_alloc() {
+    MailItem* item = (MailItem*)pool_get(POOL_MAIL, sizeof(MailItem));
+    if (!item) {
+        perror("Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    return item;
+}
+
+void mail_free(MailItem* item) {
+    pool_put(POOL_MAIL, item);
+}
+
+inline void store_be16(char* out, uint16_t v) {
+    out[0] = (char)(v >> 8);
+    out[1] = (char)v;
+}
+
+inline uint16_t load_be16(const char* in) {
+    const unsigned char* b = (const unsigned char*)in;
+    return (uint16_t)((b[0] << 8) | b[1]);
+}
+
+inline void store_be32(char* out, uint32_t v) {
+    out[0] = (char)(v >> 24);
+    out[1] = (char)(v >> 16);
+    out[2] = (char)(v >> 8);
+    out[3] = (char)v;
+}
+
+inline uint32_t load_be32(const char* in) {
+    const unsigned char* b = (const unsigned char*)in;
+    return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+}
+
+inline void store_be64(char* out, uint64_t v) {
+    store_be32(out, (uint32_t)(v >> 32));
+    store_be32(out + 4, (uint32_t)v);
+}
+
+inline uint64_t load_be64(const char* in) {
+    return ((uint64_t)load_be32(in) << 32) | load_be32(in + 4);
+}
+
+// A user id as binary payloads carry it, written into buf
+inline StrView id_view(char* buf, ConnRef ref) {
+    store_be64(buf, ref);
+    return str_view(buf, USER_ID_SIZE);
+}
+
+// Copy several pieces into a new buffer after a header of the given size
+SharedBuf* gather_parts(size_t header, const StrView* parts, int count, size_t* len) {
+    *len = 0;
+    for (int i = 0; i < count; i++) {
+        *len += parts[i].len;
+    }
+    SharedBuf* buf = buf_alloc(header + *len + 1);
+    char* out = buf->data + header;
+    for (int i = 0; i < count; i++) {
+        memcpy(out, parts[i].data, parts[i].len);
+        out += parts[i].len;
+    }
+    return buf;
+}
+
+// Fill in a binary protocol header for a payload of len bytes
+inline void binary_header(SharedBuf* buf, BinaryOp op, size_t len) {
+    buf->data[0] = (char)op;
+    buf->data[1] = buf->data[2] = buf->data[3] = 0;
+    store_be32(buf->data + 4, (uint32_t)len);
+    buf->len = BINARY_HEADER + len;
+}
+
+// Build a message framed for a client out of several pieces (say a name,
+// ": " and the text), written straight into one buffer: trailing whitespace
+// trimmed, then exactly one newline, a length header, or a binary OP_TEXT header
+SharedBuf* frame_parts(Framing framing, const StrView* parts, int count) {
+    size_t header = framing == FRAMING_LENGTH ? FRAME_HEADER : framing == FRAMING_BINARY ? BINARY_HEADER : 0;
+    size_t len;
+    SharedBuf* buf = gather_parts(header, parts, count, &len);
+    char* payload = buf->data + header;
+    len = trimmed_view(payload, len).len;
+    if (framing == FRAMING_LENGTH) {
+        store_be32(buf->data, (uint32_t)len);
+        buf->len = FRAME_HEADER + len;
+    } else if (framing == FRAMING_BINARY) {
+        binary_header(buf, OP_TEXT, len);
+    } else {
+        payload[len] = '\n';
+        buf->len = len + 1;
+    }
+    return buf;
+}
+
+SharedBuf* frame_message(Framing framing, const char* msg, size_t len) {
+    StrView part = str_view(msg, len);
+    return frame_parts(framing, &part, 1);
+}
+
+// A binary protocol frame, payload sent exactly as given
+SharedBuf* frame_binary(BinaryOp op, const StrView* parts, int count) {
+    size_t len;
+    SharedBuf* buf = gather_parts(BINARY_HEADER, parts, count, &len);
+    binary_header(buf, op, len);
+    return buf;
+}
+
+// Frame one message for every framing, for replies shared by many clients;
+// out is indexed by Framing and its FRAMING_UNKNOWN slot is left NULL
+void frame_all(SharedBuf* out[FRAMING_COUNT], const StrView* parts, int count) {
+    out[FRAMING_UNKNOWN] = NULL;
+    for (int f = FRAMING_NEWLINE; f < FRAMING_COUNT; f++) {
+        out[f] = frame_parts((Framing)f, parts, count);
+    }
+}
+
+void release_all(SharedBuf* bufs[FRAMING_COUNT]) {
+    for (int f = FRAMING_NEWLINE; f < FRAMING_COUNT; f++) {
+        buf_release(bufs[f]);
+    }
+}
+
+bool codec_available(int codec) {
+#ifdef HAVE_LZ4
+    if (codec == CODEC_LZ4) return true;
+#endif
+#ifdef HAVE_ZSTD
+    if (codec == CODEC_ZSTD) return true;
+#endif
+    return false;
+}
+
+// Largest compressed size of len bytes
+size_t codec_bound(Codec codec, size_t len) {
+#ifdef HAVE_LZ4
+    if (codec == CODEC_LZ4) return LZ4_compressBound((int)len);
+#endif
+#ifdef HAVE_ZSTD
+    if (codec == CODEC_ZSTD) return ZSTD_compressBound(len);
+#endif
+    return 0;
+}
+
+// Compress with the connection's own context, made on its first large reply
+// and reused until it closes. Returns the compressed size, 0 on failure.
+size_t codec_compress(Connection* conn, const char* data, size_t len, char* out, size_t cap) {
+#ifdef HAVE_LZ4
+    if (conn->codec == CODEC_LZ4) {
+        if (!conn->codec_state) conn->codec_state = counted_malloc(LZ4_sizeofState());
+        int n = LZ4_compress_fast_extState(conn->codec_state, data, out, (int)len, (int)cap, 1);
+        return n > 0 ? n : 0;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (conn->codec == CODEC_ZSTD) {
+        if (!conn->codec_state) conn->codec_state = ZSTD_createCCtx();
+        size_t n = ZSTD_compressCCtx((ZSTD_CCtx*)conn->codec_state, out, cap, data, len, ZSTD_LEVEL);
+        return ZSTD_isError(n) ? 0 : n;
+    }
+#endif
+    return 0;
+}
+
+void codec_release(Connection* conn) {
+    if (!conn->codec_state) return;
+#ifdef HAVE_ZSTD
+    if (conn->codec == CODEC_ZSTD) ZSTD_freeCCtx((ZSTD_CCtx*)conn->codec_state);
+    else free(conn->codec_state);
+#else
+    free(conn->codec_state);
+#endif
+    conn->codec_state = NULL;
+}
+
+#ifdef HAVE_ZSTD
+__thread ZSTD_DCtx* zstd_dctx = NULL;  // Decompression needs no per-client state; one per thread
+#endif
+
+// Decompress exactly raw_len bytes; false if the input is corrupt
+bool codec_decompress(Codec codec, const char* data, size_t len, char* out, size_t raw_len) {
+#ifdef HAVE_LZ4
+    if (codec == CODEC_LZ4) return LZ4_decompress_safe(data, out, (int)len, (int)raw_len) == (int)raw_len;
+#endif
+#ifdef HAVE_ZSTD
+    if (codec == CODEC_ZSTD) {
+        if (!zstd_dctx) zstd_dctx = ZSTD_createDCtx();
+        return ZSTD_decompressDCtx(zstd_dctx, out, raw_len, data, len) == raw_len;
+    }
+#endif
+    return false;
+}
+
+// A binary frame's payload compressed with the client's codec: the same
+// header with BINARY_COMPRESSED set, the raw length, the compressed bytes.
+// Returns &incompressible if that would not be smaller.
+SharedBuf* compress_frame(Connection* conn, const SharedBuf* buf) {
+    size_t len = buf->len - BINARY_HEADER;
+    size_t cap = codec_bound(conn->codec, len);
+    SharedBuf* out = buf_alloc(BINARY_HEADER + 4 + cap);
+    uint64_t start = monotonic_ns();
+    size_t packed = codec_compress(conn, buf->data + BINARY_HEADER, len, out->data + BINARY_HEADER + 4, cap);
+    ThreadMetrics* m = metrics();
+    metric_add(m->codec_ns[0], monotonic_ns() - start);
+    metric_add(m->packed_raw, len);
+    if (!packed || 4 + packed >= len) {
+        metric_add(m->packed_wire, len);
+        buf_release(out);
+        return &incompressible;
+    }
+    memcpy(out->data, buf->data, 4);  // Opcode, flags and tag
+    out->data[1] |= BINARY_COMPRESSED;
+    store_be32(out->data + 4, (uint32_t)(4 + packed));
+    store_be32(out->data + BINARY_HEADER, (uint32_t)len);
+    out->len = BINARY_HEADER + 4 + packed;
+    metric_add(m->packed_wire, 4 + packed);
+    return out;
+}
+
+// The form of a frame to send a client that negotiated compression. The
+// compressed copy is kept with the buffer, so a room broadcast or /list
+// snapshot is compressed by its first recipient and shared by the rest.
+SharedBuf* packed_frame(Connection* conn, SharedBuf* buf) {
+    if (buf->data[1] & BINARY_COMPRESSED) return buf;  // The echo of a frame the client compressed
+    atomic<SharedBuf*>& slot = buf->packed[conn->codec - 1];
+    SharedBuf* packed = slot.load(memory_order_acquire);
+    if (!packed) {
+        packed = compress_frame(conn, buf);
+        SharedBuf* seen = NULL;
+        if (!slot.compare_exchange_strong(seen, packed, memory_order_acq_rel, memory_order_acquire)) {
+            // Another reactor compressed it first
+            if (packed != &incompressible) buf_release(packed);
+            packed = seen;
+        }
+    }
+    return packed == &incompressible ? buf : packed;
+}
+
+// Load the certificate and key and build the context every TLS client
+// shares; false, with OpenSSL's reasons printed, if that fails
+bool tls_setup() {
+#ifdef HAVE_OPENSSL
+    tls_ctx = SSL_CTX_new(TLS_server_method());
+    if (!tls_ctx || SSL_CTX_use_certificate_chain_file(tls_ctx, tls_cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls_ctx, tls_key, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(tls_ctx) != 1) {
+        ERR_print_errors_fp(stderr);
+        return false;
+    }
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+    // Partial writes and a moving write buffer let a write that had to wait
+    // be retried from the output queue, however it was gathered meanwhile;
+    // idle clients give their record buffers back
+    SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+    // Resumption uses stateless session tickets only, so there is no session
+    // cache for the reactors to share and lock
+    SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_options(tls_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF | (ktls_enabled ? SSL_OP_ENABLE_KTLS : 0));
+    SSL_CTX_set_read_ahead(tls_ctx, 1);  // Read whole socket buffers, not a record header and body at a time
+    return true;
+#else
+    return false;
+#endif
+}
+
+// The key that protects session tickets, so a server taking over can resume
+// the sessions of the TLS clients it could not inherit; empty without TLS
+string tls_ticket_keys() {
+#ifdef HAVE_OPENSSL
+    char keys[TLS_TICKET_KEYS];
+    if (tls_ctx && SSL_CTX_get_tlsext_ticket_keys(tls_ctx, keys, sizeof(keys)) == 1) return string(keys, sizeof(keys));
+#endif
+    return "";
+}
+
+void tls_adopt_ticket_keys(StrView keys) {
+#ifdef HAVE_OPENSSL
+    if (tls_ctx && keys.len == TLS_TICKET_KEYS) SSL_CTX_set_tlsext_ticket_keys(tls_ctx, (char*)keys.data, keys.len);
+#endif
+}
+
+// Start the server side of a TLS session on a new connection; the handshake
+// runs from the reactor as the socket becomes ready
+bool tls_attach(Connection* conn) {
+#ifdef HAVE_OPENSSL
+    SSL* ssl = SSL_new(tls_ctx);
+    if (!ssl) return false;
+    SSL_set_fd(ssl, conn->socket);
+    SSL_set_accept_state(ssl);
+    conn->tls = ssl;
+    conn->tls_handshaking = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Send close_notify if the session is still sound, then free it
+void tls_release(Connection* conn) {
+    if (!conn->tls) return;
+#ifdef HAVE_OPENSSL
+    if (!conn->tls_handshaking) SSL_shutdown(conn->tls);
+    SSL_free(conn->tls);
+    ERR_clear_error();
+#endif
+    conn->tls = NULL;
+}
+
+// recv() for a TLS client: decrypted bytes, 0 once the client has closed, or
+// -1 with errno set (EAGAIN while OpenSSL waits for the socket)
+ssize_t tls_recv(Connection* conn, char* data, size_t len) {
+#ifdef HAVE_OPENSSL
+    int n = SSL_read(conn->tls, data, (int)min(len, (size_t)INT_MAX));
+    if (n > 0) return n;
+    int err = SSL_get_error(conn->tls, n);
+    if (err == SSL_ERROR_ZERO_RETURN) return 0;
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        errno = EAGAIN;
+        return -1;
+    }
+    SSL_set_quiet_shutdown(conn->tls, 1);  // A broken session gets no close_notify
+    ERR_clear_error();
+#endif
+    errno = ECONNRESET;
+    return -1;
+}
+
+// Remember to flush a connection once the reactor finishes its current batch
+void mark_dirty(Connection* conn) {
+    if (!conn->flush_queued) {
+        conn->flush_queued = true;
+        conn->reactor->dirty.push_back(conn);
+    }
+}
+
+TimerWheel* timer_wheel_create(uint64_t now_ms) {
+    TimerWheel* w = new TimerWheel();
+    w->now = now_ms / TIMER_TICK_MS;
+    w->armed = 0;
+    for (int i = 0; i < WHEEL_SLOTS; i++) {
+        w->inner[i].prev = w->inner[i].next = &w->inner[i];
+    }
+    for (int i = 0; i < WHEEL_OUTER_SLOTS; i++) {
+        w->outer[i].prev = w->outer[i].next = &w->outer[i];
+    }
+    return w;
+}
+
+void timer_cancel(TimerWheel* w, TimerNode* node) {
+    if (!node->prev) return;
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = NULL;
+    w->armed--;
+}
+
+// Put a node in the slot for its expiry: the inner wheel within 256 ticks,
+// else the outer slot covering it, else the outer wheel's last slot
+void timer_insert(TimerWheel* w, TimerNode* node) {
+    TimerNode* head;
+    uint64_t outer_ahead = (node->expires >> WHEEL_BITS) - (w->now >> WHEEL_BITS);
+    if (node->expires - w->now < WHEEL_SLOTS) {
+        head = &w->inner[node->expires & (WHEEL_SLOTS - 1)];
+    } else if (outer_ahead < WHEEL_OUTER_SLOTS) {
+        head = &w->outer[(node->expires >> WHEEL_BITS) & (WHEEL_OUTER_SLOTS - 1)];
+    } else {
+        head = &w->outer[((w->now >> WHEEL_BITS) + WHEEL_OUTER_SLOTS - 1) & (WHEEL_OUTER_SLOTS - 1)];
+    }
+    node->prev = head;
+    node->next = head->next;
+    head->next->prev = node;
+    head->next = node;
+    w->armed++;
+}
+
+// Older clients send their name without a newline: part of a name is waiting
+// and only the quiet period after it says the client has finished
+inline bool name_pending(const Connection* conn) {
+    return conn->state == CONN_NAME && conn->framing == FRAMING_NEWLINE && conn->in.end > conn->in.start;
+}
+
+// Earliest time a connection's timeouts need looking at, or 0 if none apply
+uint64_t next_deadline(const Connection* conn) {
+    uint64_t deadline = 0;
+    if (conn->state == CONN_NAME) {
+        if (handshake_timeout_ms) deadline = conn->opened_ms + handshake_timeout_ms;
+        if (name_pending(conn) && (!deadline || conn->input_ms + NAME_QUIET_MS < deadline)) {
+            deadline = conn->input_ms + NAME_QUIET_MS;
+        }
+    } else if (idle_timeout_ms) {
+        deadline = max(conn->input_ms, conn->output_ms) + idle_timeout_ms;
+    }
+    if (conn->out.count > 0 && write_stall_timeout_ms) {
+        uint64_t stall = conn->output_ms + write_stall_timeout_ms;
+        if (!deadline || stall < deadline) deadline = stall;
+    }
+    if (conn->throttled_until && (!deadline || conn->throttled_until < deadline)) deadline = conn->throttled_until;
+    return deadline;
+}
+
+// Arm, move or cancel a connection's timer for its next deadline. Activity
+// only updates timestamps; a timer that fires early is re-armed from them.
+void schedule_timeout(Connection* conn) {
+    TimerWheel* w = conn->reactor->timers;
+    uint64_t deadline = next_deadline(conn);
+    if (!deadline) {
+        timer_cancel(w, &conn->timer);
+        return;
+    }
+    uint64_t expires = max((deadline + TIMER_TICK_MS - 1) / TIMER_TICK_MS, w->now + 1);
+    if (conn->timer.prev && conn->timer.expires == expires) return;
+    timer_cancel(w, &conn->timer);
+    conn->timer.expires = expires;
+    timer_insert(w, &conn->timer);
+}
+
+// The tagged binary request this thread is handling. Whatever is queued to
+// its client meanwhile is a reply and goes out carrying the request's tag.
+struct ReplyTag {
+    Connection* conn;
+    uint16_t tag;
+    bool replied;
+};
+__thread ReplyTag reply_tag = { NULL, 0, false };
+
+// A stamped copy of a reply: the buffer itself may be shared (a room
+// broadcast, the /list snapshot) and must reach everyone else untagged
+SharedBuf* tag_reply(SharedBuf* buf) {
+    SharedBuf* copy = buf_alloc(buf->len);
+    memcpy(copy->data, buf->data, buf->len);
+    store_be16(copy->data + 2, reply_tag.tag);
+    reply_tag.replied = true;
+    return copy;
+}
+
+// Append a buffer (taking a reference) to a connection's output queue as it is
+void append_output(Connection* conn, SharedBuf* buf) {
+    OutQueue* q = &conn->out;
+    bool was_empty = q->count == 0;
+    if (q->count == q->cap) {
+        unsigned cap = q->cap ? q->cap * 2 : 8;
+        OutChunk* items = (OutChunk*)counted_malloc(cap * sizeof(OutChunk));
+        for (unsigned i = 0; i < q->count; i++) {
+            items[i] = q->items[(q->head + i) % q->cap];
+        }
+        free(q->items);
+        q->items = items;
+        q->head = 0;
+        q->cap = cap;
+    }
+    buf->refs.fetch_add(1, memory_order_relaxed);
+    OutChunk* chunk = &q->items[(q->head + q->count) % q->cap];
+    chunk->buf = buf;
+    chunk->offset = 0;
+    q->count++;
+    q->bytes.fetch_add(buf->len, memory_order_relaxed);
+    mark_dirty(conn);
+
+    if (was_empty) {
+        // The write-stall clock starts now; make sure the timer goes off by then
+        conn->output_ms = conn->reactor->now_ms;
+        uint64_t stall_tick = (conn->output_ms + write_stall_timeout_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+        if (write_stall_timeout_ms && (!conn->timer.prev || conn->timer.expires > stall_tick)) schedule_timeout(conn);
+    }
+}
+
+// Queue one framed message: a reply to the tagged request being handled
+// carries its tag, and a large one is compressed if the client asked for that
+void queue_buf(Connection* conn, SharedBuf* buf) {
+    SharedBuf* tagged = NULL;
+    if (conn == reply_tag.conn) buf = tagged = tag_reply(buf);
+    if (conn->codec != CODEC_NONE && buf->len >= BINARY_HEADER + compress_min) buf = packed_frame(conn, buf);
+    append_output(conn, buf);
+    if (tagged) buf_release(tagged);
+}
+
+// Copy one framed message into a new buffer at the tail of the output queue
+void queue_bytes(Connection* conn, const char* data, size_t len) {
+    SharedBuf* buf = buf_alloc(len);
+    memcpy(buf->data, data, len);
+    queue_buf(conn, buf);
+    buf_release(buf);
+}
+
+// Copy bytes that may hold several frames, or part of one, to the output
+// queue exactly as they are
+void queue_stream(Connection* conn, const char* data, size_t len) {
+    SharedBuf* buf = buf_alloc(len);
+    memcpy(buf->data, data, len);
+    append_output(conn, buf);
+    buf_release(buf);
+}
+
+// Send bytes straight from the caller's memory when nothing is queued ahead of
+// them; only what the socket will not take right now is copied into the queue
+void write_or_queue(Connection* conn, const char* data, size_t len) {
+    if (conn->out.count == 0 && io_backend == IO_EPOLL && (!conn->tls || conn->tls_kernel_send)) {
+        ssize_t sent;
+        do {
+            sent = send(conn->socket, data, len, MSG_NOSIGNAL);
+        } while (sent < 0 && errno == EINTR);
+        if (sent > 0) {
+            metric_add(metrics()->bytes_out, sent);
+            data += sent;
+            len -= sent;
+        }
+    }
+    if (len > 0) queue_stream(conn, data, len);
+}
+
+// Drop bytes the socket has taken from the front of the queue; a short write
+// leaves an offset in the head chunk
+void retire_output(OutQueue* q, size_t sent) {
+    q->bytes.fetch_sub(sent, memory_order_relaxed);
+    while (sent > 0) {
+        OutChunk* chunk = &q->items[q->head];
+        size_t left = chunk->buf->len - chunk->offset;
+        if (sent < left) {
+            chunk->offset += sent;
+            break;
+        }
+        sent -= left;
+        buf_release(chunk->buf);
+        q->head = (q->head + 1) % q->cap;
+        q->count--;
+    }
+}
+
+// Fill iovecs from the front of the output queue; returns how many were used
+int output_iovecs(OutQueue* q, struct iovec* iov, int max) {
+    int n = 0;
+    for (unsigned i = 0; i < q->count && n < max; i++, n++) {
+        OutChunk* chunk = &q->items[(q->head + i) % q->cap];
+        iov[n].iov_base = chunk->buf->data + chunk->offset;
+        iov[n].iov_len = chunk->buf->len - chunk->offset;
+    }
+    return n;
+}
+
+__thread char tls_gather[TLS_RECORD_MAX];  // Small queued buffers joined into one record
+
+// flush_output for a TLS client the kernel does not encrypt for. Small
+// buffers are gathered so each record, and each write, carries up to 16 KiB.
+// A write that has to wait is retried with at least the same bytes, which
+// is all OpenSSL asks of a moving write buffer.
+bool tls_flush(Connection* conn) {
+#ifdef HAVE_OPENSSL
+    OutQueue* q = &conn->out;
+    while (q->count > 0) {
+        OutChunk* head = &q->items[q->head];
+        const char* data = head->buf->data + head->offset;
+        size_t len = head->buf->len - head->offset;
+        if (len < TLS_RECORD_MAX && q->count > 1) {
+            len = 0;
+            for (unsigned i = 0; i < q->count && len < TLS_RECORD_MAX; i++) {
+                OutChunk* chunk = &q->items[(q->head + i) % q->cap];
+                size_t n = min(chunk->buf->len - chunk->offset, (size_t)TLS_RECORD_MAX - len);
+                memcpy(tls_gather + len, chunk->buf->data + chunk->offset, n);
+                len += n;
+            }
+            data = tls_gather;
+        }
+        int sent = SSL_write(conn->tls, data, (int)min(len, (size_t)INT_MAX));
+        if (sent <= 0) {
+            int err = SSL_get_error(conn->tls, sent);
+            if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) break;  // EPOLLOUT resumes us
+            SSL_set_quiet_shutdown(conn->tls, 1);
+            ERR_clear_error();
+            return false;
+        }
+        metric_add(metrics()->bytes_out, sent);
+        retire_output(q, sent);
+        conn->output_ms = conn->reactor->now_ms;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Write as much queued output as the socket accepts, batching chunks with
+// sendmsg(); kTLS encrypts on the way if the kernel took over a TLS
+// client's records. Returns false if the connection failed.
+bool flush_output(Connection* conn) {
+    if (conn->tls && !conn->tls_kernel_send) return conn->tls_handshaking || tls_flush(conn);
+    OutQueue* q = &conn->out;
+    while (q->count > 0) {
+        struct iovec iov[IOV_BATCH];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = output_iovecs(q, iov, IOV_BATCH);
+        ssize_t sent = sendmsg(conn->socket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;  // EPOLLOUT resumes us
+            return false;
+        }
+        metric_add(metrics()->bytes_out, sent);
+        retire_output(q, sent);
+        conn->output_ms = conn->reactor->now_ms;
+    }
+    return true;
+}
+
+// Drop everything still queued for a connection
+void discard_output(Connection* conn) {
+    OutQueue* q = &conn->out;
+    while (q->count > 0) {
+        buf_release(q->items[q->head].buf);
+        q->head = (q->head + 1) % q->cap;
+        q->count--;
+    }
+    q->bytes.store(0, memory_order_relaxed);
+}
+
+// True when a client has more unsent output than output_hwm
+bool output_backlogged(ConnRef ref) {
+    Connection* conn = resolve_ref(ref);
+    return conn && conn->out.bytes.load(memory_order_relaxed) > output_hwm;
+}
+
+// Send a message to a client, framed the way that client talks to us
+void send_message(int socket, const string& message) {
+    Connection* conn = find_client(socket);
+    if (!conn) return;
+    SharedBuf* buf = frame_message(conn->framing, message.data(), message.length());
+    queue_buf(conn, buf);
+    buf_release(buf);
+}
+
+// Send a binary protocol frame to a client
+void send_binary(Connection* conn, BinaryOp op, const StrView* parts, int count) {
+    SharedBuf* buf = frame_binary(op, parts, count);
+    queue_buf(conn, buf);
+    buf_release(buf);
+}
+
+// Refuse a request: an OP_ERROR frame to binary clients, a plain message to the others
+void send_error(Connection* conn, const string& message) {
+    if (conn->framing != FRAMING_BINARY) {
+        send_message(conn->socket, message);
+        return;
+    }
+    StrView part = str_view(message);
+    send_binary(conn, OP_ERROR, &part, 1);
+}
+
+// Queue an item on a reactor's mailbox, waking it if the mailbox was empty
+void push_mail(Reactor* r, MailItem* item) {
+    MailItem* head = r->mailbox.head.load(memory_order_relaxed);
+    do {
+        item->next = head;
+    } while (!r->mailbox.head.compare_exchange_weak(head, item, memory_order_release, memory_order_relaxed));
+    if (head == NULL) {
+        uint64_t one = 1;
+        if (write(r->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("eventfd write failed");
+        }
+    }
+}
+
+// Hand a framed message (or, with buf NULL, a new socket) to another reactor
+void post_mail(Reactor* r, int socket, uint32_t gen, SharedBuf* buf) {
+    MailItem* item = mail_alloc();
+    item->socket = socket;
+    item->gen = gen;
+    item->buf = buf;
+    item->room = NULL;
+    push_mail(r, item);
+}
+
+// Queue a buffer already framed for another client, from its own reactor thread
+void deliver_buf(Connection* peer, SharedBuf* buf) {
+    if (peer->reactor == current_reactor) {
+        queue_buf(peer, buf);
+        buf_release(buf);
+    } else {
+        post_mail(peer->reactor, peer->socket, peer->gen, buf);  // Mail owns the reference
+    }
+}
+
+// Deliver a message, given in pieces, to another client from its own reactor thread
+void deliver_message(ConnRef ref, const StrView* parts, int count) {
+    Connection* peer = resolve_ref(ref);
+    if (!peer) return;
+    deliver_buf(peer, frame_parts(peer->framing, parts, count));
+}
+
+// Deliver text from one user to another: "name: text" to text clients, an
+// OP_DELIVER carrying the sender's id to binary ones
+void deliver_from(ConnRef ref, Connection* from, StrView text) {
+    Connection* peer = resolve_ref(ref);
+    if (!peer) return;
+    if (peer->framing == FRAMING_BINARY) {
+        char id[USER_ID_SIZE];
+        StrView parts[] = { id_view(id, conn_ref(from)), text };
+        deliver_buf(peer, frame_binary(OP_DELIVER, parts, 2));
+    } else {
+        StrView parts[] = { str_view(from->name), str_view(": "), text };
+        deliver_buf(peer, frame_parts(peer->framing, parts, 3));
+    }
+}
+
+void deliver_message(ConnRef ref, const string& message) {
+    StrView part = str_view(message);
+    deliver_message(ref, &part, 1);
+}
+
+void register_client(int client_socket, Reactor* r, bool tls = false);
+void room_fanout(Room* room, RoomShard* shard, Connection* sender, SharedBuf* const* framed);
+void room_release(Room* room);
+
+// Send everything waiting in this reactor's mailbox, oldest first
+void drain_mailbox(Reactor* r) {
+    uint64_t count;
+    while (read(r->wake_fd, &count, sizeof(count)) < 0 && errno == EINTR) {}
+
+    MailItem* item = r->mailbox.head.exchange(NULL, memory_order_acquire);
+    MailItem* ordered = NULL;
+    while (item) {
+        MailItem* next = item->next;
+        item->next = ordered;
+        ordered = item;
+        item = next;
+    }
+    while (ordered) {
+        MailItem* next = ordered->next;
+        // The socket may have been closed and reused since the mail was posted
+        if (ordered->room) {
+            room_fanout(ordered->room, &ordered->room->shards[r->index], NULL, ordered->framed);
+            release_all(ordered->framed);
+            room_release(ordered->room);
+        } else if (!ordered->buf) {
+            metric_add(metrics()->handoffs_taken, 1);
+            register_client(ordered->socket, r, ordered->gen != 0);
+        } else {
+            Connection* conn = find_client(ordered->socket);
+            if (conn && conn->gen == ordered->gen) {
+                queue_buf(conn, ordered->buf);
+            }
+            buf_release(ordered->buf);
+        }
+        mail_free(ordered);
+        ordered = next;
+    }
+}
+
+// Shard a name lives in
+NameShard* name_shard(const string& name) {
+    return &name_shards[hash<string>()(name) & (NAME_SHARDS - 1)];
+}
+
+// Claim a name for a connection; false if it is taken
+bool register_name(const string& name, ConnRef ref) {
+    NameShard* shard = name_shard(name);
+    lock_mutex(&shard->lock, LOCK_NAME);
+    bool added = shard->names.insert(make_pair(name, ref)).second;
+    if (added) registry_version.fetch_add(1, memory_order_release);
+    pthread_mutex_unlock(&shard->lock);
+    return added;
+}
+
+// Release a name, unless it has already passed to another connection
+void unregister_name(const string& name, ConnRef ref) {
+    NameShard* shard = name_shard(name);
+    lock_mutex(&shard->lock, LOCK_NAME);
+    unordered_map<string, ConnRef>::iterator found = shard->names.find(name);
+    if (found != shard->names.end() && found->second == ref) {
+        shard->names.erase(found);
+        registry_version.fetch_add(1, memory_order_release);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Connection registered under a name, or 0
+ConnRef lookup_name(const string& name) {
+    NameShard* shard = name_shard(name);
+    lock_mutex(&shard->lock, LOCK_NAME);
+    unordered_map<string, ConnRef>::iterator found = shard->names.find(name);
+    ConnRef ref = found != shard->names.end() ? found->second : 0;
+    pthread_mutex_unlock(&shard->lock);
+    return ref;
+}
+
+// Copy every registered name. Shards are copied one at a time, so a
+// registration waits for at most one shard's copy; if the registry changed
+// meanwhile the copy is retried (seqlock style), which gives a single
+// point-in-time view unless names are churning faster than we can copy.
+// Returns the registry version the copy started from.
+uint64_t snapshot_names(vector<pair<string, ConnRef> >& users) {
+    uint64_t version = 0;
+    for (int attempt = 0; attempt < SNAPSHOT_RETRIES; attempt++) {
+        version = registry_version.load(memory_order_acquire);
+        users.clear();
+        for (int i = 0; i < NAME_SHARDS; i++) {
+            lock_mutex(&name_shards[i].lock, LOCK_NAME);
+            users.insert(users.end(), name_shards[i].names.begin(), name_shards[i].names.end());
+            pthread_mutex_unlock(&name_shards[i].lock);
+        }
+        if (registry_version.load(memory_order_acquire) == version) break;
+    }
+    return version;
+}
+
+// Switch a client between echo ('e') and chat ('c'); the user list shows it
+void set_mode(Connection* conn, char mode) {
+    if (conn->mode.load(memory_order_relaxed) == mode) return;
+    conn->mode.store(mode, memory_order_relaxed);
+    registry_version.fetch_add(1, memory_order_release);
+}
+
+// Pair two clients for chat. Each side's peer is claimed with a CAS, so
+// concurrent /chat requests can never leave a one-sided pair. On failure
+// *reason says why.
+bool pair_clients(Connection* a, Connection* b, string* reason) {
+    ConnRef expected = 0;
+    if (!a->peer.compare_exchange_strong(expected, conn_ref(b), memory_order_acq_rel)) {
+        *reason = "You are already in a chat.";
+        return false;
+    }
+    expected = 0;
+    if (!b->peer.compare_exchange_strong(expected, conn_ref(a), memory_order_acq_rel)) {
+        expected = conn_ref(b);
+        a->peer.compare_exchange_strong(expected, 0, memory_order_acq_rel);
+        *reason = "Client is already in a chat with someone else.";
+        return false;
+    }
+    return true;
+}
+
+// End a client's chat; returns the former partner (0 if there was none)
+ConnRef unpair_client(Connection* conn) {
+    ConnRef peer = conn->peer.exchange(0, memory_order_acq_rel);
+    Connection* other = resolve_ref(peer);
+    if (other) {
+        ConnRef expected = conn_ref(conn);
+        other->peer.compare_exchange_strong(expected, 0, memory_order_acq_rel);
+    }
+    return peer;
+}
+
+void user_list_release(UserList* list) {
+    if (list->refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+        release_all(list->full);
+        delete list;
+    }
+}
+
+// Serialize the registry as it is now
+UserList* build_user_list() {
+    vector<pair<string, ConnRef> > users;
+    UserList* list = new UserList();
+    list->refs.store(1, memory_order_relaxed);
+    list->version = snapshot_names(users);
+    sort(users.begin(), users.end());
+    list->names.reserve(users.size());
+    list->lines.reserve(users.size());
+    string text = "Connected users:";
+    for (const auto& entry : users) {
+        Connection* other = resolve_ref(entry.second);
+        const char* mode_str = (other && other->mode.load(memory_order_relaxed) == 'c') ? " (chat)" : " (echo)";
+        list->names.push_back(entry.first);
+        list->lines.push_back("\n  " + entry.first + mode_str);
+        text += list->lines.back();
+    }
+    StrView part = str_view(text);
+    frame_all(list->full, &part, 1);
+    return list;
+}
+
+// Current user list, with a reference for the caller. It is rebuilt only
+// when the registry has changed since, and by one reactor at a time; the
+// others keep serving the previous version meanwhile.
+UserList* acquire_user_list() {
+    lock_mutex(&list_mutex, LOCK_LIST);
+    UserList* list = user_list;
+    list->refs.fetch_add(1, memory_order_relaxed);
+    pthread_mutex_unlock(&list_mutex);
+    if (list->version == registry_version.load(memory_order_acquire)) return list;
+    if (list_rebuilding.exchange(true, memory_order_acquire)) return list;
+
+    UserList* fresh = build_user_list();
+    fresh->refs.fetch_add(1, memory_order_relaxed);  // One for user_list, one for us
+    lock_mutex(&list_mutex, LOCK_LIST);
+    UserList* old = user_list;
+    user_list = fresh;
+    pthread_mutex_unlock(&list_mutex);
+    list_rebuilding.store(false, memory_order_release);
+    user_list_release(old);
+    user_list_release(list);
+    return fresh;
+}
+
+// /list [prefix [page]]: the whole list goes out as the shared preserialized
+// buffer; with a prefix ("*" for everyone) the matches are found by binary
+// search and sent LIST_PAGE_SIZE at a time
+void send_user_list(Connection* conn, const string& args) {
+    UserList* list = acquire_user_list();
+    if (args.empty()) {
+        queue_buf(conn, list->full[conn->framing]);
+        user_list_release(list);
+        return;
+    }
+
+    size_t space = args.find(' ');
+    string prefix = args.substr(0, space);
+    long page = space == string::npos ? 1 : strtol(args.c_str() + space + 1, NULL, 10);
+    if (prefix == "*") prefix.clear();
+    const vector<string>& names = list->names;
+    vector<string>::const_iterator lo = lower_bound(names.begin(), names.end(), prefix);
+    vector<string>::const_iterator hi = partition_point(lo, names.end(), [&prefix](const string& name) {
+        return name.compare(0, prefix.size(), prefix) == 0;
+    });
+    long matches = hi - lo;
+    long pages = matches ? (matches + LIST_PAGE_SIZE - 1) / LIST_PAGE_SIZE : 1;
+    page = max(1L, min(page, pages));
+
+    string text = "Connected users";
+    if (!prefix.empty()) text += " matching '" + prefix + "'";
+    text += " (page " + to_string(page) + " of " + to_string(pages) + ", " + to_string(matches) + " users):";
+    size_t first = (lo - names.begin()) + (page - 1) * LIST_PAGE_SIZE;
+    size_t last = min(first + LIST_PAGE_SIZE, (size_t)(hi - names.begin()));
+    for (size_t i = first; i < last; i++) {
+        text += list->lines[i];
+    }
+    if (page < pages) text += "\n  '/list " + (prefix.empty() ? string("*") : prefix) + " " + to_string(page + 1) + "' for more";
+    user_list_release(list);
+    send_message(conn->socket, text);
+}
+
+// Find a room by name, creating it on first use; the caller gets a reference
+Room* find_room(const string& name) {
+    lock_mutex(&rooms_mutex, LOCK_ROOMS);
+    Room*& room = rooms[name];
+    if (!room) {
+        room = new Room();
+        room->name = name;
+        room->shards = new RoomShard[reactor_count];
+        for (int i = 0; i < reactor_count; i++) {
+            room->shards[i].count.store(0, memory_order_relaxed);
+        }
+        room->refs.store(0, memory_order_relaxed);
+    }
+    Room* found = room;
+    found->refs.fetch_add(1, memory_order_relaxed);
+    pthread_mutex_unlock(&rooms_mutex);
+    return found;
+}
+
+// Drop a reference. The last one is dropped under rooms_mutex, so find_room
+// cannot hand the room out again while it is being freed.
+void room_release(Room* room) {
+    int refs = room->refs.load(memory_order_relaxed);
+    while (refs > 1) {
+        if (room->refs.compare_exchange_weak(refs, refs - 1, memory_order_acq_rel)) return;
+    }
+    lock_mutex(&rooms_mutex, LOCK_ROOMS);
+    if (room->refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+        rooms.erase(room->name);
+        delete[] room->shards;
+        delete room;
+    }
+    pthread_mutex_unlock(&rooms_mutex);
+}
+
+// Members on every reactor; other reactors' counts may be a moment old
+int room_members(Room* room) {
+    int total = 0;
+    for (int i = 0; i < reactor_count; i++) {
+        total += room->shards[i].count.load(memory_order_relaxed);
+    }
+    return total;
+}
+
+// Queue a room message to one shard's members, skipping the sender. Every
+// member gets a reference to the same buffer: no copies, no locks.
+void room_fanout(Room* room, RoomShard* shard, Connection* sender, SharedBuf* const* framed) {
+    uint64_t delivered = 0, dropped = 0;
+    for (size_t i = 0; i < shard->members.size(); i++) {
+        Connection* member = shard->members[i];
+        if (member == sender) continue;
+        // A member that is not keeping up misses messages instead of growing its queue
+        if (member->out.bytes.load(memory_order_relaxed) > output_hwm) {
+            dropped++;
+            continue;
+        }
+        queue_buf(member, framed[member->framing]);
+        delivered++;
+    }
+    ThreadMetrics* m = metrics();
+    metric_add(m->room_deliveries, delivered);
+    if (dropped) metric_add(m->room_drops, dropped);
+}
+
+// Send text to everyone in a room but the sender. The text is framed once per
+// framing style; other reactors with members get one mail each and fan out on
+// their own threads while this one serves its local members.
+void room_broadcast(Room* room, Connection* sender, const StrView* parts, int count) {
+    SharedBuf* framed[FRAMING_COUNT];
+    frame_all(framed, parts, count);
+    for (int i = 0; i < reactor_count; i++) {
+        if (&reactors[i] == current_reactor || room->shards[i].count.load(memory_order_relaxed) == 0) continue;
+        MailItem* item = mail_alloc();
+        item->room = room;
+        room->refs.fetch_add(1, memory_order_relaxed);
+        for (int f = 0; f < FRAMING_COUNT; f++) {
+            item->framed[f] = framed[f];
+            if (framed[f]) framed[f]->refs.fetch_add(1, memory_order_relaxed);
+        }
+        push_mail(&reactors[i], item);
+    }
+    room_fanout(room, &room->shards[current_reactor->index], sender, framed);
+    release_all(framed);
+}
+
+void room_broadcast(Room* room, Connection* sender, const string& text) {
+    StrView part = str_view(text);
+    room_broadcast(room, sender, &part, 1);
+}
+
+// Add a connection to its reactor's shard of a room; the member keeps the
+// caller's reference
+void room_add(Connection* conn, Room* room) {
+    RoomShard* shard = &room->shards[conn->reactor->index];
+    conn->room = room;
+    conn->room_slot = (int)shard->members.size();
+    shard->members.push_back(conn);
+    shard->count.store((int)shard->members.size(), memory_order_relaxed);
+}
+
+// Take a connection out of its room and tell the members who are left
+void leave_room(Connection* conn) {
+    Room* room = conn->room;
+    RoomShard* shard = &room->shards[conn->reactor->index];
+    Connection* last = shard->members.back();
+    shard->members[conn->room_slot] = last;
+    last->room_slot = conn->room_slot;
+    shard->members.pop_back();
+    shard->count.store((int)shard->members.size(), memory_order_relaxed);
+    conn->room = NULL;
+    StrView parts[] = { str_view("["), str_view(room->name), str_view("] * "), str_view(conn->name), str_view(" left") };
+    room_broadcast(room, NULL, parts, 5);
+    room_release(room);
+}
+
+// /join <room>: leave any current room, enter the new one and switch to chat mode
+void join_room(Connection* conn, const string& room_name) {
+    if (room_name.empty() || room_name.length() > MAX_ROOM_NAME || room_name.find_first_of(" \t") != string::npos) {
+        send_message(conn->socket, "Usage: /join <room> (one word, up to " + to_string(MAX_ROOM_NAME) + " characters)");
+        return;
+    }
+    if (conn->room) {
+        if (conn->room->name == room_name) {
+            send_message(conn->socket, "You are already in room " + room_name + ".");
+            return;
+        }
+        leave_room(conn);
+    }
+    // Someone may have paired with us while we were unpaired in chat mode
+    ConnRef former = unpair_client(conn);
+    if (former) deliver_message(former, conn->name + " has left the chat.");
+    Room* room = find_room(room_name);
+    room_add(conn, room);
+    set_mode(conn, 'c');
+    send_message(conn->socket, "Joined room " + room_name + " (" + to_string(room_members(room)) +
+                 " members). Type '/leave' to exit.");
+    room_broadcast(room, conn, "[" + room_name + "] * " + conn->name + " joined");
+
+    char log_msg[BUFFER_SIZE];
+    snprintf(log_msg, sizeof(log_msg), "Client '%s' joined room '%s'", conn->name.c_str(), room_name.c_str());
+    log_event(log_msg);
+}
+
+// ---- History store -----------------------------------------------------------
+//
+// Chat relays and /msg messages are appended to a log of fixed-size segment
+// files in --history-dir, each mapped into memory for the life of the server.
+// An in-memory index keyed by (conversation, sequence) points straight at the
+// records, so /history and offline delivery copy text from the mapped pages
+// into the reply and nothing else. Records are only ever appended; on startup
+// the segments are scanned and the index rebuilt. Writes reach the page cache
+// as they happen, so a crashed or restarted server loses nothing; the kernel
+// writes them to disk in the background.
+
+// What a history record stands for
+enum HistoryType {
+    HISTORY_CHAT = 1,     // A message the recipient got as it was sent
+    HISTORY_OFFLINE,      // A /msg for a user who was not connected, held for them
+    HISTORY_DELIVERED,    // Everything held for a user was delivered (no text)
+    HISTORY_NAME          // A user registered this name for the first time (no text)
+};
+
+// What became of a /msg for a user who is not connected
+enum HoldResult {
+    HOLD_STORED,          // Held until they register the name
+    HOLD_UNKNOWN,         // Nobody has ever registered the name, so nothing is held
+    HOLD_FULL             // HISTORY_PENDING_MAX messages already wait for them
+};
+
+// Header of one record, followed by the sender's name, the recipient's name
+// and the text, padded to 8 bytes. The magic is written last: a record cut
+// short by a crash has none and ends the scan.
+struct HistoryRecord {
+    uint32_t magic;
+    uint16_t type;
+    uint16_t from_len;
+    uint16_t to_len;
+    uint16_t reserved;
+    uint32_t text_len;
+    uint64_t seq;                    // Position in its conversation, from 1; 0 for markers
+    uint64_t time;                   // Unix seconds
+};
+
+// Every message between two users, oldest first: seq n is records[n - 1]
+struct Conversation {
+    vector<const HistoryRecord*> records;
+};
+
+// Guarded by history_mutex. Segments are never unmapped, so record pointers
+// stay valid after the lock is dropped and records never change once written.
+struct HistoryStore {
+    string dir;                      // --history-dir; empty when history is off
+    vector<char*> segments;          // Mapped segment files, oldest first
+    size_t used;                     // Bytes written to the last segment
+    unordered_map<string, Conversation> conversations;          // Keyed by conversation_key()
+    unordered_map<string, deque<const HistoryRecord*> > pending;  // Offline messages by recipient
+    unordered_map<ConnRef, string> online;                      // Registered names, to find a chat partner's
+    unordered_set<string> names;                                // Every name ever registered, the only ones mail is held for
+};
+
+HistoryStore history;
+
+inline StrView record_from(const HistoryRecord* rec) {
+    return str_view((const char*)(rec + 1), rec->from_len);
+}
+
+inline StrView record_to(const HistoryRecord* rec) {
+    return str_view((const char*)(rec + 1) + rec->from_len, rec->to_len);
+}
+
+inline StrView record_text(const HistoryRecord* rec) {
+    return str_view((const char*)(rec + 1) + rec->from_len + rec->to_len, rec->text_len);
+}
+
+inline size_t record_size(size_t payload) {
+    return (sizeof(HistoryRecord) + payload + 7) & ~(size_t)7;
+}
+
+// The two names in order, so both sides find the same conversation. The
+// first is prefixed with its length rather than ended by a separator, so no
+// pair of names can produce another pair's key.
+string conversation_key(StrView a, StrView b) {
+    int order = memcmp(a.data, b.data, min(a.len, b.len));
+    if (order > 0 || (order == 0 && a.len > b.len)) swap(a, b);
+    string key = to_string(a.len);
+    key += ':';
+    key.append(a.data, a.len);
+    key.append(b.data, b.len);
+    return key;
+}
+
+// Add a record to the index; conv is its conversation if the caller knows it
+void history_index(const HistoryRecord* rec, Conversation* conv) {
+    StrView to = record_to(rec);
+    if (rec->type == HISTORY_NAME) {
+        history.names.insert(string(to.data, to.len));
+        return;
+    }
+    if (rec->type == HISTORY_DELIVERED) {
+        history.pending.erase(string(to.data, to.len));
+        return;
+    }
+    if (!conv) conv = &history.conversations[conversation_key(record_from(rec), to)];
+    conv->records.push_back(rec);
+    if (rec->type == HISTORY_OFFLINE) {
+        deque<const HistoryRecord*>& waiting = history.pending[string(to.data, to.len)];
+        waiting.push_back(rec);
+        if (waiting.size() > HISTORY_PENDING_MAX) waiting.pop_front();  // Only stores from before the cap; still in /history
+    }
+}
+
+// Map segment number index, creating the file if it does not exist yet
+char* map_segment(size_t index) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%08zu.seg", history.dir.c_str(), index);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return NULL;
+    struct stat st;
+    void* seg = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (st.st_size == HISTORY_SEGMENT_SIZE ||
+                                (st.st_size == 0 && ftruncate(fd, HISTORY_SEGMENT_SIZE) == 0))) {
+        seg = mmap(NULL, HISTORY_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    return seg == MAP_FAILED ? NULL : (char*)seg;
+}
+
+// Index the complete records at the start of a segment; returns where they end
+size_t scan_segment(const char* seg) {
+    size_t pos = 0;
+    while (pos + sizeof(HistoryRecord) <= HISTORY_SEGMENT_SIZE) {
+        const HistoryRecord* rec = (const HistoryRecord*)(seg + pos);
+        if (rec->magic != HISTORY_MAGIC) break;
+        size_t len = record_size((size_t)rec->from_len + rec->to_len + rec->text_len);
+        if (pos + len > HISTORY_SEGMENT_SIZE) break;
+        history_index(rec, NULL);
+        pos += len;
+    }
+    return pos;
+}
+
+// Map every segment in dir, in order, and rebuild the index from them
+bool history_open(const char* dir) {
+    uint64_t start = monotonic_ns();
+    history.dir = dir;
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror("History disabled");
+        history.dir.clear();
+        return false;
+    }
+    size_t records = 0;
+    char path[PATH_MAX];
+    struct stat st;
+    while (snprintf(path, sizeof(path), "%s/%08zu.seg", dir, history.segments.size()), stat(path, &st) == 0) {
+        char* seg = map_segment(history.segments.size());
+        if (!seg) {
+            fprintf(stderr, "History disabled: cannot map %s\n", path);
+            history.dir.clear();
+            return false;
+        }
+        history.segments.push_back(seg);
+        history.used = scan_segment(seg);
+    }
+    for (const auto& entry : history.conversations) {
+        records += entry.second.records.size();
+    }
+    char log_msg[BUFFER_SIZE];
+    snprintf(log_msg, sizeof(log_msg), "History: %zu messages in %zu conversations from %zu segments, indexed in %.1f ms.",
+             records, history.conversations.size(), history.segments.size(), (monotonic_ns() - start) / 1e6);
+    log_event(log_msg);
+    printf("%s\n", log_msg);
+    return true;
+}
+
+// Append a record to the log and index it; the caller holds history_mutex.
+// NULL if it cannot be stored (names too long, or the disk is full).
+const HistoryRecord* history_append(Conversation* conv, HistoryType type, StrView from, StrView to, StrView text) {
+    if (from.len > UINT16_MAX || to.len > UINT16_MAX) return NULL;
+    size_t len = record_size(from.len + to.len + text.len);
+    if (len > HISTORY_SEGMENT_SIZE) return NULL;
+    if (history.segments.empty() || history.used + len > HISTORY_SEGMENT_SIZE) {
+        char* seg = map_segment(history.segments.size());
+        if (!seg) return NULL;
+        if (!history.segments.empty()) msync(history.segments.back(), HISTORY_SEGMENT_SIZE, MS_ASYNC);
+        history.segments.push_back(seg);
+        history.used = 0;
+    }
+    char* at = history.segments.back() + history.used;
+    HistoryRecord* rec = (HistoryRecord*)at;
+    char* payload = (char*)(rec + 1);
+    memcpy(payload, from.data, from.len);
+    memcpy(payload + from.len, to.data, to.len);
+    memcpy(payload + from.len + to.len, text.data, text.len);
+    rec->type = (uint16_t)type;
+    rec->from_len = (uint16_t)from.len;
+    rec->to_len = (uint16_t)to.len;
+    rec->reserved = 0;
+    rec->text_len = (uint32_t)text.len;
+    rec->seq = conv ? conv->records.size() + 1 : 0;
+    rec->time = (uint64_t)time(NULL);
+    // Bytes left by a record torn in a crash must not pass for the next one
+    if (history.used + len + sizeof(HistoryRecord) <= HISTORY_SEGMENT_SIZE) ((HistoryRecord*)(at + len))->magic = 0;
+    __atomic_store_n(&rec->magic, HISTORY_MAGIC, __ATOMIC_RELEASE);
+    history.used += len;
+    metric_add(metrics()->history_appends, 1);
+    history_index(rec, conv);
+    return rec;
+}
+
+// Queue stored messages to a client as one reply: a header line, then
+// "name: text" per record, copied from the mapped pages into the buffer
+void send_records(Connection* conn, const string& header, const vector<const HistoryRecord*>& records) {
+    vector<StrView> parts;
+    parts.reserve(1 + 4 * records.size());
+    parts.push_back(str_view(header));
+    for (size_t i = 0; i < records.size(); i++) {
+        parts.push_back(str_view("\n  "));
+        parts.push_back(record_from(records[i]));
+        parts.push_back(str_view(": "));
+        parts.push_back(record_text(records[i]));
+    }
+    SharedBuf* buf = frame_parts(conn->framing, parts.data(), (int)parts.size());
+    queue_buf(conn, buf);
+    buf_release(buf);
+    metric_add(metrics()->history_replayed, records.size());
+}
+
+// A client registered its name: remember it for its chat partners, and hand
+// it everything sent to it while it was away. Names are not authenticated:
+// whoever registers a name gets what was held for it.
+void history_online(Connection* conn) {
+    vector<const HistoryRecord*> waiting;
+    lock_mutex(&history_mutex, LOCK_HISTORY);
+    history.online[conn_ref(conn)] = conn->name;
+    if (!history.names.count(conn->name)) {
+        history_append(NULL, HISTORY_NAME, str_view(""), str_view(conn->name), str_view(""));
+    }
+    unordered_map<string, deque<const HistoryRecord*> >::iterator found = history.pending.find(conn->name);
+    if (found != history.pending.end()) {
+        waiting.assign(found->second.begin(), found->second.end());
+        history_append(NULL, HISTORY_DELIVERED, str_view(""), str_view(conn->name), str_view(""));
+    }
+    pthread_mutex_unlock(&history_mutex);
+    if (waiting.empty()) return;
+    send_records(conn, "While you were away (" + to_string(waiting.size()) + " messages):", waiting);
+}
+
+void history_offline(Connection* conn) {
+    lock_mutex(&history_mutex, LOCK_HISTORY);
+    history.online.erase(conn_ref(conn));
+    pthread_mutex_unlock(&history_mutex);
+}
+
+// Record a relay to a chat partner. The partner's name and the conversation
+// are looked up on the first relay to it and kept on the connection.
+void history_chat(Connection* conn, ConnRef peer, StrView text) {
+    lock_mutex(&history_mutex, LOCK_HISTORY);
+    if (conn->history_peer != peer) {
+        unordered_map<ConnRef, string>::iterator found = history.online.find(peer);
+        conn->history_peer = peer;
+        conn->history_conv = NULL;
+        if (found != history.online.end()) {
+            conn->history_partner = found->second;
+            conn->history_conv = &history.conversations[conversation_key(str_view(conn->name), str_view(found->second))];
+        }
+    }
+    if (conn->history_conv) {
+        history_append(conn->history_conv, HISTORY_CHAT, str_view(conn->name), str_view(conn->history_partner), text);
+    }
+    pthread_mutex_unlock(&history_mutex);
+}
+
+// Record a /msg and find its recipient under one lock, so a recipient
+// registering meanwhile either is found here or finds the message waiting.
+// Returns the recipient's connection, or 0 if it is not connected; then
+// hold says whether the message was kept for it. Mail is only held for
+// names someone has registered before, and only HISTORY_PENDING_MAX of it,
+// so made-up names cannot grow the log.
+ConnRef history_message(Connection* conn, const string& to, StrView text, HoldResult* hold) {
+    lock_mutex(&history_mutex, LOCK_HISTORY);
+    ConnRef ref = lookup_name(to);
+    bool online = resolve_ref(ref) != NULL;
+    *hold = HOLD_STORED;
+    if (!online && !history.names.count(to)) {
+        *hold = HOLD_UNKNOWN;
+    } else if (!online) {
+        unordered_map<string, deque<const HistoryRecord*> >::iterator waiting = history.pending.find(to);
+        if (waiting != history.pending.end() && waiting->second.size() >= HISTORY_PENDING_MAX) *hold = HOLD_FULL;
+    }
+    if (*hold == HOLD_STORED) {
+        Conversation* conv = &history.conversations[conversation_key(str_view(conn->name), str_view(to))];
+        history_append(conv, online ? HISTORY_CHAT : HISTORY_OFFLINE, str_view(conn->name), str_view(to), text);
+    }
+    pthread_mutex_unlock(&history_mutex);
+    return online ? ref : 0;
+}
+
+// The last count messages between two users; returns how many there are in all
+size_t history_recent(const string& a, const string& b, size_t count, vector<const HistoryRecord*>& out) {
+    string key = conversation_key(str_view(a), str_view(b));
+    lock_mutex(&history_mutex, LOCK_HISTORY);
+    unordered_map<string, Conversation>::iterator found = history.conversations.find(key);
+    size_t total = found != history.conversations.end() ? found->second.records.size() : 0;
+    if (total) {
+        const vector<const HistoryRecord*>& records = found->second.records;
+        out.assign(records.end() - min(count, total), records.end());
+    }
+    pthread_mutex_unlock(&history_mutex);
+    return total;
+}
+
+// OP_COMPRESS, before OP_HELLO: take the first codec in the client's list
+// that this build has, and answer with it (an empty payload if none)
+void handle_compress(Connection* conn, const MsgView& view) {
+    Codec chosen = CODEC_NONE;
+    for (size_t i = 0; i < view.len && chosen == CODEC_NONE; i++) {
+        if (codec_available((unsigned char)view.data[i])) chosen = (Codec)(unsigned char)view.data[i];
+    }
+    codec_release(conn);
+    conn->codec = chosen;
+    char reply = (char)chosen;
+    StrView part = str_view(&reply, chosen != CODEC_NONE);
+    send_binary(conn, OP_COMPRESS, &part, 1);
+}
+
+// Tell a binary client its user id
+void send_welcome(Connection* conn) {
+    char id[USER_ID_SIZE];
+    StrView part = id_view(id, conn_ref(conn));
+    send_binary(conn, OP_WELCOME, &part, 1);
+}
+
+// Handle the name negotiation step; returns true once the name is registered
+bool handle_name(Connection* conn, const MsgView& view) {
+    int client_socket = conn->socket;
+    string client_name(view.data, view.len);
+    client_name.erase(client_name.find_last_not_of(" \n\r\t") + 1);
+
+    // Length-prefixed and binary framing can carry any byte; a name with a
+    // line break in it would pass for two names in replies and logs
+    for (size_t i = 0; i < client_name.size(); i++) {
+        unsigned char c = (unsigned char)client_name[i];
+        if (c < 0x20 || c == 0x7f) {
+            send_error(conn, "Names cannot contain control characters. Please Try another ");
+            return false;
+        }
+    }
+    if (!register_name(client_name, conn_ref(conn))) {
+        send_error(conn, "Name already exists. Please Try another ");
+        return false;
+    }
+
+    conn->name = client_name;
+    conn->state = CONN_ACTIVE;
+    if (conn->framing == FRAMING_BINARY) {
+        send_welcome(conn);
+    } else {
+        send_message(client_socket, "Welcome to the server!");
+        send_message(client_socket, "Type '/startchat' to enter chat mode or '/startecho' to enter echo mode");
+    }
+    if (!history.dir.empty()) history_online(conn);
+
+    // Log connection
+    char log_msg[BUFFER_SIZE];
+    snprintf(log_msg, sizeof(log_msg), "Client '%s' connected (socket %d).", client_name.c_str(), client_socket);
+    log_event(log_msg);
+    printf("%s\n", log_msg);
+    return true;
+}
+
+// Where a client is, as far as commands go; a command table entry lists the
+// places it is recognized in
+enum ClientPlace {
+    IN_ECHO = 1,      // Echo mode
+    IN_CHAT = 2,      // Chat mode without a partner
+    IN_PAIRED = 4,    // Chatting with a partner
+    IN_ROOM = 8       // Member of a room
+};
+
+int client_place(Connection* conn) {
+    if (conn->room) return IN_ROOM;
+    if (conn->mode.load(memory_order_relaxed) == 'e') return IN_ECHO;
+    return conn->peer.load(memory_order_acquire) ? IN_PAIRED : IN_CHAT;
+}
+
+// Tell a client's partner, if any, that the chat is over; returns whether there was one
+bool end_chat(Connection* conn) {
+    ConnRef former = unpair_client(conn);
+    if (former) {
+        StrView parts[] = { str_view(conn->name), str_view(" has left the chat.") };
+        deliver_message(former, parts, 2);
+    }
+    return former != 0;
+}
+
+void command_list(Connection* conn, int place, StrView args) {
+    send_user_list(conn, string(args.data, args.len));
+}
+
+void command_help(Connection* conn, int place, StrView args) {
+    const char* help_text;
+    if (place == IN_ECHO) {
+        help_text = "Commands:\n"
+                    "  /startchat - Switch to chat mode\n"
+                    "  /startecho - Switch to echo mode\n"
+                    "  /join <room> - Join a chat room\n"
+                    "  /list [prefix [page]] - Show connected users and their modes\n"
+                    "  /msg <name> <message> - Message a user, held for them if they are away\n"
+                    "  /history <name> [n] - Show your last n messages with a user\n"
+                    "  /help - Show this help message\n"
+                    "  /quit - Quit application";
+    } else if (place == IN_ROOM) {
+        help_text = "Commands:\n"
+                    "  /leave - Leave the room\n"
+                    "  /join <room> - Move to another room\n"
+                    "  /list [prefix [page]] - Show connected users\n"
+                    "  /msg <name> <message> - Message a user, held for them if they are away\n"
+                    "  /history <name> [n] - Show your last n messages with a user\n"
+                    "  /startecho - Leave the room and switch to echo mode\n"
+                    "  /quit - Disconnect from server\n"
+                    "  /help - Show this help message";
+    } else {
+        help_text = "Commands:\n"
+                    "  /chat <name> - Request chat with another user\n"
+                    "  /join <room> - Join a chat room\n"
+                    "  /list [prefix [page]] - Show connected users\n"
+                    "  /msg <name> <message> - Message a user, held for them if they are away\n"
+                    "  /history <name> [n] - Show your last n messages with a user\n"
+                    "  /exit - Leave current chat\n"
+                    "  /startecho - Switch to echo mode\n"
+                    "  /quit - Disconnect from server\n"
+                    "  /help - Show this help message";
+    }
+    send_message(conn->socket, help_text);
+}
+
+void command_startchat(Connection* conn, int place, StrView args) {
+    set_mode(conn, 'c');
+    send_message(conn->socket, "Switched to chat mode. Use /chat <name> to start chatting with someone.");
+}
+
+void command_startecho(Connection* conn, int place, StrView args) {
+    if (place == IN_ROOM) {
+        leave_room(conn);
+        set_mode(conn, 'e');
+        send_message(conn->socket, "Left the room. Switched to echo mode.");
+    } else if (place == IN_PAIRED) {
+        end_chat(conn);
+        send_message(conn->socket, "Chat ended. Switching to echo mode.");
+        set_mode(conn, 'e');
+    } else {
+        // Someone may have paired with us since we looked
+        if (end_chat(conn)) send_message(conn->socket, "Chat ended.");
+        set_mode(conn, 'e');
+        send_message(conn->socket, "Switched to echo mode.");
+    }
+}
+
+// /chat <name>: pair with another client in chat mode
+void command_chat(Connection* conn, int place, StrView args) {
+    int client_socket = conn->socket;
+    if (place == IN_ROOM) {
+        send_message(client_socket, "Leave the room with /leave before starting a private chat.");
+        return;
+    }
+    string target_name(args.data, args.len);
+    if (target_name.empty()) {
+        send_message(client_socket, "Usage: /chat <name>");
+        return;
+    }
+
+    ConnRef target_ref = lookup_name(target_name);
+    Connection* target = resolve_ref(target_ref);
+    string reply;
+    if (!target) {
+        reply = "Client not found: " + target_name;
+    } else if (target == conn) {
+        reply = "You cannot chat with yourself.";
+    } else if (target->peer.load(memory_order_acquire)) {
+        reply = "Client is already in a chat with someone else.";
+    } else if (target->room) {
+        reply = "Cannot start chat: " + target_name + " is in a room.";
+    } else if (target->mode.load(memory_order_relaxed) == 'e') {
+        reply = "Cannot start chat: " + target_name + " is in echo mode. They need to switch to chat mode first.";
+    } else {
+        pair_clients(conn, target, &reply);
+    }
+
+    if (!reply.empty()) {
+        send_message(client_socket, reply);
+        return;
+    }
+
+    send_message(client_socket, "Chat started with " + target_name + ". Type '/exit' to end.");
+    deliver_message(target_ref, "Chat started with " + conn->name + ". Type '/exit' to end.");
+
+    // Log chat start
+    char log_msg[BUFFER_SIZE + 50];
+    snprintf(log_msg, sizeof(log_msg), "Chat started between '%s' and '%s'",
+             conn->name.c_str(), target_name.c_str());
+    log_event(log_msg);
+}
+
+void command_exit(Connection* conn, int place, StrView args) {
+    end_chat(conn);
+    send_message(conn->socket, "Chat ended.");
+}
+
+void command_join(Connection* conn, int place, StrView args) {
+    if (place == IN_PAIRED) {
+        send_message(conn->socket, "Leave the chat with /exit before joining a room.");
+        return;
+    }
+    join_room(conn, string(args.data, args.len));
+}
+
+void command_leave(Connection* conn, int place, StrView args) {
+    string room_name = conn->room->name;
+    leave_room(conn);
+    send_message(conn->socket, "Left room " + room_name + ".");
+}
+
+// /msg <name> <text>: message one user, in any mode. With history on, a
+// known user who is not connected gets it when they next register that name.
+void command_msg(Connection* conn, int place, StrView args) {
+    const char* space = (const char*)memchr(args.data, ' ', args.len);
+    StrView text = space ? trimmed_view(space + 1, args.len - (space + 1 - args.data)) : str_view("");
+    if (!space || space == args.data || text.len == 0) {
+        send_message(conn->socket, "Usage: /msg <name> <message>");
+        return;
+    }
+    string target_name(args.data, space - args.data);
+    if (target_name == conn->name) {
+        send_message(conn->socket, "You cannot message yourself.");
+        return;
+    }
+    HoldResult hold = HOLD_UNKNOWN;
+    ConnRef target = history.dir.empty() ? lookup_name(target_name) : history_message(conn, target_name, text, &hold);
+    if (resolve_ref(target)) {
+        deliver_from(target, conn, text);
+        send_message(conn->socket, "Sent to " + target_name + ".");
+    } else if (hold == HOLD_STORED) {
+        send_message(conn->socket, target_name + " is away; the message will be delivered when they connect.");
+    } else if (hold == HOLD_FULL) {
+        send_message(conn->socket, target_name + " is away with " + to_string(HISTORY_PENDING_MAX) +
+                                       " messages waiting; the message was not stored.");
+    } else {
+        send_message(conn->socket, "Client not found: " + target_name);
+    }
+}
+
+// /history <name> [n]: the last n messages between the client and name
+void command_history(Connection* conn, int place, StrView args) {
+    if (history.dir.empty()) {
+        send_message(conn->socket, "History is not enabled on this server.");
+        return;
+    }
+    const char* space = (const char*)memchr(args.data, ' ', args.len);
+    string target_name(args.data, space ? (size_t)(space - args.data) : args.len);
+    long count = space ? strtol(string(space + 1, args.len - (space + 1 - args.data)).c_str(), NULL, 10) : HISTORY_REPLAY_DEFAULT;
+    if (target_name.empty() || count < 1) {
+        send_message(conn->socket, "Usage: /history <name> [count]");
+        return;
+    }
+    vector<const HistoryRecord*> records;
+    size_t total = history_recent(conn->name, target_name, min(count, (long)HISTORY_REPLAY_MAX), records);
+    if (!total) {
+        send_message(conn->socket, "No messages with " + target_name + " yet.");
+        return;
+    }
+    send_records(conn, "History with " + target_name + " (messages " + to_string(total - records.size() + 1) + "-" +
+                       to_string(total) + " of " + to_string(total) + "):", records);
+}
+
+// One slash command. Where it is not recognized, the text is an ordinary
+// message: echoed, relayed to the partner or broadcast to the room.
+struct CommandSpec {
+    MetricCommand id;
+    const char* name;
+    size_t len;
+    bool takes_args;                 // "/cmd args" matches too, not just "/cmd"
+    int places;                      // IN_* flags
+    void (*handler)(Connection* conn, int place, StrView args);
+};
+
+#define COMMAND(id, name, args, places, handler) { id, name, sizeof(name) - 1, args, places, handler }
+
+// Indexed by MetricCommand, which also keys the per-command metrics
+constexpr CommandSpec command_table[CMD_COUNT] = {
+    COMMAND(CMD_LIST, "/list", true, IN_ECHO | IN_CHAT | IN_ROOM, command_list),
+    COMMAND(CMD_HELP, "/help", false, IN_ECHO | IN_CHAT | IN_ROOM, command_help),
+    COMMAND(CMD_STARTCHAT, "/startchat", false, IN_ECHO, command_startchat),
+    COMMAND(CMD_STARTECHO, "/startecho", false, IN_ECHO | IN_CHAT | IN_PAIRED | IN_ROOM, command_startecho),
+    COMMAND(CMD_CHAT, "/chat", true, IN_CHAT | IN_ROOM, command_chat),
+    COMMAND(CMD_EXIT, "/exit", false, IN_PAIRED, command_exit),
+    COMMAND(CMD_JOIN, "/join", true, IN_ECHO | IN_CHAT | IN_PAIRED | IN_ROOM, command_join),
+    COMMAND(CMD_LEAVE, "/leave", false, IN_ROOM, command_leave),
+    COMMAND(CMD_MSG, "/msg", true, IN_ECHO | IN_CHAT | IN_PAIRED | IN_ROOM, command_msg),
+    COMMAND(CMD_HISTORY, "/history", true, IN_ECHO | IN_CHAT | IN_PAIRED | IN_ROOM, command_history),
+};
+
+#undef COMMAND
+
+constexpr bool command_table_ordered(int i) {
+    return i == CMD_COUNT || (command_table[i].id == i && command_table_ordered(i + 1));
+}
+static_assert(command_table_ordered(0), "command_table must be in MetricCommand order");
+
+// The command a word names, or CMD_COUNT. Length and one distinguishing byte
+// pick the only candidate, and a single memcmp confirms it; a new command
+// needs a case here as well as its table entry.
+MetricCommand lookup_command(StrView word) {
+    MetricCommand id = CMD_COUNT;
+    switch (word.len) {
+    case 4:
+        id = CMD_MSG;
+        break;
+    case 5:
+        switch (word.data[1]) {
+        case 'l': id = CMD_LIST; break;
+        case 'h': id = CMD_HELP; break;
+        case 'c': id = CMD_CHAT; break;
+        case 'e': id = CMD_EXIT; break;
+        case 'j': id = CMD_JOIN; break;
+        }
+        break;
+    case 6:
+        id = CMD_LEAVE;
+        break;
+    case 8:
+        id = CMD_HISTORY;
+        break;
+    case 10:
+        id = word.data[6] == 'c' ? CMD_STARTCHAT : CMD_STARTECHO;
+        break;
+    }
+    if (id == CMD_COUNT || memcmp(word.data, command_table[id].name, word.len) != 0) return CMD_COUNT;
+    return id;
+}
+
+// Run msg as a command if it is one where the client is; false if it is an ordinary message
+bool run_command(Connection* conn, int place, StrView msg) {
+    const char* space = (const char*)memchr(msg.data, ' ', msg.len);
+    StrView word = str_view(msg.data, space ? (size_t)(space - msg.data) : msg.len);
+    MetricCommand id = lookup_command(word);
+    if (id == CMD_COUNT) return false;
+    const CommandSpec& cmd = command_table[id];
+    if (!(cmd.places & place) || (space && !cmd.takes_args)) return false;
+    count_command(id);
+    StrView args = space ? str_view(space + 1, msg.len - (space + 1 - msg.data)) : str_view("");
+    cmd.handler(conn, place, args);
+    return true;
+}
+
+// Handle one message from a client that has completed name negotiation.
+// Anything not starting with '/' skips the command table altogether.
+void handle_message(Connection* conn, const MsgView& view) {
+    StrView msg = trimmed_view(view.data, view.len);
+    int place = client_place(conn);
+    if (msg.len > 0 && msg.data[0] == '/' && run_command(conn, place, msg)) return;
+
+    const string& client_name = conn->name;
+    char log_msg[BUFFER_SIZE + 50];
+    if (place == IN_ECHO) {
+        if (view.frame) {
+            queue_bytes(conn, view.frame, view.frame_len);
+        } else {
+            // An item of a binary batch goes back as a frame of its own
+            StrView part = str_view(view.data, view.len);
+            send_binary(conn, OP_MESSAGE, &part, 1);
+        }
+        // Logged through the async ring; nothing is printed per message on the reactor thread
+        snprintf(log_msg, sizeof(log_msg), "Client '%s' (echo mode): %.*s", client_name.c_str(), (int)view.len, view.data);
+        log_event(log_msg);
+    } else if (place == IN_ROOM) {
+        if (msg.len == 0) return;
+        StrView parts[] = { str_view("["), str_view(conn->room->name), str_view("] "), str_view(client_name), str_view(": "), msg };
+        room_broadcast(conn->room, conn, parts, 6);
+
+        snprintf(log_msg, sizeof(log_msg), "Room '%s' message from '%s': %.*s",
+                 conn->room->name.c_str(), client_name.c_str(), (int)view.len, view.data);
+        log_event(log_msg);
+    } else if (place == IN_PAIRED) {
+        // The pairing lives on the connection, so no lock is needed to find the peer
+        ConnRef peer = conn->peer.load(memory_order_acquire);
+        if (output_backlogged(peer)) {
+            // Never let a slow reader make us buffer without bound
+            send_message(conn->socket, "Message not delivered: your chat partner is not keeping up.");
+        } else if (msg.len > 0) {
+            deliver_from(peer, conn, msg);
+            if (!history.dir.empty()) history_chat(conn, peer, msg);
+
+            // Log chat message
+            snprintf(log_msg, sizeof(log_msg), "Chat from '%s' to peer: %.*s", client_name.c_str(), (int)view.len, view.data);
+            log_event(log_msg);
+        }
+    } else {
+        send_message(conn->socket, "You are in chat mode but not chatting with anyone. Use /chat <name> to start a chat or /startecho to switch to echo mode.");
+    }
+}
+
+// A binary protocol request other than OP_MESSAGE, from a logged-in client
+void handle_binary(Connection* conn, const MsgView& view) {
+    char id[USER_ID_SIZE];
+    switch (view.op) {
+    case OP_SEND: {
+        if (view.len < USER_ID_SIZE) {
+            send_error(conn, "OP_SEND needs a user id.");
+            return;
+        }
+        ConnRef target = load_be64(view.data);
+        StrView text = str_view(view.data + USER_ID_SIZE, view.len - USER_ID_SIZE);
+        if (!resolve_ref(target)) {
+            send_error(conn, "No such user.");
+        } else if (output_backlogged(target)) {
+            send_error(conn, "Message not delivered: the recipient is not keeping up.");
+        } else {
+            deliver_from(target, conn, text);
+            if (!history.dir.empty()) history_chat(conn, target, text);
+        }
+        break;
+    }
+    case OP_LOOKUP: {
+        ConnRef ref = lookup_name(string(view.data, view.len));
+        StrView parts[] = { id_view(id, resolve_ref(ref) ? ref : 0), str_view(view.data, view.len) };
+        send_binary(conn, OP_USER, parts, 2);
+        break;
+    }
+    case OP_HELLO:
+        send_error(conn, "Already logged in as " + conn->name + ".");
+        break;
+    case OP_COMPRESS:
+        send_error(conn, "Compression is negotiated before OP_HELLO.");
+        break;
+    default:
+        send_error(conn, "Unknown opcode " + to_string(view.op) + ".");
+    }
+}
+
+// Release everything held by a connection and close its socket
+void close_connection(Connection* conn) {
+    int client_socket = conn->socket;
+    char log_msg[BUFFER_SIZE];
+    bool was_active = conn->state == CONN_ACTIVE;
+    if (was_active) {
+        const string& client_name = conn->name;
+        if (conn->room) leave_room(conn);
+
+        // Client disconnected
+        ConnRef peer = unpair_client(conn);
+        if (peer) {
+            StrView parts[] = { str_view(client_name), str_view(" has disconnected.") };
+            deliver_message(peer, parts, 2);
+        }
+        unregister_name(client_name, conn_ref(conn));
+        if (!history.dir.empty()) history_offline(conn);
+
+        snprintf(log_msg, sizeof(log_msg), "Client '%s' disconnected (socket %d).", client_name.c_str(), client_socket);
+    }
+    if (!conn->send_inflight) flush_output(conn);  // Best effort, e.g. a final error message
+    discard_output(conn);
+    timer_cancel(conn->reactor->timers, &conn->timer);
+    if (conn->ip) ip_release(conn->ip);
+    remove_client(conn);
+    // Ends any io_uring requests still holding the socket open
+    if (io_backend == IO_URING) shutdown(client_socket, SHUT_RDWR);
+    close(client_socket);
+    if (was_active) {
+        log_event(log_msg);
+        printf("%s\n", log_msg);
+    }
+    release_client();
+}
+
+bool resume_input(Connection* conn);
+void dispatch_message(Connection* conn, const MsgView& view);
+void finish_input(Connection* conn);
+
+// The client went quiet partway through a name line: take what it sent as the name
+void take_unterminated_name(Connection* conn) {
+    InputBuffer* in = &conn->in;
+    MsgView view;
+    view.data = view.frame = in->data + in->start;
+    view.len = view.frame_len = in->end - in->start;
+    view.op = OP_MESSAGE;
+    view.tag = 0;
+    in->start = in->end;
+    dispatch_message(conn, view);
+    finish_input(conn);
+}
+
+// A connection's timer went off: resume reading once a rate limit's wait is
+// over, close it if one of its timeouts has really passed, otherwise re-arm
+// for whatever deadline activity has moved it to
+void check_timeouts(Connection* conn) {
+    uint64_t now = conn->reactor->now_ms;
+    if (conn->throttled_until && now >= conn->throttled_until) {
+        conn->throttled_until = 0;
+        if (!resume_input(conn)) {
+            close_connection(conn);
+            return;
+        }
+    }
+    if (name_pending(conn) && !conn->throttled_until && now >= conn->input_ms + NAME_QUIET_MS) {
+        take_unterminated_name(conn);
+    }
+    TimeoutReason reason = TIMEOUT_COUNT;
+    if (conn->state == CONN_NAME && handshake_timeout_ms && now >= conn->opened_ms + handshake_timeout_ms) {
+        reason = TIMEOUT_HANDSHAKE;
+    } else if (conn->out.count > 0 && write_stall_timeout_ms && now >= conn->output_ms + write_stall_timeout_ms) {
+        reason = TIMEOUT_WRITE_STALL;
+    } else if (conn->state == CONN_ACTIVE && idle_timeout_ms &&
+               now >= max(conn->input_ms, conn->output_ms) + idle_timeout_ms) {
+        reason = TIMEOUT_IDLE;
+    }
+    if (reason == TIMEOUT_COUNT) {
+        schedule_timeout(conn);
+        return;
+    }
+
+    metric_add(metrics()->timeouts[reason], 1);
+    char log_msg[BUFFER_SIZE];
+    snprintf(log_msg, sizeof(log_msg), "Closing socket %d ('%s'): %s timeout.", conn->socket, conn->name.c_str(),
+             timeout_names[reason]);
+    log_event(log_msg);
+    // A stalled client would never read a goodbye
+    if (reason == TIMEOUT_HANDSHAKE) send_message(conn->socket, "Timed out waiting for your name.");
+    if (reason == TIMEOUT_IDLE) send_message(conn->socket, "Disconnected after being idle too long.");
+    close_connection(conn);
+}
+
+// Advance a reactor's timer wheel to its clock, firing every timer passed on the way
+void run_timers(Reactor* r) {
+    TimerWheel* w = r->timers;
+    uint64_t tick = r->now_ms / TIMER_TICK_MS;
+    if (w->armed == 0) {
+        w->now = tick;
+        return;
+    }
+    while (w->now < tick) {
+        w->now++;
+        if ((w->now & (WHEEL_SLOTS - 1)) == 0) {
+            // Spread the next 256 ticks' worth of outer timers over the inner wheel
+            TimerNode* head = &w->outer[(w->now >> WHEEL_BITS) & (WHEEL_OUTER_SLOTS - 1)];
+            TimerNode* node = head->next;
+            head->prev = head->next = head;
+            while (node != head) {
+                TimerNode* next = node->next;
+                w->armed--;
+                timer_insert(w, node);
+                node = next;
+            }
+        }
+        TimerNode* head = &w->inner[w->now & (WHEEL_SLOTS - 1)];
+        while (head->next != head) {
+            TimerNode* node = head->next;
+            timer_cancel(w, node);
+            check_timeouts(node->conn);
+        }
+    }
+}
+
+// Make room to receive more bytes; returns false if a single message outgrows
+// max_message (plus any slack the caller allows for bytes it cannot refuse)
+bool input_reserve(InputBuffer* in, size_t slack = 0) {
+    if (!in->data) {
+        in->data = (char*)counted_malloc(BUFFER_SIZE);
+        in->cap = BUFFER_SIZE;
+        in->start = in->end = in->scanned = 0;
+        return in->data != NULL;
+    }
+    if (in->end < in->cap) return true;
+    if (in->start > 0) {
+        memmove(in->data, in->data + in->start, in->end - in->start);
+        in->end -= in->start;
+        in->start = 0;
+        return true;
+    }
+    size_t limit = max_message + BINARY_HEADER + slack;  // The longest header any framing uses
+    if (in->cap >= limit) return false;
+    size_t cap = min(in->cap * 2, limit);
+    char* data = (char*)counted_realloc(in->data, cap);
+    if (!data) return false;
+    in->data = data;
+    in->cap = cap;
+    return true;
+}
+
+__thread char* inflate_buf = NULL;   // Decompressed payload of the message being handled
+__thread size_t inflate_cap = 0;
+
+// Point a compressed binary frame's view at its decompressed payload, in a
+// buffer the thread reuses; the frame itself is left as it came, so an echo
+// goes back still compressed. False if it is corrupt or too big.
+bool inflate_message(Connection* conn, MsgView* view) {
+    if (conn->codec == CODEC_NONE || view->len < 4) return false;
+    size_t raw_len = load_be32(view->data);
+    if (raw_len > max_message) return false;
+    if (inflate_cap < raw_len) {
+        inflate_cap = max(raw_len, (size_t)BUFFER_SIZE);
+        free(inflate_buf);
+        inflate_buf = (char*)counted_malloc(inflate_cap);
+    }
+    uint64_t start = monotonic_ns();
+    bool ok = codec_decompress(conn->codec, view->data + 4, view->len - 4, inflate_buf, raw_len);
+    metric_add(metrics()->codec_ns[1], monotonic_ns() - start);
+    view->data = inflate_buf;
+    view->len = raw_len;
+    return ok;
+}
+
+// Parse the next complete message out of the input buffer without copying it.
+// Returns 1 with *view filled in, 0 if more bytes are needed, -1 if the
+// message is larger than max_message or overruns the batch it is in, -2 if
+// a compressed frame does not decompress.
+int next_message(Connection* conn, MsgView* view) {
+    InputBuffer* in = &conn->in;
+    if (conn->framing == FRAMING_UNKNOWN) {
+        if (in->end == in->start) return 0;
+        unsigned char first = in->data[in->start];
+        if (first == FRAME_LENGTH_MAGIC) {
+            conn->framing = FRAMING_LENGTH;
+            in->start++;
+        } else if (first == BINARY_MAGIC) {
+            conn->framing = FRAMING_BINARY;
+            in->start++;
+        } else {
+            conn->framing = FRAMING_NEWLINE;
+        }
+    }
+
+    // A binary batch header is consumed on its own; its items are parsed as they arrive
+    while (conn->framing == FRAMING_BINARY && !conn->batch_left && in->end - in->start >= BINARY_HEADER &&
+           (in->data[in->start + 1] & BINARY_BATCH)) {
+        conn->batch_op = (unsigned char)in->data[in->start];
+        conn->batch_left = load_be32(in->data + in->start + 4);
+        in->start += BINARY_HEADER;
+    }
+
+    const char* begin = in->data + in->start;
+    size_t avail = in->end - in->start;
+    view->op = OP_MESSAGE;
+    view->tag = 0;
+    if (conn->framing == FRAMING_LENGTH) {
+        if (avail < FRAME_HEADER) return 0;
+        size_t len = load_be32(begin);
+        if (len > max_message) return -1;
+        if (avail < FRAME_HEADER + len) return 0;
+        view->data = begin + FRAME_HEADER;
+        view->len = len;
+        view->frame = begin;
+        view->frame_len = FRAME_HEADER + len;
+    } else if (conn->batch_left) {
+        // The next (length, message) item of a binary batch
+        if (avail < FRAME_HEADER) return 0;
+        size_t len = load_be32(begin);
+        if (len > max_message || FRAME_HEADER + len > conn->batch_left) return -1;
+        if (avail < FRAME_HEADER + len) return 0;
+        view->data = begin + FRAME_HEADER;
+        view->len = len;
+        view->frame = NULL;
+        view->frame_len = FRAME_HEADER + len;
+        view->op = conn->batch_op;
+        conn->batch_left -= view->frame_len;
+    } else if (conn->framing == FRAMING_BINARY) {
+        if (avail < BINARY_HEADER) return 0;
+        size_t len = load_be32(begin + 4);
+        if (len > max_message) return -1;
+        if (avail < BINARY_HEADER + len) return 0;
+        view->data = begin + BINARY_HEADER;
+        view->len = len;
+        view->frame = begin;
+        view->frame_len = BINARY_HEADER + len;
+        view->op = (unsigned char)begin[0];
+        view->tag = load_be16(begin + 2);
+        if ((begin[1] & BINARY_COMPRESSED) && !inflate_message(conn, view)) return -2;
+    } else {
+        const char* newline = (const char*)memchr(begin + in->scanned, '\n', avail - in->scanned);
+        if (!newline) {
+            in->scanned = avail;
+            return avail > max_message ? -1 : 0;
+        }
+        view->data = begin;
+        view->len = newline - begin;
+        view->frame = begin;
+        view->frame_len = view->len + 1;
+        if (view->len > max_message) return -1;
+    }
+    in->start += view->frame_len;
+    in->scanned = 0;
+    return 1;
+}
+
+// Dispatch one parsed message according to the connection state. A tagged
+// binary request always gets at least one reply carrying its tag, OP_ACK if
+// handling it produced nothing else, so pipelining clients can match them up.
+void dispatch_message(Connection* conn, const MsgView& view) {
+    uint64_t start = monotonic_ns();
+    if (view.tag) {
+        reply_tag.conn = conn;
+        reply_tag.tag = (uint16_t)view.tag;
+        reply_tag.replied = false;
+    }
+    if (conn->state == CONN_NAME) {
+        if (conn->framing != FRAMING_BINARY || view.op == OP_HELLO) handle_name(conn, view);
+        else if (view.op == OP_COMPRESS) handle_compress(conn, view);
+        else send_error(conn, "Log in with OP_HELLO first.");
+        record_service(MODE_NAME, monotonic_ns() - start);
+    } else {
+        MetricMode mode = conn->room ? MODE_ROOM : conn->mode.load(memory_order_relaxed) == 'c' ? MODE_CHAT : MODE_ECHO;
+        if (view.op == OP_MESSAGE) handle_message(conn, view);
+        else handle_binary(conn, view);
+        record_service(mode, monotonic_ns() - start);
+    }
+    if (reply_tag.conn) {
+        if (!reply_tag.replied) send_binary(conn, OP_ACK, NULL, 0);
+        reply_tag.conn = NULL;
+    }
+}
+
+// Stop reading from a connection that overdrew a rate limit. Nothing is
+// dropped: unread bytes stay in the kernel, TCP flow control holds the sender
+// back, and the timer wheel resumes reading once the debt is paid off.
+void throttle_input(Connection* conn, uint64_t wait_ms, ThrottleScope scope) {
+    uint64_t until = conn->reactor->now_ms + wait_ms;
+    if (conn->throttled_until >= until) return;
+    if (!conn->throttled_until) metric_add(metrics()->throttles[scope], 1);
+    conn->throttled_until = until;
+    schedule_timeout(conn);
+}
+
+// Charge one message to the connection's own buckets
+inline void charge_client(Connection* conn, size_t bytes) {
+    uint64_t now = conn->reactor->now_ms;
+    uint64_t wait = max(bucket_charge(&conn->msg_tokens, client_msg_rate, now, 1),
+                        bucket_charge(&conn->byte_tokens, client_byte_rate, now, bytes));
+    if (wait) throttle_input(conn, wait, THROTTLE_CLIENT);
+}
+
+// Charge a batch of messages to the buckets shared by the connection's
+// address. Batching keeps the shard lock off the per-message path; any
+// overdraft is paid back before any connection from the address is read again.
+void charge_address(Connection* conn, uint64_t msgs, uint64_t bytes) {
+    IpLimit* limit = conn->ip;
+    IpShard* shard = ip_shard(limit->addr);
+    uint64_t now = conn->reactor->now_ms;
+    lock_mutex(&shard->lock, LOCK_IP);
+    uint64_t wait = max(bucket_charge(&limit->msg_tokens, ip_msg_rate, now, msgs),
+                        bucket_charge(&limit->byte_tokens, ip_byte_rate, now, bytes));
+    if (wait) limit->paused_until.store(now + wait, memory_order_relaxed);
+    pthread_mutex_unlock(&shard->lock);
+    if (wait) throttle_input(conn, wait, THROTTLE_IP);
+}
+
+// Parse and handle every complete message in the input buffer. One read may
+// carry many messages, or only part of one. On the echo fast path,
+// consecutive plain echo frames sit next to each other in the buffer and go
+// back out in a single send, uncopied and unlogged. Parsing stops early when a
+// rate limit is overdrawn; the rest waits in the buffer. Returns false when
+// the connection must be closed.
+bool process_input(Connection* conn) {
+    MsgView view;
+    const char* echo_run = NULL;
+    size_t echo_len = 0;
+    uint64_t echo_count = 0;             // Fast-path echoes are counted but not timed
+    bool client_limited = client_msg_rate > 0 || client_byte_rate > 0;
+    uint64_t batch_msgs = 0, batch_bytes = 0;
+    int parsed = 0;
+    if (conn->ip) {
+        // Another connection from the same address may have run up its debt
+        uint64_t now = conn->reactor->now_ms;
+        uint64_t until = conn->ip->paused_until.load(memory_order_relaxed);
+        if (until > now) throttle_input(conn, until - now, THROTTLE_IP);
+    }
+    while (!conn->throttled_until && (parsed = next_message(conn, &view)) > 0) {
+        if (client_limited) charge_client(conn, view.frame_len);
+        batch_msgs++;
+        batch_bytes += view.frame_len;
+        // A large uncompressed frame from a client that negotiated compression
+        // takes the copy path, which compresses the echo
+        if (echo_fast_path && conn->state == CONN_ACTIVE && view.op == OP_MESSAGE && view.frame &&
+            (view.len == 0 || view.data[0] != '/') && conn->mode.load(memory_order_relaxed) == 'e' &&
+            (conn->codec == CODEC_NONE || view.frame_len < BINARY_HEADER + compress_min || (view.frame[1] & BINARY_COMPRESSED))) {
+            if (!echo_run) echo_run = view.frame;
+            echo_len += view.frame_len;
+            echo_count++;
+            continue;
+        }
+        if (echo_run) {
+            write_or_queue(conn, echo_run, echo_len);
+            echo_run = NULL;
+            echo_len = 0;
+        }
+        dispatch_message(conn, view);
+    }
+    if (echo_run) write_or_queue(conn, echo_run, echo_len);
+    if (echo_count) metric_add(metrics()->messages[MODE_ECHO], echo_count);
+    if (conn->ip && batch_msgs) charge_address(conn, batch_msgs, batch_bytes);
+    if (parsed == -2) {
+        send_error(conn, "Bad compressed payload.");
+        return false;
+    }
+    if (parsed < 0) {
+        send_message(conn->socket, "Message too large.");
+        return false;
+    }
+    return true;
+}
+
+// Called once the socket has nothing more to read for now
+void finish_input(Connection* conn) {
+    InputBuffer* in = &conn->in;
+
+    // The rest of a name may still be on its way; the timer takes it if not
+    if (name_pending(conn)) schedule_timeout(conn);
+
+    // Give idle connections' memory back
+    if (in->start == in->end) {
+        in->start = in->end = in->scanned = 0;
+        if (in->cap > BUFFER_SIZE) {
+            free(in->data);
+            in->data = NULL;
+            in->cap = 0;
+        }
+    }
+}
+
+// Drain a readable socket (edge-triggered); returns false when the connection is gone
+bool handle_readable(Connection* conn) {
+    InputBuffer* in = &conn->in;
+    while (1) {
+        // Backpressure: leave further input in the kernel until our output drains
+        if (conn->out.bytes.load(memory_order_relaxed) > output_hwm) {
+            conn->read_paused = true;
+            break;
+        }
+        if (conn->throttled_until) break;  // ...or until a rate limit's wait is over
+
+        if (!input_reserve(in)) {
+            send_message(conn->socket, "Message too large.");
+            return false;
+        }
+        ssize_t bytes_read = conn->tls ? tls_recv(conn, in->data + in->end, in->cap - in->end)
+                                       : recv(conn->socket, in->data + in->end, in->cap - in->end, 0);
+        if (bytes_read == 0) return false;
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+            break;
+        }
+        metric_add(metrics()->bytes_in, bytes_read);
+        conn->input_ms = conn->reactor->now_ms;
+        in->end += bytes_read;
+        if (!process_input(conn)) return false;
+    }
+    finish_input(conn);
+    return true;
+}
+
+// Move a TLS client's handshake along. Once it is done, note whether the
+// kernel took over the record layer, and read what arrived with the
+// client's last flight: OpenSSL already holds it, so no readiness event
+// will come for it. Returns false when the connection must close.
+bool tls_handshake(Connection* conn) {
+#ifdef HAVE_OPENSSL
+    int rc = SSL_do_handshake(conn->tls);
+    if (rc <= 0) {
+        int err = SSL_get_error(conn->tls, rc);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) return true;
+        metric_add(metrics()->tls_handshakes[TLS_FAILED], 1);
+        SSL_set_quiet_shutdown(conn->tls, 1);
+        ERR_clear_error();
+        return false;
+    }
+    conn->tls_handshaking = false;
+    ThreadMetrics* m = metrics();
+    metric_add(m->tls_handshakes[SSL_session_reused(conn->tls) ? TLS_RESUMED : TLS_FULL], 1);
+    metric_add(m->tls_handshake_ms, conn->reactor->now_ms - conn->opened_ms);
+    if (BIO_get_ktls_send(SSL_get_wbio(conn->tls))) {
+        conn->tls_kernel_send = true;
+        metric_add(m->ktls[0], 1);
+    }
+    if (BIO_get_ktls_recv(SSL_get_rbio(conn->tls))) metric_add(m->ktls[1], 1);
+    return handle_readable(conn);
+#else
+    return false;
+#endif
+}
+
+// ---- io_uring backend ----------------------------------------------------
+
+// What an io_uring completion belongs to, kept in the low bits of user_data
+enum UringOp {
+    UOP_RECV = 1,     // (gen << 32) | (socket << 3) | UOP_RECV
+    UOP_SEND = 2,     // UringSend pointer | UOP_SEND
+    UOP_ACCEPT = 3,
+    UOP_WAKE = 4,
+    UOP_CANCEL = 5,
+    UOP_TIMER = 6
+};
+#define UOP_MASK 7
+
+// One in-flight sendmsg; holds references so queued buffers outlive a close
+struct UringSend {
+    UringSend* next_free;
     int socket;
-    char mode;  // 'e' -> echo, 'c' -> chat
-} ClientInfo;
+    uint32_t gen;
+    int nbufs;
+    SharedBuf* bufs[IOV_BATCH];
+    struct iovec iov[IOV_BATCH];
+    struct msghdr msg;
+};
+
+// A reactor's rings, mapped from the kernel, plus its provided buffer ring
+struct Uring {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned to_submit;
+    struct io_uring_buf_ring* buf_ring;
+    char* buf_pool;
+    UringSend* free_sends;
+    struct __kernel_timespec tick;   // Timer wheel tick, for IORING_OP_TIMEOUT
+    bool tick_armed;
+};
+
+int uring_enter(Uring* u, unsigned wait) {
+    int ret = (int)syscall(__NR_io_uring_enter, u->fd, u->to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (ret > 0) u->to_submit -= ret;
+    return ret;
+}
+
+// Next free submission entry. The tail is published right away: without
+// SQPOLL the kernel only looks at it during io_uring_enter().
+struct io_uring_sqe* uring_sqe(Uring* u) {
+    unsigned tail = *u->sq_tail;
+    while (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        if (uring_enter(u, 0) < 0 && errno != EINTR && errno != EBUSY) {
+            perror("io_uring_enter failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct io_uring_sqe* sqe = &u->sqes[tail & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[tail & u->sq_mask] = tail & u->sq_mask;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->to_submit++;
+    return sqe;
+}
+
+// Hand a provided receive buffer back to the kernel. The entries are indexed
+// by hand: in C++ the header's flexible-array wrapper shifts bufs[] by 8 bytes.
+void uring_recycle_buffer(Uring* u, unsigned bid) {
+    unsigned short tail = u->buf_ring->tail;
+    struct io_uring_buf* buf = (struct io_uring_buf*)u->buf_ring + (tail & (URING_BUFS - 1));
+    buf->addr = (uint64_t)(uintptr_t)(u->buf_pool + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&u->buf_ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+// Create the rings and register the provided buffer ring; false if the kernel says no
+bool uring_setup(Reactor* r) {
+    Uring* u = new Uring();
+    memset(u, 0, sizeof(*u));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_ENTRIES * 4;
+    u->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (u->fd < 0) return false;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        fprintf(stderr, "io_uring: kernel too old (no single mmap)\n");
+        return false;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_size = sq_size > cq_size ? sq_size : cq_size;
+    char* ring = (char*)mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->sqes = (struct io_uring_sqe*)mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                                         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (ring == MAP_FAILED || u->sqes == MAP_FAILED) return false;
+    u->sq_head = (unsigned*)(ring + params.sq_off.head);
+    u->sq_tail = (unsigned*)(ring + params.sq_off.tail);
+    u->sq_array = (unsigned*)(ring + params.sq_off.array);
+    u->sq_mask = *(unsigned*)(ring + params.sq_off.ring_mask);
+    u->sq_entries = params.sq_entries;
+    u->cq_head = (unsigned*)(ring + params.cq_off.head);
+    u->cq_tail = (unsigned*)(ring + params.cq_off.tail);
+    u->cq_mask = *(unsigned*)(ring + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(ring + params.cq_off.cqes);
+
+    // Receive buffers the kernel picks from for multishot recv (group 0)
+    size_t buf_ring_size = URING_BUFS * sizeof(struct io_uring_buf);
+    u->buf_ring = (struct io_uring_buf_ring*)mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE,
+                                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->buf_pool = (char*)malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+    if (u->buf_ring == MAP_FAILED || !u->buf_pool) return false;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->buf_ring;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        fprintf(stderr, "io_uring: provided buffer rings unsupported\n");
+        return false;
+    }
+    u->buf_ring->tail = 0;
+    for (unsigned bid = 0; bid < URING_BUFS; bid++) {
+        uring_recycle_buffer(u, bid);
+    }
+    r->uring = u;
+    return true;
+}
+
+// Multishot accept on the reactor's own listener (--reactors mode)
+void uring_arm_accept(Reactor* r) {
+    struct io_uring_sqe* sqe = uring_sqe(r->uring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = r->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = UOP_ACCEPT;
+}
+
+// Wait for the mailbox eventfd to become readable
+void uring_arm_wake(Reactor* r) {
+    struct io_uring_sqe* sqe = uring_sqe(r->uring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = r->wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = UOP_WAKE;
+}
+
+// Complete after one timer wheel tick, so the loop wakes while timers are armed
+void uring_arm_tick(Reactor* r) {
+    Uring* u = r->uring;
+    u->tick.tv_sec = 0;
+    u->tick.tv_nsec = TIMER_TICK_MS * 1000000LL;
+    struct io_uring_sqe* sqe = uring_sqe(u);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&u->tick;
+    sqe->len = 1;
+    sqe->user_data = UOP_TIMER;
+    u->tick_armed = true;
+}
+
+uint64_t uring_recv_tag(Connection* conn) {
+    return ((uint64_t)conn->gen << 32) | ((uint64_t)conn->socket << 3) | UOP_RECV;
+}
+
+// Multishot recv; the kernel picks buffers from the provided buffer ring
+void uring_arm_recv(Connection* conn) {
+    struct io_uring_sqe* sqe = uring_sqe(conn->reactor->uring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = uring_recv_tag(conn);
+    conn->recv_armed = true;
+}
+
+// Stop the multishot recv so the peer feels TCP backpressure
+void uring_cancel_recv(Connection* conn) {
+    struct io_uring_sqe* sqe = uring_sqe(conn->reactor->uring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = uring_recv_tag(conn);
+    sqe->user_data = UOP_CANCEL;
+}
+
+// Submit a sendmsg for the front of the output queue unless one is in flight
+void uring_send(Connection* conn) {
+    if (conn->send_inflight || conn->out.count == 0) return;
+    Uring* u = conn->reactor->uring;
+    UringSend* op = u->free_sends;
+    if (op) {
+        u->free_sends = op->next_free;
+    } else {
+        op = new UringSend();
+    }
+    op->socket = conn->socket;
+    op->gen = conn->gen;
+    op->nbufs = output_iovecs(&conn->out, op->iov, IOV_BATCH);
+    for (int i = 0; i < op->nbufs; i++) {
+        op->bufs[i] = conn->out.items[(conn->out.head + i) % conn->out.cap].buf;
+        op->bufs[i]->refs.fetch_add(1, memory_order_relaxed);
+    }
+    memset(&op->msg, 0, sizeof(op->msg));
+    op->msg.msg_iov = op->iov;
+    op->msg.msg_iovlen = op->nbufs;
+
+    struct io_uring_sqe* sqe = uring_sqe(u);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->socket;
+    sqe->addr = (uint64_t)(uintptr_t)&op->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)op | UOP_SEND;
+    conn->send_inflight = true;
+}
+
+// Copy received bytes into the connection's input buffer; false if too large
+bool input_append(InputBuffer* in, const char* data, size_t len, size_t slack) {
+    while (len > 0) {
+        if (!input_reserve(in, slack)) return false;
+        size_t room = min(in->cap - in->end, len);
+        memcpy(in->data + in->end, data, room);
+        in->end += room;
+        data += room;
+        len -= room;
+    }
+    return true;
+}
+
+// Parse input held back while reads were paused, then read again unless
+// another pause still applies; returns false when the connection must close
+bool resume_input(Connection* conn) {
+    if (conn->read_paused || conn->throttled_until) return true;
+    if (!process_input(conn)) return false;
+    if (io_backend == IO_EPOLL && !conn->throttled_until) {
+        return handle_readable(conn);  // Edge-triggered: data may already be waiting
+    }
+    finish_input(conn);
+    if (io_backend == IO_URING) {
+        // What was parsed alone may cross the mark again
+        if (conn->out.bytes.load(memory_order_relaxed) > output_hwm) {
+            conn->read_paused = true;
+        } else if (!conn->throttled_until && !conn->recv_armed) {
+            uring_arm_recv(conn);
+        }
+    }
+    return true;
+}
+
+// Flush queued output and resume reading once a paused connection has drained;
+// returns false when the connection is gone
+bool handle_writable(Connection* conn) {
+    if (!flush_output(conn)) return false;
+    if (conn->read_paused && conn->out.bytes.load(memory_order_relaxed) <= output_hwm / 2) {
+        conn->read_paused = false;
+        return resume_input(conn);
+    }
+    return true;
+}
+
+// Register a freshly accepted non-blocking socket with a reactor
+void register_client(int client_socket, Reactor* r, bool tls) {
+    Connection* conn = add_client(client_socket, r);
+    if (!conn) {
+        fprintf(stderr, "Socket %d exceeds the connection table\n", client_socket);
+        close(client_socket);
+        release_client();
+        return;
+    }
+    if (ip_msg_rate > 0 || ip_byte_rate > 0) conn->ip = ip_acquire(client_socket, r->now_ms);
+    if (tls && !tls_attach(conn)) {
+        fprintf(stderr, "Could not start TLS on socket %d\n", client_socket);
+        if (conn->ip) ip_release(conn->ip);
+        remove_client(conn);
+        close(client_socket);
+        release_client();
+        return;
+    }
+
+    // Output is already gathered into one sendmsg() per flush; Nagle would
+    // only hold a pipelining client's last replies until its delayed ACK
+    int one = 1;
+    setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (io_backend == IO_URING) {
+        uring_arm_recv(conn);
+        schedule_timeout(conn);
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.u64 = ((uint64_t)conn->gen << 32) | (uint32_t)client_socket;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+        perror("epoll_ctl failed");
+        if (conn->ip) ip_release(conn->ip);
+        remove_client(conn);
+        close(client_socket);
+        release_client();
+        return;
+    }
+    schedule_timeout(conn);
+}
+
+// Accept every pending connection on a reactor's own listening socket
+void accept_clients(Reactor* r) {
+    while (1) {
+        int client_socket = accept4(r->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (client_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("Accept failed");
+            return;
+        }
+        metric_add(metrics()->accepts, 1);
+        if (admit_client(client_socket)) register_client(client_socket, r);
+    }
+}
+
+// Hold a reactor still while main() hands its connections to a new server.
+// Returns only if the handoff fails and this process carries on.
+void park_reactor(Reactor* r) {
+    pthread_mutex_lock(&handoff_mutex);
+    parked_reactors++;
+    pthread_cond_broadcast(&handoff_cond);
+    while (handoff_pending.load(memory_order_relaxed)) {
+        pthread_cond_wait(&handoff_cond, &handoff_mutex);
+    }
+    parked_reactors--;
+    pthread_mutex_unlock(&handoff_mutex);
+    r->now_ms = monotonic_ns() / 1000000;
+}
+
+// Event loop run by each reactor thread
+void* reactor_loop(void* arg) {
+    Reactor* r = (Reactor*)arg;
+    current_reactor = r;
+    struct epoll_event events[MAX_EVENTS];
+
+    if (pin_reactors) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(r->index % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            fprintf(stderr, "Could not pin reactor %d\n", r->index);
+        }
+    }
+
+    while (1) {
+        // Wake every tick while any timer is armed
+        int n = epoll_wait(r->epoll_fd, events, MAX_EVENTS, r->timers->armed ? TIMER_TICK_MS : -1);
+        r->now_ms = monotonic_ns() / 1000000;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            // Connections are tagged with socket and generation, other sources with gen 0
+            int fd = (int)(uint32_t)events[i].data.u64;
+            uint32_t gen = (uint32_t)(events[i].data.u64 >> 32);
+            if (gen == 0) {
+                if (fd == r->listen_fd) accept_clients(r);
+                else if (fd == r->wake_fd) drain_mailbox(r);
+                continue;
+            }
+            Connection* conn = find_client(fd);
+            if (!conn || conn->gen != gen) continue;  // Closed earlier in this batch
+            bool alive = true;
+            if (conn->tls_handshaking) {
+                alive = tls_handshake(conn);
+            } else {
+                if (events[i].events & EPOLLOUT) {
+                    alive = handle_writable(conn);
+                }
+                if (alive && !conn->read_paused && (events[i].events & (EPOLLIN | EPOLLRDHUP))) {
+                    alive = handle_readable(conn);
+                }
+            }
+            if (alive && (events[i].events & (EPOLLHUP | EPOLLERR))) {
+                alive = false;
+            }
+            if (!alive) close_connection(conn);
+        }
+        run_timers(r);
 
-ClientInfo clients[MAX_CLIENTS];     
-int client_count = 0; 
+        // Write everything queued during this batch with as few syscalls as possible
+        for (size_t i = 0; i < r->dirty.size(); i++) {
+            Connection* conn = r->dirty[i];
+            conn->flush_queued = false;
+            if (conn->in_use && !handle_writable(conn)) close_connection(conn);
+        }
+        r->dirty.clear();
+        if (handoff_pending.load(memory_order_acquire)) park_reactor(r);
+    }
+    return NULL;
+}
 
-// Chat-specific variables
-map<int, string> client_names;           // socket -> name
-map<string, int> name_to_socket;         // name -> socket
-map<int, int> chatting_with;             // socket -> socket
+// Apply a recv completion; returns false when the connection must close
+bool uring_received(Connection* conn, const struct io_uring_cqe* cqe, const char* data) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) conn->recv_armed = false;
+    if (cqe->res == 0) return false;
+    bool was_paused = conn->read_paused || conn->throttled_until;
+    if (cqe->res < 0) {
+        if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) return false;
+    } else {
+        metric_add(metrics()->bytes_in, cqe->res);
+        conn->input_ms = conn->reactor->now_ms;
+        // Completions already queued behind a cancel cannot be refused, but
+        // the provided buffer ring bounds how many there can be
+        size_t slack = was_paused ? (size_t)URING_BUFS * URING_BUF_SIZE : 0;
+        if (!input_append(&conn->in, data, cqe->res, slack)) {
+            send_message(conn->socket, "Message too large.");
+            return false;
+        }
+        // While paused, bytes already in flight are kept but not parsed
+        if (!was_paused) {
+            if (!process_input(conn)) return false;
+            finish_input(conn);
+        }
+    }
+    if (!conn->read_paused && conn->out.bytes.load(memory_order_relaxed) > output_hwm) conn->read_paused = true;
+    if (conn->read_paused || conn->throttled_until) {
+        if (!was_paused && conn->recv_armed) uring_cancel_recv(conn);
+    } else if (!conn->recv_armed) {
+        uring_arm_recv(conn);
+    }
+    return true;
+}
 
-//Function to ensure message ends with exactly one newline
-string formatMessage(const string& msg) {
-    string result = msg;
-    while (!result.empty() && (result.back() == '\n' || result.back() == '\r' || result.back() == ' ' || result.back() == '\t')) {
-        result.pop_back();
+// Apply a sendmsg completion; returns false when the connection must close
+bool uring_sent(Connection* conn, int res) {
+    conn->send_inflight = false;
+    if (res < 0 && res != -EAGAIN && res != -EINTR) return false;
+    if (res > 0) {
+        metric_add(metrics()->bytes_out, res);
+        retire_output(&conn->out, res);
+        conn->output_ms = conn->reactor->now_ms;
     }
-    result += '\n';
-    return result;
+    if (conn->read_paused && conn->out.bytes.load(memory_order_relaxed) <= output_hwm / 2) {
+        conn->read_paused = false;
+        if (!resume_input(conn)) return false;
+    }
+    uring_send(conn);
+    return true;
 }
 
-void log_event(const char* msg) {
-    pthread_mutex_lock(&log_mutex);
-    FILE* log_file = fopen("server_log.txt", "a");
-    if (log_file) {
-        time_t now = time(NULL);
-        char time_str[32];
-        strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", localtime(&now));
-        fprintf(log_file, "[%s] %s\n", time_str, msg);
-        fclose(log_file);
+// Event loop for the io_uring backend: one io_uring_enter() both submits
+// everything queued during the previous batch and waits for completions
+void* uring_reactor_loop(void* arg) {
+    Reactor* r = (Reactor*)arg;
+    Uring* u = r->uring;
+    current_reactor = r;
+
+    if (r->listen_fd >= 0) uring_arm_accept(r);
+    uring_arm_wake(r);
+
+    while (1) {
+        if (r->timers->armed && !u->tick_armed) uring_arm_tick(r);
+        if (uring_enter(u, 1) < 0 && errno != EINTR && errno != EBUSY) {
+            perror("io_uring_enter failed");
+            break;
+        }
+        r->now_ms = monotonic_ns() / 1000000;
+
+        unsigned head = *u->cq_head;
+        unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe* cqe = &u->cqes[head & u->cq_mask];
+            uint64_t tag = cqe->user_data;
+            switch (tag & UOP_MASK) {
+            case UOP_ACCEPT:
+                if (cqe->res >= 0) {
+                    metric_add(metrics()->accepts, 1);
+                    if (admit_client(cqe->res)) register_client(cqe->res, r);
+                }
+                if (!(cqe->flags & IORING_CQE_F_MORE)) uring_arm_accept(r);
+                break;
+            case UOP_WAKE:
+                drain_mailbox(r);
+                uring_arm_wake(r);
+                break;
+            case UOP_TIMER:
+                u->tick_armed = false;
+                break;
+            case UOP_RECV: {
+                const char* data = NULL;
+                unsigned bid = 0;
+                if (cqe->flags & IORING_CQE_F_BUFFER) {
+                    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                    data = u->buf_pool + (size_t)bid * URING_BUF_SIZE;
+                }
+                Connection* conn = find_client((int)((tag & 0xffffffffu) >> 3));
+                if (conn && conn->gen == (uint32_t)(tag >> 32)) {
+                    if (!uring_received(conn, cqe, data)) close_connection(conn);
+                }
+                if (cqe->flags & IORING_CQE_F_BUFFER) uring_recycle_buffer(u, bid);
+                break;
+            }
+            case UOP_SEND: {
+                UringSend* op = (UringSend*)(uintptr_t)(tag & ~(uint64_t)UOP_MASK);
+                Connection* conn = find_client(op->socket);
+                if (conn && conn->gen == op->gen && !uring_sent(conn, cqe->res)) close_connection(conn);
+                for (int i = 0; i < op->nbufs; i++) {
+                    buf_release(op->bufs[i]);
+                }
+                op->next_free = u->free_sends;
+                u->free_sends = op;
+                break;
+            }
+            default:
+                break;
+            }
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+        run_timers(r);
+
+        // Queue a send for every connection that gained output during this batch
+        for (size_t i = 0; i < r->dirty.size(); i++) {
+            Connection* conn = r->dirty[i];
+            conn->flush_queued = false;
+            if (conn->in_use) uring_send(conn);
+        }
+        r->dirty.clear();
     }
-    pthread_mutex_unlock(&log_mutex);
+    return NULL;
 }
 
-// Add client socket to queue
-void enqueue_client(int client_socket) {
-    pthread_mutex_lock(&queue_mutex);
-    client_queue[rear++] = client_socket;
-    pthread_cond_signal(&queue_cond);
-    pthread_mutex_unlock(&queue_mutex);
+// Create a listening socket on port, optionally shared with SO_REUSEPORT
+int create_listener(int port, bool reuseport) {
+    struct sockaddr_in server_addr;
+    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_fd == -1) {
+        perror("Socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    int opt = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (reuseport && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("SO_REUSEPORT failed");
+        exit(EXIT_FAILURE);
+    }
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+
+    // Bind socket
+    if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Bind failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Listen
+    if (listen(server_fd, SOMAXCONN) < 0) {
+        perror("Listen failed");
+        exit(EXIT_FAILURE);
+    }
+    return server_fd;
 }
 
-// Remove client socket from queue
-int dequeue_client() {
-    pthread_mutex_lock(&queue_mutex);
-    while (front == rear) {
-        pthread_cond_wait(&queue_cond, &queue_mutex);
+// Set up a reactor's epoll instance or io_uring, wakeup eventfd and (in
+// --reactors mode) listener, reusing listen_fd if a hot restart handed one over
+void init_reactor(Reactor* r, int index, int listen_fd) {
+    r->index = index;
+    r->now_ms = monotonic_ns() / 1000000;
+    r->timers = timer_wheel_create(r->now_ms);
+    r->mailbox.head.store(NULL);
+    r->epoll_fd = epoll_create1(0);
+    r->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (r->epoll_fd < 0 || r->wake_fd < 0) {
+        perror("Reactor setup failed");
+        exit(EXIT_FAILURE);
+    }
+
+    r->listen_fd = -1;
+    if (reuseport_mode) {
+        r->listen_fd = listen_fd >= 0 ? listen_fd : create_listener(PORT, true);
+    }
+
+    r->uring = NULL;
+    if (io_backend == IO_URING) {
+        if (!uring_setup(r)) {
+            perror("io_uring setup failed");
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint32_t)r->wake_fd;
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wake_fd, &ev);
+    if (r->listen_fd >= 0) {
+        set_nonblocking(r->listen_fd);
+        ev.events = EPOLLIN;
+        ev.data.u64 = (uint32_t)r->listen_fd;
+        epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->listen_fd, &ev);
     }
-    int client_socket = client_queue[front++];
-    pthread_mutex_unlock(&queue_mutex);
-    return client_socket;
 }
 
-// Add client to clients array
-void add_client(int socket) {
-    pthread_mutex_lock(&clients_mutex);
-    if (client_count < MAX_CLIENTS) {
-        clients[client_count].socket = socket;
-        clients[client_count].mode = 'e';  // Default to echo mode
-        client_count++;
+// ---- Metrics endpoint -----------------------------------------------------
+
+void append_format(string& out, const char* fmt, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (len > 0) out.append(line, min((size_t)len, sizeof(line) - 1));
+}
+
+void append_header(string& out, const char* name, const char* type, const char* help) {
+    append_format(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Sum one counter over every thread's slot; field names the counter in slot 0.
+// Slots are read while their owners keep writing, so a scrape is a
+// consistent-enough snapshot rather than an exact cut.
+uint64_t metric_total(const atomic<uint64_t>& field) {
+    size_t offset = (const char*)&field - (const char*)&metric_slots[0];
+    int slots = min(metric_slot_count.load(memory_order_relaxed), METRIC_SLOTS);
+    uint64_t total = 0;
+    for (int i = 0; i < slots; i++) {
+        total += ((const atomic<uint64_t>*)((const char*)&metric_slots[i] + offset))->load(memory_order_relaxed);
     }
-    pthread_mutex_unlock(&clients_mutex);
+    return total;
 }
 
-// Remove client from clients array
-void remove_client(int socket) {
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < client_count; i++) {
-        if (clients[i].socket == socket) {
-            // Shift remaining clients
-            for (int j = i; j < client_count - 1; j++) {
-                clients[j] = clients[j + 1];
-            }
-            client_count--;
-            break;
+// Render every counter in Prometheus text format (version 0.0.4)
+string render_metrics() {
+#define TOTAL(field) metric_total(metric_slots[0].field)
+    string out;
+    append_header(out, "echo_accepts_total", "counter", "Connections accepted.");
+    append_format(out, "echo_accepts_total %llu\n", (unsigned long long)TOTAL(accepts));
+    append_header(out, "echo_rejects_total", "counter", "Connections shed at accept by admission control.");
+    for (int r = 0; r < REJECT_COUNT; r++) {
+        append_format(out, "echo_rejects_total{reason=\"%s\"} %llu\n", reject_names[r], (unsigned long long)TOTAL(rejects[r]));
+    }
+    append_header(out, "echo_accept_queue_depth", "gauge", "Accepted sockets handed to a reactor but not yet registered.");
+    uint64_t posted = TOTAL(handoffs_posted), taken = TOTAL(handoffs_taken);
+    append_format(out, "echo_accept_queue_depth %llu\n", (unsigned long long)(posted > taken ? posted - taken : 0));
+    append_header(out, "echo_takeover_seconds", "gauge", "How long the hot restart that started this server kept clients waiting (0 if started fresh).");
+    append_format(out, "echo_takeover_seconds %.6f\n", takeover_us / 1e6);
+    append_header(out, "echo_connected_clients", "gauge", "Open client connections.");
+    uint64_t opened = TOTAL(opened), closed = TOTAL(closed);
+    append_format(out, "echo_connected_clients %llu\n", (unsigned long long)(opened > closed ? opened - closed : 0));
+
+    append_header(out, "echo_bytes_total", "counter", "Bytes received from and sent to clients.");
+    append_format(out, "echo_bytes_total{direction=\"in\"} %llu\n", (unsigned long long)TOTAL(bytes_in));
+    append_format(out, "echo_bytes_total{direction=\"out\"} %llu\n", (unsigned long long)TOTAL(bytes_out));
+
+    append_header(out, "echo_timeouts_total", "counter", "Connections closed by the timer wheel, by timeout.");
+    for (int t = 0; t < TIMEOUT_COUNT; t++) {
+        append_format(out, "echo_timeouts_total{reason=\"%s\"} %llu\n", timeout_names[t], (unsigned long long)TOTAL(timeouts[t]));
+    }
+
+    append_header(out, "echo_throttles_total", "counter", "Times a rate limit paused a connection's reads, by limit.");
+    for (int t = 0; t < THROTTLE_COUNT; t++) {
+        append_format(out, "echo_throttles_total{limit=\"%s\"} %llu\n", throttle_names[t], (unsigned long long)TOTAL(throttles[t]));
+    }
+
+    append_header(out, "echo_history_appends_total", "counter", "Records appended to the history store.");
+    append_format(out, "echo_history_appends_total %llu\n", (unsigned long long)TOTAL(history_appends));
+    append_header(out, "echo_history_replayed_total", "counter", "Stored messages sent back by /history or on reconnect.");
+    append_format(out, "echo_history_replayed_total %llu\n", (unsigned long long)TOTAL(history_replayed));
+
+    append_header(out, "echo_compression_bytes_total", "counter",
+                  "Payload bytes handed to a compressor (raw) and sent in their place (wire).");
+    append_format(out, "echo_compression_bytes_total{stage=\"raw\"} %llu\n", (unsigned long long)TOTAL(packed_raw));
+    append_format(out, "echo_compression_bytes_total{stage=\"wire\"} %llu\n", (unsigned long long)TOTAL(packed_wire));
+    append_header(out, "echo_compression_seconds_total", "counter", "Time spent compressing replies and decompressing requests.");
+    append_format(out, "echo_compression_seconds_total{op=\"compress\"} %.9f\n", TOTAL(codec_ns[0]) / 1e9);
+    append_format(out, "echo_compression_seconds_total{op=\"decompress\"} %.9f\n", TOTAL(codec_ns[1]) / 1e9);
+    append_header(out, "echo_tls_handshakes_total", "counter", "TLS handshakes on --tls-port by result.");
+    for (int t = 0; t < TLS_RESULT_COUNT; t++) {
+        append_format(out, "echo_tls_handshakes_total{result=\"%s\"} %llu\n", tls_result_names[t],
+                      (unsigned long long)TOTAL(tls_handshakes[t]));
+    }
+    append_header(out, "echo_tls_handshake_seconds_total", "counter", "Time from accept to a finished TLS handshake, summed.");
+    append_format(out, "echo_tls_handshake_seconds_total %.3f\n", TOTAL(tls_handshake_ms) / 1e3);
+    append_header(out, "echo_ktls_connections_total", "counter", "TLS connections whose records the kernel encrypts (send) or decrypts (recv).");
+    append_format(out, "echo_ktls_connections_total{direction=\"send\"} %llu\n", (unsigned long long)TOTAL(ktls[0]));
+    append_format(out, "echo_ktls_connections_total{direction=\"recv\"} %llu\n", (unsigned long long)TOTAL(ktls[1]));
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    append_header(out, "process_cpu_seconds_total", "counter", "User and system CPU time of the server.");
+    append_format(out, "process_cpu_seconds_total %.6f\n", usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+                  (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6);
+
+    append_header(out, "echo_room_deliveries_total", "counter", "Room messages queued to a member.");
+    append_format(out, "echo_room_deliveries_total %llu\n", (unsigned long long)TOTAL(room_deliveries));
+    append_header(out, "echo_room_drops_total", "counter", "Room messages skipped for a member over --output-hwm.");
+    append_format(out, "echo_room_drops_total %llu\n", (unsigned long long)TOTAL(room_drops));
+
+#ifdef ALLOC_COUNT
+    append_header(out, "echo_heap_allocations_total", "counter",
+                  "Heap allocations made serving clients (operator new and the server's own mallocs).");
+    append_format(out, "echo_heap_allocations_total %llu\n", (unsigned long long)TOTAL(heap_allocs));
+#endif
+
+    append_header(out, "echo_messages_total", "counter", "Messages handled, by client mode.");
+    for (int m = 0; m < MODE_COUNT; m++) {
+        append_format(out, "echo_messages_total{mode=\"%s\"} %llu\n", mode_names[m], (unsigned long long)TOTAL(messages[m]));
+    }
+    append_header(out, "echo_commands_total", "counter", "Slash commands handled.");
+    for (int c = 0; c < CMD_COUNT; c++) {
+        append_format(out, "echo_commands_total{command=\"%s\"} %llu\n", command_table[c].name, (unsigned long long)TOTAL(commands[c]));
+    }
+
+    append_header(out, "echo_lock_acquisitions_total", "counter", "Times a shared mutex was taken.");
+    for (int l = 0; l < LOCK_COUNT; l++) {
+        append_format(out, "echo_lock_acquisitions_total{lock=\"%s\"} %llu\n", lock_names[l], (unsigned long long)TOTAL(lock_acquired[l]));
+    }
+    append_header(out, "echo_lock_contended_total", "counter", "Acquisitions that had to wait for another thread.");
+    for (int l = 0; l < LOCK_COUNT; l++) {
+        append_format(out, "echo_lock_contended_total{lock=\"%s\"} %llu\n", lock_names[l], (unsigned long long)TOTAL(lock_contended[l]));
+    }
+    append_header(out, "echo_lock_wait_seconds_total", "counter", "Time spent waiting for a shared mutex.");
+    for (int l = 0; l < LOCK_COUNT; l++) {
+        append_format(out, "echo_lock_wait_seconds_total{lock=\"%s\"} %.9f\n", lock_names[l], TOTAL(lock_wait_ns[l]) / 1e9);
+    }
+
+    append_header(out, "echo_message_service_seconds", "histogram",
+                  "Time to handle one message (echo fast-path runs are not timed).");
+    for (int m = 0; m < MODE_COUNT; m++) {
+        uint64_t cumulative = 0;
+        for (int b = 0; b < SERVICE_BUCKETS; b++) {
+            cumulative += TOTAL(service_buckets[m][b]);
+            append_format(out, "echo_message_service_seconds_bucket{mode=\"%s\",le=\"%.9g\"} %llu\n",
+                          mode_names[m], (double)(1ull << b) / 1e6, (unsigned long long)cumulative);
         }
+        cumulative += TOTAL(service_buckets[m][SERVICE_BUCKETS]);
+        append_format(out, "echo_message_service_seconds_bucket{mode=\"%s\",le=\"+Inf\"} %llu\n",
+                      mode_names[m], (unsigned long long)cumulative);
+        append_format(out, "echo_message_service_seconds_sum{mode=\"%s\"} %.9f\n", mode_names[m], TOTAL(service_ns[m]) / 1e9);
+        append_format(out, "echo_message_service_seconds_count{mode=\"%s\"} %llu\n", mode_names[m], (unsigned long long)cumulative);
     }
-    pthread_mutex_unlock(&clients_mutex);
+#undef TOTAL
+    return out;
 }
 
-// Send a message to a client
-void send_message(int socket, const string& message) {
-    string formatted = formatMessage(message);
-    send(socket, formatted.c_str(), formatted.length(), 0);
+// Send a whole buffer on a blocking socket
+bool send_all(int socket, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(socket, data, len, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        data += sent;
+        len -= sent;
+    }
+    return true;
 }
 
-// List all connected clients
-void list_connected_clients() {
-    printf("=== Connected Clients ===\n");
-    for (const auto& entry : name_to_socket) {
-        printf("Name: %s | Socket: %d\n", entry.first.c_str(), entry.second);
+// Answer scrapes one at a time. Rendering happens here, off the reactors;
+// the only cost to them is the counters they already keep.
+void* metrics_server(void* arg) {
+    int listen_fd = (int)(intptr_t)arg;
+#ifdef ALLOC_COUNT
+    allocations_untracked = true;
+#endif
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) perror("Metrics accept failed");
+            continue;
+        }
+        struct timeval timeout = { 1, 0 };  // A stalled scraper must not wedge the endpoint
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        char request[1024];
+        ssize_t got = recv(fd, request, sizeof(request) - 1, 0);
+        if (got > 0) {
+            request[got] = '\0';
+            bool found = strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0;
+            string body = found ? render_metrics() : string("Not found; try /metrics\n");
+            char header[160];
+            int len = snprintf(header, sizeof(header),
+                               "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                               found ? "200 OK" : "404 Not Found", body.size());
+            if (send_all(fd, header, len)) send_all(fd, body.data(), body.size());
+        }
+        close(fd);
     }
-    printf("=========================\n");
+    return NULL;
 }
 
-// Handle client communication
-void handle_client(int client_socket) {
-    char buffer[BUFFER_SIZE];
-    int bytes_read;
-    string client_name = "Unknown";
-    bool name_set = false;
+int metrics_listen_fd = -1;          // Passed on by a hot restart
 
-    // Get the client's name
-    while (!name_set) {
-        bytes_read = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-        if (bytes_read <= 0) {
-            close(client_socket);
-            return;
-        }
-        buffer[bytes_read] = '\0';
-        client_name = string(buffer);
-        client_name.erase(client_name.find_last_not_of(" \n\r\t") + 1);
-    
-        pthread_mutex_lock(&name_mutex);
-        if (!name_to_socket.count(client_name)) {
-            client_names[client_socket] = client_name;
-            name_to_socket[client_name] = client_socket;
-            pthread_mutex_unlock(&name_mutex);
-            name_set = true;
-            break;
+// Listen on 127.0.0.1:metrics_port and serve it from its own thread. A
+// listener handed over by a hot restart is kept if it is on the same port.
+void start_metrics(int inherited_fd) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (inherited_fd >= 0 && (metrics_port == 0 || getsockname(inherited_fd, (struct sockaddr*)&addr, &addr_len) < 0 ||
+                              ntohs(addr.sin_port) != metrics_port)) {
+        close(inherited_fd);
+        inherited_fd = -1;
+    }
+    if (metrics_port == 0) return;
+    int fd = inherited_fd;
+    if (fd < 0) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        int opt = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(metrics_port);
+        if (fd >= 0 && (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0)) {
+            close(fd);
+            fd = -1;
         }
-        pthread_mutex_unlock(&name_mutex);
-        send_message(client_socket, "Name already exists. Please Try another ");
     }
-    
-    add_client(client_socket);
-    send_message(client_socket, "Welcome to the server!");
-    send_message(client_socket, "Type '/startchat' to enter chat mode or '/startecho' to enter echo mode");
+    pthread_t thread;
+    if (fd < 0 || pthread_create(&thread, NULL, metrics_server, (void*)(intptr_t)fd) != 0) {
+        perror("Metrics endpoint disabled");
+        if (fd >= 0) close(fd);
+        return;
+    }
+    pthread_detach(thread);
+    metrics_listen_fd = fd;
+}
 
-    // Log connection
-    char log_msg[BUFFER_SIZE];
-    snprintf(log_msg, sizeof(log_msg), "Client '%s' connected (socket %d).", client_name.c_str(), client_socket);
-    log_event(log_msg);
-    printf("%s\n", log_msg);
+// ---- Hot restart -----------------------------------------------------------
+//
+// A new server started with --takeover connects to the running one over the
+// Unix socket at handoff_path. The old server parks its reactors, finishes
+// what they left in flight, and sends its listening sockets and every client
+// socket (SCM_RIGHTS) together with each session: name, mode, chat partner,
+// room, unparsed input and unsent output. The new server rebuilds the
+// sessions on its own reactors and acknowledges; only then does the old one
+// exit. Until that point either side can back out and the old server resumes.
+
+bool recv_all(int socket, void* data, size_t len) {
+    char* p = (char*)data;
+    while (len > 0) {
+        ssize_t got = recv(socket, p, len, 0);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+        p += got;
+        len -= got;
+    }
+    return true;
+}
 
-    list_connected_clients();
+void put_u32(string& out, uint32_t v) {
+    out.append((const char*)&v, sizeof(v));
+}
 
-    // Main message handling loop
-    while (1) {
-        memset(buffer, 0, BUFFER_SIZE);
-        bytes_read = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
-        if (bytes_read <= 0) break;
-
-        buffer[bytes_read] = '\0';
-        string msg(buffer);
-        msg.erase(msg.find_last_not_of(" \n\r\t") + 1);
-
-        // Get client's current mode
-        pthread_mutex_lock(&clients_mutex);
-        char mode = 'e';
-        for (int i = 0; i < client_count; i++) {
-            if (clients[i].socket == client_socket) {
-                mode = clients[i].mode;
-                break;
+void put_u64(string& out, uint64_t v) {
+    out.append((const char*)&v, sizeof(v));
+}
+
+void put_bytes(string& out, const char* data, size_t len) {
+    put_u32(out, (uint32_t)len);
+    out.append(data, len);
+}
+
+// Cursor over received session records; ok turns false on a short record
+struct HandoffReader {
+    const char* pos;
+    const char* end;
+    bool ok;
+};
+
+StrView get_span(HandoffReader* in, uint64_t len) {
+    if (!in->ok || (uint64_t)(in->end - in->pos) < len) {
+        in->ok = false;
+        return str_view("");
+    }
+    StrView v = str_view(in->pos, len);
+    in->pos += len;
+    return v;
+}
+
+uint32_t get_u32(HandoffReader* in) {
+    uint32_t v = 0;
+    StrView span = get_span(in, sizeof(v));
+    if (in->ok) memcpy(&v, span.data, sizeof(v));
+    return v;
+}
+
+uint64_t get_u64(HandoffReader* in) {
+    uint64_t v = 0;
+    StrView span = get_span(in, sizeof(v));
+    if (in->ok) memcpy(&v, span.data, sizeof(v));
+    return v;
+}
+
+StrView get_bytes(HandoffReader* in) {
+    return get_span(in, get_u32(in));
+}
+
+// Pass descriptors over a Unix socket, HANDOFF_FDS_PER_MSG at a time; each
+// batch rides on a 4-byte count of the descriptors it carries
+bool send_fds(int socket, const int* fds, size_t count) {
+    char control[CMSG_SPACE(HANDOFF_FDS_PER_MSG * sizeof(int))];
+    while (count > 0) {
+        uint32_t n = (uint32_t)min(count, (size_t)HANDOFF_FDS_PER_MSG);
+        struct iovec iov = { &n, sizeof(n) };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        memset(control, 0, sizeof(control));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+        if (sendmsg(socket, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(n)) return false;
+        fds += n;
+        count -= n;
+    }
+    return true;
+}
+
+bool recv_fds(int socket, vector<int>& fds, size_t count) {
+    char control[CMSG_SPACE(HANDOFF_FDS_PER_MSG * sizeof(int))];
+    while (fds.size() < count) {
+        uint32_t n;
+        struct iovec iov = { &n, sizeof(n) };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(socket, &msg, 0) != (ssize_t)sizeof(n) || (msg.msg_flags & MSG_CTRUNC)) return false;
+        size_t got = 0;
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+            size_t k = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int* data = (const int*)CMSG_DATA(cmsg);
+            fds.insert(fds.end(), data, data + k);
+            got += k;
+        }
+        if (got != n) return false;
+    }
+    return fds.size() == count;
+}
+
+// Listen on handoff_path for a new server that wants to take over
+int create_handoff_listener() {
+    struct sockaddr_un addr;
+    if (!*handoff_path) return -1;
+    if (strlen(handoff_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Hot restart disabled: %s is too long for a socket path\n", handoff_path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, handoff_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(handoff_path);            // Left by a server that was replaced or killed
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        perror("Hot restart disabled");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    set_nonblocking(fd);
+    return fd;
+}
+
+// With every reactor parked, finish their in-flight work on this thread:
+// mail posted before they stopped, and the output it queued. Closing a
+// connection can post more mail, so go round until nothing is left.
+void settle_reactors() {
+    bool busy = true;
+    while (busy) {
+        busy = false;
+        for (int i = 0; i < reactor_count; i++) {
+            Reactor* r = &reactors[i];
+            current_reactor = r;
+            if (r->mailbox.head.load(memory_order_acquire)) {
+                drain_mailbox(r);
+                busy = true;
             }
+            for (size_t j = 0; j < r->dirty.size(); j++) {
+                Connection* conn = r->dirty[j];
+                conn->flush_queued = false;
+                if (conn->in_use && !handle_writable(conn)) close_connection(conn);
+                busy = true;
+            }
+            r->dirty.clear();
         }
-        pthread_mutex_unlock(&clients_mutex);
-
-        if (mode == 'e') {
-            // Echo mode
-            if (msg == "/list") {
-                pthread_mutex_lock(&name_mutex);
-                string user_list = "Connected users:";
-                for (const auto& entry : name_to_socket) {
-                    string mode_str = " (echo)";
-                    pthread_mutex_lock(&clients_mutex);
-                    for (int i = 0; i < client_count; i++) {
-                        if (clients[i].socket == entry.second) {
-                            mode_str = clients[i].mode == 'c' ? " (chat)" : " (echo)";
-                            break;
-                        }
-                    }
-                    pthread_mutex_unlock(&clients_mutex);
-                    user_list += "\n  " + entry.first + mode_str;
-                }
-                pthread_mutex_unlock(&name_mutex);
-                send_message(client_socket, user_list);
-            } else if (msg == "/help") {
-                string help_text = "Commands:\n"
-                                  "  /startchat - Switch to chat mode\n"
-                                  "  /startecho - Switch to echo mode\n"
-                                  "  /list - Show connected users and their modes\n"
-                                  "  /help - Show this help message\n"
-                                  "  /quit - Quit application";
-                send_message(client_socket, help_text);
-            } else if (msg == "/startchat") {
-                pthread_mutex_lock(&clients_mutex);
-                for (int i = 0; i < client_count; i++) {
-                    if (clients[i].socket == client_socket) {
-                        clients[i].mode = 'c';
-                        break;
-                    }
-                }
-                pthread_mutex_unlock(&clients_mutex);
-                send_message(client_socket, "Switched to chat mode. Use /chat <name> to start chatting with someone.");
-            } else if (msg == "/startecho") {
-                pthread_mutex_lock(&clients_mutex);
-                for (int i = 0; i < client_count; i++) {
-                    if (clients[i].socket == client_socket) {
-                        clients[i].mode = 'e';
-                        break;
-                    }
-                }
-                pthread_mutex_unlock(&clients_mutex);
-                send_message(client_socket, "Switched to echo mode.");
-            } else {
-                send(client_socket, buffer, bytes_read, 0);
-                // Log and print message
-                char log_msg[BUFFER_SIZE + 50];
-                snprintf(log_msg, sizeof(log_msg), "Client '%s' (echo mode): %s", client_name.c_str(), buffer);
-                log_event(log_msg);
-                printf("Echo from client '%s': %s", client_name.c_str(), buffer);
+    }
+    current_reactor = NULL;
+}
+
+// The highest generation given out and the session ticket key, then one
+// record per live connection, in the order their sockets are appended to fds.
+// TLS clients are left out and counted in tls_left: their sessions live in
+// OpenSSL, so they reconnect instead, resuming with their tickets.
+string serialize_clients(vector<int>& fds, uint32_t* tls_left) {
+    string out;
+    uint32_t max_gen = gen_floor;
+    for (int s = 0; s < conn_table.slab_count; s++) {
+        Connection* slab = conn_table.slabs[s].load(memory_order_acquire);
+        if (!slab) continue;
+        for (int i = 0; i < SLAB_SIZE; i++) {
+            Connection* conn = &slab[i];
+            max_gen = max(max_gen, conn->gen);
+            if (!conn->in_use) continue;
+            if (conn->tls) {
+                (*tls_left)++;
+                continue;
             }
-        } else {
-            // Chat mode
-            pthread_mutex_lock(&name_mutex);
-            if (chatting_with.count(client_socket)) {
-                int peer = chatting_with[client_socket];
-                pthread_mutex_unlock(&name_mutex);
-                
-                if (msg == "/exit") {
-                    pthread_mutex_lock(&name_mutex);
-                    chatting_with.erase(client_socket);
-                    chatting_with.erase(peer);
-                    pthread_mutex_unlock(&name_mutex);
-                    
-                    send_message(client_socket, "Chat ended.");
-                    send_message(peer, client_name + " has left the chat.");
-                } else if (msg == "/startecho") {
-                    pthread_mutex_lock(&name_mutex);
-                    chatting_with.erase(client_socket);
-                    chatting_with.erase(peer);
-                    pthread_mutex_unlock(&name_mutex);
-                    
-                    send_message(client_socket, "Chat ended. Switching to echo mode.");
-                    send_message(peer, client_name + " has left the chat.");
-                    
-                    pthread_mutex_lock(&clients_mutex);
-                    for (int i = 0; i < client_count; i++) {
-                        if (clients[i].socket == client_socket) {
-                            clients[i].mode = 'e';
-                            break;
-                        }
-                    }
-                    pthread_mutex_unlock(&clients_mutex);
-                } else if (!msg.empty()) {
-                    string full_msg = client_name + ": " + msg;
-                    send_message(peer, full_msg);
-                    
-                    // Log chat message
-                    char log_msg[BUFFER_SIZE + 50];
-                    snprintf(log_msg, sizeof(log_msg), "Chat from '%s' to peer: %s", client_name.c_str(), buffer);
-                    log_event(log_msg);
-                }
-            } else {
-                pthread_mutex_unlock(&name_mutex);
-                
-                if (msg.substr(0, 5) == "/chat") {
-                    string target_name;
-                    if (msg.length() > 6) {
-                        target_name = msg.substr(6);
-                    }
-                    
-                    if (target_name.empty()) {
-                        send_message(client_socket, "Usage: /chat <name>");
-                        continue;
-                    }
-
-                    pthread_mutex_lock(&name_mutex);
-                    if (name_to_socket.count(target_name)) {
-                        int target_socket = name_to_socket[target_name];
-
-                        if (target_socket == client_socket) {
-                            send_message(client_socket, "You cannot chat with yourself.");
-                        } else if (chatting_with.count(target_socket)) {
-                            send_message(client_socket, "Client is already in a chat with someone else.");
-                        } else {
-                            // Check if target user is in echo mode
-                            bool target_in_echo_mode = true;
-                            pthread_mutex_lock(&clients_mutex);
-                            for (int i = 0; i < client_count; i++) {
-                                if (clients[i].socket == target_socket) {
-                                    target_in_echo_mode = (clients[i].mode == 'e');
-                                    break;
-                                }
-                            }
-                            pthread_mutex_unlock(&clients_mutex);
-                            
-                            if (target_in_echo_mode) {
-                                send_message(client_socket, "Cannot start chat: " + target_name + " is in echo mode. They need to switch to chat mode first.");
-                            } else {
-                                chatting_with[client_socket] = target_socket;
-                                chatting_with[target_socket] = client_socket;
-                                pthread_mutex_unlock(&name_mutex);
-
-                                string target_msg = "Chat started with " + client_name + ". Type '/exit' to end.";
-                                string requester_msg = "Chat started with " + target_name + ". Type '/exit' to end.";
-
-                                send_message(client_socket, requester_msg);
-                                send_message(target_socket, target_msg);
-                                
-                                // Log chat start
-                                char log_msg[BUFFER_SIZE + 50];
-                                snprintf(log_msg, sizeof(log_msg), "Chat started between '%s' and '%s'", 
-                                        client_name.c_str(), target_name.c_str());
-                                log_event(log_msg);
-                            }
-                        }
-                    } else {
-                        send_message(client_socket, "Client not found: " + target_name);
-                    }
-                    pthread_mutex_unlock(&name_mutex);
-                } else if (msg == "/list") {
-                    pthread_mutex_lock(&name_mutex);
-                    string user_list = "Connected users:";
-                    for (const auto& entry : name_to_socket) {
-                        string mode_str = " (echo)";
-                        pthread_mutex_lock(&clients_mutex);
-                        for (int i = 0; i < client_count; i++) {
-                            if (clients[i].socket == entry.second) {
-                                mode_str = clients[i].mode == 'c' ? " (chat)" : " (echo)";
-                                break;
-                            }
-                        }
-                        pthread_mutex_unlock(&clients_mutex);
-                        user_list += "\n  " + entry.first + mode_str;
-                    }
-                    pthread_mutex_unlock(&name_mutex);
-                    send_message(client_socket, user_list);
-                } else if (msg == "/help") {
-                    string help_text = "Commands:\n"
-                                      "  /chat <name> - Request chat with another user\n"
-                                      "  /list - Show connected users\n"
-                                      "  /exit - Leave current chat\n"
-                                      "  /startecho - Switch to echo mode\n"
-                                      "  /quit - Disconnect from server\n"
-                                      "  /help - Show this help message";
-                    send_message(client_socket, help_text);
-                } else if (msg == "/startecho") {
-                    if (chatting_with.count(client_socket)) {
-                        int peer = chatting_with[client_socket];
-                        chatting_with.erase(client_socket);
-                        chatting_with.erase(peer);
-                        
-                        send_message(client_socket, "Chat ended.");
-                        send_message(peer, client_name + " has left the chat.");
-                    }
-                    pthread_mutex_lock(&clients_mutex);
-                    for (int i = 0; i < client_count; i++) {
-                        if (clients[i].socket == client_socket) {
-                            clients[i].mode = 'e';
-                            break;
-                        }
-                    }
-                    pthread_mutex_unlock(&clients_mutex);
-                    send_message(client_socket, "Switched to echo mode.");
-                } else {
-                    send_message(client_socket, "You are in chat mode but not chatting with anyone. Use /chat <name> to start a chat or /startecho to switch to echo mode.");
-                }
+            Connection* peer = resolve_ref(conn->peer.load(memory_order_relaxed));
+            put_u32(out, conn->socket);
+            put_u32(out, conn->reactor->index);
+            put_u32(out, conn->state);
+            put_u32(out, (unsigned char)conn->mode.load(memory_order_relaxed));
+            put_u32(out, conn->framing);
+            put_u32(out, conn->batch_op);
+            put_u64(out, conn->batch_left);
+            put_u32(out, conn->codec);
+            put_u32(out, peer ? (uint32_t)peer->socket : UINT32_MAX);
+            put_bytes(out, conn->name.data(), conn->name.size());
+            if (conn->room) put_bytes(out, conn->room->name.data(), conn->room->name.size());
+            else put_bytes(out, "", 0);
+            put_bytes(out, conn->in.data + conn->in.start, conn->in.end - conn->in.start);
+            // Unsent output, already framed for the client
+            OutQueue* q = &conn->out;
+            put_u64(out, q->bytes.load(memory_order_relaxed));
+            for (unsigned c = 0; c < q->count; c++) {
+                OutChunk* chunk = &q->items[(q->head + c) % q->cap];
+                out.append(chunk->buf->data + chunk->offset, chunk->buf->len - chunk->offset);
             }
+            fds.push_back(conn->socket);
         }
     }
-    // Client disconnected
-    pthread_mutex_lock(&name_mutex);
-    if (chatting_with.count(client_socket)) {
-        int peer = chatting_with[client_socket];
-        chatting_with.erase(peer);
-        chatting_with.erase(client_socket);
-        send_message(peer, client_name + " has disconnected.");
+    string prefix;
+    put_u32(prefix, max_gen);
+    string keys = tls_ticket_keys();
+    put_bytes(prefix, keys.data(), keys.size());
+    return prefix + out;
+}
+
+// A new server connected to the handoff socket: park the reactors, send it
+// every socket and session, and exit once it has taken over. If it backs out
+// or goes quiet, release the reactors and carry on serving.
+void serve_handoff(int handoff_fd, int server_fd) {
+    int fd = accept(handoff_fd, NULL, NULL);
+    if (fd < 0) return;
+    struct timeval timeout = { HANDOFF_TIMEOUT, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    uint32_t hello[2];
+    const char* refusal = NULL;
+    if (!recv_all(fd, hello, sizeof(hello)) || hello[0] != HANDOFF_MAGIC) {
+        close(fd);
+        return;
+    }
+    uint64_t start = monotonic_ns();
+    if (io_backend == IO_URING) {
+        refusal = "the running server uses --io uring, whose in-flight receives cannot be handed over";
+    } else if ((hello[1] != 0) != reuseport_mode) {
+        refusal = "--reactors must be given to both servers or to neither";
+    }
+    string reply;
+    put_u32(reply, refusal ? 1 : 0);
+    if (refusal) put_bytes(reply, refusal, strlen(refusal));
+    if (!send_all(fd, reply.data(), reply.size()) || refusal) {
+        if (refusal) log_event("Refused a hot restart request.");
+        close(fd);
+        return;
+    }
+
+    // Stop every reactor at the end of its current iteration
+    handoff_pending.store(true, memory_order_release);
+    for (int i = 0; i < reactor_count; i++) {
+        uint64_t one = 1;
+        if (write(reactors[i].wake_fd, &one, sizeof(one)) < 0) {}
+    }
+    pthread_mutex_lock(&handoff_mutex);
+    while (parked_reactors < reactor_count) {
+        pthread_cond_wait(&handoff_cond, &handoff_mutex);
+    }
+    pthread_mutex_unlock(&handoff_mutex);
+    settle_reactors();
+    uint64_t quiesced = monotonic_ns();
+
+    // Listeners first, then the TLS and metrics listeners, then one socket per record
+    vector<int> fds;
+    if (reuseport_mode) {
+        for (int i = 0; i < reactor_count; i++) {
+            fds.push_back(reactors[i].listen_fd);
+        }
+    } else {
+        fds.push_back(server_fd);
     }
-    name_to_socket.erase(client_name);
-    client_names.erase(client_socket);
-    pthread_mutex_unlock(&name_mutex);
+    uint32_t listeners = (uint32_t)fds.size();
+    if (tls_listen_fd >= 0) fds.push_back(tls_listen_fd);
+    if (metrics_listen_fd >= 0) fds.push_back(metrics_listen_fd);
+    uint32_t tls_left = 0;
+    string records = serialize_clients(fds, &tls_left);
+    uint32_t clients = (uint32_t)fds.size() - listeners - (tls_listen_fd >= 0) - (metrics_listen_fd >= 0);
+    string header;
+    put_u32(header, listeners);
+    put_u32(header, tls_listen_fd >= 0);
+    put_u32(header, metrics_listen_fd >= 0);
+    put_u32(header, clients);
+    put_u64(header, (quiesced - start) / 1000);
+    put_u64(header, records.size());
+    bool ok = send_all(fd, header.data(), header.size()) && send_all(fd, records.data(), records.size()) &&
+              send_fds(fd, fds.data(), fds.size());
+    char ack = 0, bye = HANDOFF_BYE;
+    ok = ok && recv_all(fd, &ack, 1) && ack == HANDOFF_ACK && send_all(fd, &bye, 1);
 
-    remove_client(client_socket);
-    snprintf(log_msg, sizeof(log_msg), "Client '%s' disconnected (socket %d).", client_name.c_str(), client_socket);
+    char log_msg[BUFFER_SIZE];
+    if (ok) {
+        // The new server owns every socket now; leave them untouched and go
+        snprintf(log_msg, sizeof(log_msg),
+                 "Handed %u clients to the new server in %.1f ms (%.1f ms to park the reactors); %u TLS clients will reconnect; exiting.",
+                 clients, (monotonic_ns() - start) / 1e6, (quiesced - start) / 1e6, tls_left);
+        log_event(log_msg);
+        printf("%s\n", log_msg);
+        fflush(stdout);
+        flush_log();
+        _exit(0);
+    }
+    snprintf(log_msg, sizeof(log_msg), "Hot restart abandoned by the new server after %.1f ms; resuming.",
+             (monotonic_ns() - start) / 1e6);
     log_event(log_msg);
     printf("%s\n", log_msg);
-    close(client_socket);
+    close(fd);
+    pthread_mutex_lock(&handoff_mutex);
+    handoff_pending.store(false, memory_order_relaxed);
+    pthread_cond_broadcast(&handoff_cond);
+    pthread_mutex_unlock(&handoff_mutex);
+}
+
+// Sockets and sessions received from the server being replaced
+struct Handoff {
+    int socket;                      // To the old server, until the takeover commits
+    vector<int> listeners;
+    int tls_fd;                      // -1 if the old server had no TLS listener
+    int metrics_fd;                  // -1 if the old server had no metrics endpoint
+    vector<int> clients;             // One per record, in order
+    string records;
+    uint64_t started_ns;             // When we asked
+    uint64_t quiesce_us;             // How long the old server took to park its reactors
+    uint64_t received_ns;            // When the last socket arrived
+};
+
+// Ask the server on handoff_path for its sockets and sessions. On failure
+// the old server keeps running and this one should exit.
+bool receive_handoff(Handoff* h) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, handoff_path, sizeof(addr.sun_path) - 1);
+    h->socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (h->socket < 0 || connect(h->socket, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "No server to take over at %s: %s\n", handoff_path, strerror(errno));
+        return false;
+    }
+    h->started_ns = monotonic_ns();
+    uint32_t hello[2] = { HANDOFF_MAGIC, reuseport_mode };
+    uint32_t status;
+    if (!send_all(h->socket, (const char*)hello, sizeof(hello)) || !recv_all(h->socket, &status, sizeof(status))) {
+        fprintf(stderr, "Takeover failed: connection to the old server lost\n");
+        return false;
+    }
+    if (status != 0) {
+        char reason[256] = "";
+        uint32_t len = 0;
+        if (recv_all(h->socket, &len, sizeof(len)) && len < sizeof(reason)) recv_all(h->socket, reason, len);
+        fprintf(stderr, "The running server refused the takeover: %s\n", reason);
+        return false;
+    }
+
+    char header[4 * sizeof(uint32_t) + 2 * sizeof(uint64_t)];
+    if (!recv_all(h->socket, header, sizeof(header))) {
+        fprintf(stderr, "Takeover failed: connection to the old server lost\n");
+        return false;
+    }
+    HandoffReader in = { header, header + sizeof(header), true };
+    uint32_t listeners = get_u32(&in);
+    uint32_t has_tls = get_u32(&in);
+    uint32_t has_metrics = get_u32(&in);
+    uint32_t clients = get_u32(&in);
+    h->quiesce_us = get_u64(&in);
+    h->records.resize(get_u64(&in));
+    vector<int> fds;
+    if (!recv_all(h->socket, &h->records[0], h->records.size()) ||
+        !recv_fds(h->socket, fds, listeners + has_tls + has_metrics + clients)) {
+        fprintf(stderr, "Takeover failed: connection to the old server lost\n");
+        return false;
+    }
+    h->listeners.assign(fds.begin(), fds.begin() + listeners);
+    h->tls_fd = has_tls ? fds[listeners] : -1;
+    h->metrics_fd = has_metrics ? fds[listeners + has_tls] : -1;
+    h->clients.assign(fds.begin() + listeners + has_tls + has_metrics, fds.end());
+    h->received_ns = monotonic_ns();
+    return true;
+}
+
+// Rebuild the handed-over sessions on this server's reactors, before they
+// start: names, modes, chat partners, rooms and bytes still in flight.
+// Returns how many clients were restored, or -1 if the records are corrupt.
+int restore_clients(Handoff* h) {
+    HandoffReader in = { h->records.data(), h->records.data() + h->records.size(), true };
+    unordered_map<uint32_t, Connection*> by_old_socket;
+    vector<pair<Connection*, uint32_t> > partners;
+    int restored = 0;
+    gen_floor = get_u32(&in);
+    tls_adopt_ticket_keys(get_bytes(&in));
+    for (size_t i = 0; i < h->clients.size(); i++) {
+        uint32_t old_socket = get_u32(&in);
+        uint32_t index = get_u32(&in);
+        uint32_t state = get_u32(&in);
+        uint32_t mode = get_u32(&in);
+        uint32_t framing = get_u32(&in);
+        uint32_t batch_op = get_u32(&in);
+        uint64_t batch_left = get_u64(&in);
+        uint32_t codec = get_u32(&in);
+        uint32_t peer = get_u32(&in);
+        StrView name = get_bytes(&in);
+        StrView room = get_bytes(&in);
+        StrView input = get_bytes(&in);
+        StrView output = get_span(&in, get_u64(&in));
+        if (!in.ok) return -1;
+
+        int fd = h->clients[i];
+        Reactor* r = &reactors[index % reactor_count];
+        admitted_clients.fetch_add(1, memory_order_relaxed);
+        register_client(fd, r);
+        Connection* conn = find_client(fd);
+        if (!conn) continue;
+        conn->state = (ConnState)state;
+        conn->mode.store((char)mode, memory_order_relaxed);
+        conn->framing = (Framing)framing;
+        conn->batch_op = batch_op;
+        conn->batch_left = batch_left;
+        conn->name.assign(name.data, name.len);
+        if (conn->state == CONN_ACTIVE) {
+            register_name(conn->name, conn_ref(conn));
+            if (!history.dir.empty()) history_online(conn);
+        }
+        if (room.len) room_add(conn, find_room(string(room.data, room.len)));
+        if (output.len) queue_stream(conn, output.data, output.len);
+        // Replies from here on are compressed again, with a context of our
+        // own; a build without the codec sends them uncompressed
+        if (codec_available(codec)) conn->codec = (Codec)codec;
+        // User ids embed the socket, which has a new number here; a binary
+        // client gets its new id and must look up the ids it knows again
+        if (conn->state == CONN_ACTIVE && conn->framing == FRAMING_BINARY) send_welcome(conn);
+        if (input.len) {
+            // Complete messages may be waiting; the timer wheel's first tick
+            // parses them on the reactor's own thread
+            input_append(&conn->in, input.data, input.len, input.len);
+            conn->throttled_until = r->now_ms;
+            schedule_timeout(conn);
+        }
+        by_old_socket[old_socket] = conn;
+        if (peer != UINT32_MAX) partners.push_back(make_pair(conn, peer));
+        restored++;
+    }
+    for (size_t i = 0; i < partners.size(); i++) {
+        unordered_map<uint32_t, Connection*>::iterator it = by_old_socket.find(partners[i].second);
+        if (it != by_old_socket.end()) partners[i].first->peer.store(conn_ref(it->second), memory_order_relaxed);
+    }
+    registry_version.fetch_add(1, memory_order_relaxed);
+    return restored;
 }
 
-// Function to manage thread pool
-void* thread_function(void* arg) {
+// Tell the old server every session is in place and wait for it to let go.
+// False if it gave up first; it then keeps serving and this server must not.
+bool commit_takeover(Handoff* h) {
+    char ack = HANDOFF_ACK, bye = 0;
+    bool ok = send_all(h->socket, &ack, 1) && recv_all(h->socket, &bye, 1) && bye == HANDOFF_BYE;
+    close(h->socket);
+    return ok;
+}
+
+// The TLS listener: the one a hot restart handed over if it is on
+// --tls-port, otherwise a new one (or none without --tls-port)
+int open_tls_listener(int inherited) {
+    if (inherited >= 0) {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        if (tls_port && getsockname(inherited, (struct sockaddr*)&addr, &len) == 0 && ntohs(addr.sin_port) == tls_port) {
+            return inherited;
+        }
+        close(inherited);
+    }
+    if (!tls_port) return -1;
+    int fd = create_listener(tls_port, false);
+    set_nonblocking(fd);
+    return fd;
+}
+
+// Accept every pending connection on a listener main() serves and mail each
+// socket to the next reactor, which registers it on its own thread
+void accept_and_post(int listen_fd, bool tls) {
     while (1) {
-        int client_socket = dequeue_client();
-        sem_wait(&client_semaphore);
-        handle_client(client_socket);
-        sem_post(&client_semaphore);
+        int client_socket = accept(listen_fd, NULL, NULL);
+        if (client_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("Accept failed");
+            return;
+        }
+        metric_add(metrics()->accepts, 1);
+        if (!admit_client(client_socket)) continue;
+        set_nonblocking(client_socket);
+        metric_add(metrics()->handoffs_posted, 1);
+        post_mail(&reactors[next_loop], client_socket, tls, NULL);
+        next_loop = (next_loop + 1) % reactor_count;
     }
-    return NULL;
 }
 
-int main() {
-    int server_fd, client_socket;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_len = sizeof(client_addr);
+void usage(const char* prog) {
+    printf("Usage: %s [--reactors N] [--pin] [--io B] [--max-clients N] [--max-message BYTES]\n"
+           "       [--echo-path P] [--output-hwm BYTES] [--log-mode M] [--log-overflow P]\n"
+           "       [--metrics-port N] [--handshake-timeout S] [--idle-timeout S] [--write-stall-timeout S]\n"
+           "       [--accept-rate N] [--client-msg-rate N] [--client-byte-rate N] [--ip-msg-rate N] [--ip-byte-rate N]\n"
+           "       [--handoff-path P] [--takeover] [--history-dir D] [--compress-min BYTES]\n"
+           "       [--tls-port N --tls-cert FILE --tls-key FILE] [--ktls on|off]\n", prog);
+    printf("  --reactors N     Run N reactors, each accepting on its own SO_REUSEPORT socket\n");
+    printf("  --pin            Pin reactor i to CPU i\n");
+    printf("  --io B           I/O backend: epoll (default) or uring\n");
+    printf("  --max-clients N  Maximum concurrent connections (default %d)\n", DEFAULT_MAX_CLIENTS);
+    printf("  --max-message B  Largest message payload in bytes (default %d)\n", DEFAULT_MAX_MESSAGE);
+    printf("  --echo-path P    copy (default) or fast: echo from the receive buffer, no per-message log\n");
+    printf("  --output-hwm B   Queued output per client before backpressure (default %d)\n", DEFAULT_OUTPUT_HWM);
+    printf("  --log-mode M     async (default), sync or off\n");
+    printf("  --log-overflow P drop (default) or block when the async log ring is full\n");
+    printf("  --metrics-port N Serve Prometheus metrics on 127.0.0.1:N (default %d, 0 = off)\n", DEFAULT_METRICS_PORT);
+    printf("  --handshake-timeout S    Close connections that send no name within S seconds (default %d, 0 = never)\n",
+           DEFAULT_HANDSHAKE_TIMEOUT);
+    printf("  --idle-timeout S         Close clients with no traffic for S seconds (default %d, 0 = never)\n", DEFAULT_IDLE_TIMEOUT);
+    printf("  --write-stall-timeout S  Close clients whose queued output has not drained for S seconds (default %d, 0 = never)\n",
+           DEFAULT_WRITE_STALL_TIMEOUT);
+    printf("  --accept-rate N       Shed new connections beyond N per second (default 0 = unlimited)\n");
+    printf("  --client-msg-rate N   Messages per second read from one connection (default 0 = unlimited)\n");
+    printf("  --client-byte-rate N  Bytes per second read from one connection (default 0 = unlimited)\n");
+    printf("  --ip-msg-rate N       Messages per second read from all connections of one address (default 0 = unlimited)\n");
+    printf("  --ip-byte-rate N      Bytes per second read from all connections of one address (default 0 = unlimited)\n");
+    printf("  --handoff-path P Unix socket a new server connects to for a hot restart (default %s, \"\" = off)\n",
+           DEFAULT_HANDOFF_PATH);
+    printf("  --takeover       Take over the listening sockets and clients of the server running on --handoff-path\n");
+    printf("  --history-dir D  Keep chat and /msg history in D, hold messages for users who are away (default off)\n");
+    printf("  --compress-min B Compress payloads of at least B bytes for binary clients that ask (default %d)\n",
+           DEFAULT_COMPRESS_MIN);
+    printf("  --tls-port N     Also accept TLS clients on port N (default off; needs --io epoll)\n");
+    printf("  --tls-cert F     PEM certificate chain for --tls-port\n");
+    printf("  --tls-key F      PEM private key for --tls-port\n");
+    printf("  --ktls M         on (default) or off: let the kernel encrypt TLS records where it supports that\n");
+#ifdef HAVE_OPENSSL
+    printf("TLS in this build: %s\n", OpenSSL_version(OPENSSL_VERSION));
+#else
+    printf("TLS in this build: none (make TLS=1)\n");
+#endif
+    printf("Compression codecs in this build:");
+    int codecs = 0;
+    for (int c = CODEC_NONE + 1; c < CODEC_COUNT; c++) {
+        if (!codec_available(c)) continue;
+        printf(" %s", codec_names[c]);
+        codecs++;
+    }
+    printf("%s\n", codecs ? "" : " none (make COMPRESSION=\"lz4 zstd\")");
+}
 
-    sem_init(&client_semaphore, 0, MAX_CLIENTS);
-    pthread_mutex_init(&queue_mutex, NULL);
-    pthread_mutex_init(&log_mutex, NULL);
-    pthread_mutex_init(&name_mutex, NULL);
-    pthread_mutex_init(&clients_mutex, NULL);
-    pthread_cond_init(&queue_cond, NULL);
+int main(int argc, char* argv[]) {
+    int server_fd = -1;
+    const char* history_dir = NULL;
 
-    // Create thread pool
-    pthread_t threads[THREAD_POOL_SIZE];
-    for (int i = 0; i < THREAD_POOL_SIZE; i++) {
-        pthread_create(&threads[i], NULL, thread_function, NULL);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--reactors") == 0 && i + 1 < argc) {
+            reactor_count = atoi(argv[++i]);
+            reuseport_mode = true;
+        } else if (strcmp(argv[i], "--max-clients") == 0 && i + 1 < argc) {
+            max_clients = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-message") == 0 && i + 1 < argc) {
+            max_message = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--compress-min") == 0 && i + 1 < argc) {
+            compress_min = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--echo-path") == 0 && i + 1 < argc) {
+            const char* path = argv[++i];
+            if (strcmp(path, "fast") == 0) echo_fast_path = true;
+            else if (strcmp(path, "copy") == 0) echo_fast_path = false;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--output-hwm") == 0 && i + 1 < argc) {
+            output_hwm = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--log-mode") == 0 && i + 1 < argc) {
+            const char* mode = argv[++i];
+            if (strcmp(mode, "async") == 0) log_mode = LOG_ASYNC;
+            else if (strcmp(mode, "sync") == 0) log_mode = LOG_SYNC;
+            else if (strcmp(mode, "off") == 0) log_mode = LOG_OFF;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--log-overflow") == 0 && i + 1 < argc) {
+            const char* policy = argv[++i];
+            if (strcmp(policy, "drop") == 0) log_block_when_full = false;
+            else if (strcmp(policy, "block") == 0) log_block_when_full = true;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+            const char* backend = argv[++i];
+            if (strcmp(backend, "epoll") == 0) io_backend = IO_EPOLL;
+            else if (strcmp(backend, "uring") == 0) io_backend = IO_URING;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--metrics-port") == 0 && i + 1 < argc) {
+            metrics_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--handshake-timeout") == 0 && i + 1 < argc) {
+            handshake_timeout_ms = strtoul(argv[++i], NULL, 10) * 1000;
+        } else if (strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc) {
+            idle_timeout_ms = strtoul(argv[++i], NULL, 10) * 1000;
+        } else if (strcmp(argv[i], "--write-stall-timeout") == 0 && i + 1 < argc) {
+            write_stall_timeout_ms = strtoul(argv[++i], NULL, 10) * 1000;
+        } else if (strcmp(argv[i], "--accept-rate") == 0 && i + 1 < argc) {
+            accept_rate = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--client-msg-rate") == 0 && i + 1 < argc) {
+            client_msg_rate = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--client-byte-rate") == 0 && i + 1 < argc) {
+            client_byte_rate = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--ip-msg-rate") == 0 && i + 1 < argc) {
+            ip_msg_rate = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--ip-byte-rate") == 0 && i + 1 < argc) {
+            ip_byte_rate = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--handoff-path") == 0 && i + 1 < argc) {
+            handoff_path = argv[++i];
+        } else if (strcmp(argv[i], "--history-dir") == 0 && i + 1 < argc) {
+            history_dir = argv[++i];
+        } else if (strcmp(argv[i], "--tls-port") == 0 && i + 1 < argc) {
+            tls_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tls-cert") == 0 && i + 1 < argc) {
+            tls_cert = argv[++i];
+        } else if (strcmp(argv[i], "--tls-key") == 0 && i + 1 < argc) {
+            tls_key = argv[++i];
+        } else if (strcmp(argv[i], "--ktls") == 0 && i + 1 < argc) {
+            const char* mode = argv[++i];
+            if (strcmp(mode, "on") == 0) ktls_enabled = true;
+            else if (strcmp(mode, "off") == 0) ktls_enabled = false;
+            else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--takeover") == 0) {
+            takeover = true;
+        } else if (strcmp(argv[i], "--pin") == 0) {
+            pin_reactors = true;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (reactor_count < 1 || max_clients < 1 || max_message < 1 || metrics_port < 0 || metrics_port > 65535 ||
+        (takeover && !*handoff_path) || tls_port < 0 || tls_port > 65535 || (tls_port && (!tls_cert || !tls_key)) ||
+        accept_rate < 0 || client_msg_rate < 0 || client_byte_rate < 0 || ip_msg_rate < 0 || ip_byte_rate < 0) {
+        usage(argv[0]);
+        return 1;
     }
 
-    // Create server socket
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == -1) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
+    if (tls_port) {
+#ifndef HAVE_OPENSSL
+        fprintf(stderr, "This server was built without TLS; rebuild it with make TLS=1\n");
+        return 1;
+#endif
+        // OpenSSL reads and writes the socket itself, which io_uring's
+        // provided-buffer receives and queued sends would go around
+        if (io_backend == IO_URING) {
+            fprintf(stderr, "--tls-port needs --io epoll\n");
+            return 1;
+        }
+        if (!tls_setup()) {
+            fprintf(stderr, "TLS setup failed\n");
+            return 1;
+        }
     }
 
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
+    signal(SIGPIPE, SIG_IGN);
+    int fd_limit = raise_fd_limit(max_clients + RESERVED_FDS);
+    if (fd_limit < max_clients + RESERVED_FDS) {
+        max_clients = fd_limit > 2 * RESERVED_FDS ? fd_limit - RESERVED_FDS : fd_limit / 2;
+        fprintf(stderr, "Descriptor limit is %d; serving at most %d clients\n", fd_limit, max_clients);
+    }
+    conn_table_init(fd_limit);
+    pthread_mutex_init(&log_mutex, NULL);
+    for (int i = 0; i < NAME_SHARDS; i++) {
+        pthread_mutex_init(&name_shards[i].lock, NULL);
+    }
+    for (int i = 0; i < IP_SHARDS; i++) {
+        pthread_mutex_init(&ip_shards[i].lock, NULL);
+    }
+    pthread_mutex_init(&clients_mutex, NULL);
+    pthread_mutex_init(&rooms_mutex, NULL);
+    pthread_mutex_init(&history_mutex, NULL);
+    pthread_mutex_init(&list_mutex, NULL);
+    user_list = build_user_list();
+    start_logger();
 
-    // Bind socket
-    if (bind(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind failed");
-        exit(EXIT_FAILURE);
+    // Hot restart: everything the old server hands over is in place before
+    // any reactor runs, and nothing is served unless the old server lets go
+    Handoff handoff;
+    handoff.tls_fd = handoff.metrics_fd = -1;
+    if (takeover && !receive_handoff(&handoff)) return 1;
+    // Opened after the handoff, once the old server has stopped appending
+    if (history_dir && *history_dir) history_open(history_dir);
+    start_metrics(handoff.metrics_fd);
+    // Before the takeover commits, so a port that cannot be bound leaves the old server running
+    tls_listen_fd = open_tls_listener(handoff.tls_fd);
+
+    // Create reactors
+    reactors = new Reactor[reactor_count];
+    for (int i = 0; i < reactor_count; i++) {
+        bool inherited = reuseport_mode && i < (int)handoff.listeners.size();
+        init_reactor(&reactors[i], i, inherited ? handoff.listeners[i] : -1);
     }
+    for (size_t i = reactor_count; reuseport_mode && i < handoff.listeners.size(); i++) {
+        close(handoff.listeners[i]);
+    }
+    if (takeover) {
+        int restored = restore_clients(&handoff);
+        if (restored < 0 || !commit_takeover(&handoff)) {
+            fprintf(stderr, "Takeover abandoned; the old server keeps running\n");
+            return 1;
+        }
+        uint64_t done = monotonic_ns();
+        takeover_us = (done - handoff.started_ns) / 1000;
+        char log_msg[BUFFER_SIZE];
+        snprintf(log_msg, sizeof(log_msg),
+                 "Took over %d clients; they waited %.1f ms (old server parking %.1f ms, transfer %.1f ms, restore %.1f ms).",
+                 restored, takeover_us / 1e3, handoff.quiesce_us / 1e3,
+                 (handoff.received_ns - handoff.started_ns) / 1e6 - handoff.quiesce_us / 1e3, (done - handoff.received_ns) / 1e6);
+        log_event(log_msg);
+        printf("%s\n", log_msg);
+    }
+    for (int i = 0; i < reactor_count; i++) {
+        pthread_create(&reactors[i].thread, NULL, io_backend == IO_URING ? uring_reactor_loop : reactor_loop, &reactors[i]);
+    }
+    int handoff_fd = create_handoff_listener();
 
-    // Listen
-    if (listen(server_fd, 10) == 0)
-        printf("Server listening on port %d...\n", PORT);
-    else {
-        perror("Listen failed");
-        exit(EXIT_FAILURE);
+    if (tls_listen_fd >= 0) printf("TLS on port %d (kTLS %s)\n", tls_port, ktls_enabled ? "where the kernel supports it" : "off");
+
+    if (reuseport_mode) {
+        printf("Server listening on port %d with %d reactors...\n", PORT, reactor_count);
+        log_event("Server started.");
+        // The reactors accept plaintext clients themselves; main() takes TLS ones
+        struct pollfd pfds[2] = { { handoff_fd, POLLIN, 0 }, { tls_listen_fd, POLLIN, 0 } };
+        while (handoff_fd >= 0 || tls_listen_fd >= 0) {
+            if (poll(pfds, 2, -1) <= 0) continue;
+            if (pfds[0].revents & POLLIN) serve_handoff(handoff_fd, -1);
+            if (pfds[1].revents & POLLIN) accept_and_post(tls_listen_fd, true);
+        }
+        for (int i = 0; i < reactor_count; i++) {
+            pthread_join(reactors[i].thread, NULL);
+        }
+        return 0;
     }
 
+    // Create server socket
+    server_fd = handoff.listeners.empty() ? create_listener(PORT, false) : handoff.listeners[0];
+    set_nonblocking(server_fd);
+    printf("Server listening on port %d...\n", PORT);
+
     log_event("Server started.");
 
-    // Accept clients
+    // Accept clients, and watch for a new server asking to take over
+    struct pollfd pfds[3] = { { server_fd, POLLIN, 0 }, { handoff_fd, POLLIN, 0 }, { tls_listen_fd, POLLIN, 0 } };
     while (1) {
-        client_socket = accept(server_fd, (struct sockaddr*)&client_addr, &addr_len);
-        if (client_socket < 0) {
-            perror("Accept failed");
-            continue;
-        }
-        enqueue_client(client_socket);
+        if (poll(pfds, 3, -1) < 0) continue;
+        if (pfds[1].revents & POLLIN) serve_handoff(handoff_fd, server_fd);
+        if (pfds[0].revents & POLLIN) accept_and_post(server_fd, false);
+        if (pfds[2].revents & POLLIN) accept_and_post(tls_listen_fd, true);
     }
 
     // Cleanup 
     close(server_fd);
-    sem_destroy(&client_semaphore);
-    pthread_mutex_destroy(&queue_mutex);
     pthread_mutex_destroy(&log_mutex);
-    pthread_mutex_destroy(&name_mutex);
     pthread_mutex_destroy(&clients_mutex);
-    pthread_cond_destroy(&queue_cond);
+    pthread_mutex_destroy(&rooms_mutex);
+    pthread_mutex_destroy(&list_mutex);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -1,187 +1,1729 @@
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <deque>
+#include <queue>
 #include <thread>
+#include <atomic>
 #include <chrono>
 #include <string>
 #include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <cmath>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
 #include <unistd.h>
-#include <atomic>
 #include <fstream>
 #include <iomanip>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
 
-#define BUFFER_SIZE 1024
+#define BUFFER_SIZE 65536
 #define DEFAULT_PORT 8989
+#define DEFAULT_THREADS 4
+#define DEFAULT_MESSAGE_SIZE 64
+#define DEFAULT_ROOM_SIZE 50
+#define DEFAULT_REPLAY 100     // Messages each /history asks for in the replay scenario
+#define AWAY_PREFIX "loadgen_away_"  // Store and replay: /msg goes to these users, who log in once and leave
+#define AWAY_HELD_MAX 1000     // The server holds at most this many messages for an away user
+#define AWAY_DURATION_REQUESTS 10000  // Store requests per connection planned for in --duration runs without --rate
+#define MAX_EVENTS 256
+#define WELCOME_LINES 2        // Replies the server sends after a name
+#define BINARY_MAGIC '\xfe'    // First byte of a binary protocol connection
+#define BINARY_HEADER 8        // Opcode, flags, big-endian request tag and payload length
+#define BINARY_COMPRESSED 0x02 // Header flag: payload is the 4-byte raw length, then the compressed message
+#define OP_HELLO 1             // Binary opcodes the load generator uses
+#define OP_MESSAGE 3
+#define OP_COMPRESS 11
+#define COMPRESS_MIN 512       // Requests this large are sent compressed (the server's default threshold)
+#define ZSTD_LEVEL 1
+#define STALL_TIMEOUT_NS 10000000000ULL  // Give up after 10 s without any reply
+#define DRAIN_GRACE_NS 5000000000ULL     // Wait this long for replies after --duration
+#define HIST_SUB_BITS 7        // 128 linear sub-buckets per power of two: under 1% error
+#define HIST_GROUPS 57         // Enough powers of two for any 64-bit value
+
+enum LoadMode { MODE_CLOSED, MODE_OPEN };
+
+// What each connection does once it has registered its name
+enum Scenario {
+    SCENARIO_ECHO,    // Requests are echoed back
+    SCENARIO_CHAT,    // Connections pair up with /chat and relay to each other
+    SCENARIO_LIST,    // Every request is a /list
+    SCENARIO_CHURN,   // Connect, register a name, disconnect, repeat
+    SCENARIO_ROOM,    // One speaker per room broadcasts to everyone else in it
+    SCENARIO_STORE,   // /msg to a user who is away: each one is appended to the history store
+    SCENARIO_REPLAY   // /history of a conversation seeded with --replay messages
+};
+
+const char* scenario_names[] = { "echo", "chat", "list", "churn", "room", "store", "replay" };
+// What one request is called in the report
+const char* scenario_units[] = { "echoes", "relays", "lists", "sessions", "deliveries", "stored messages", "replays" };
+
+// Payload compression negotiated with OP_COMPRESS; ids as the server numbers them
+enum Codec { CODEC_NONE, CODEC_LZ4, CODEC_ZSTD, CODEC_COUNT };
+const char* codec_names[] = { "none", "lz4", "zstd" };
+
+// What requests are filled with, which decides how well they compress
+enum PayloadKind {
+    PAYLOAD_FILL,     // One repeated letter
+    PAYLOAD_TEXT,     // Words from a small vocabulary, like chat
+    PAYLOAD_RANDOM    // Random letters and digits
+};
+const char* payload_names[] = { "fill", "text", "random" };
 
-std::atomic<int> successful_connections(0);
-std::atomic<int> failed_connections(0);
-std::atomic<int> total_messages_sent(0);
-std::atomic<int> total_messages_received(0);
+// --tls: every session does a full handshake, or offers the ticket from its last one
+enum TlsMode { TLS_OFF, TLS_FULL, TLS_RESUME };
+const char* tls_names[] = { "off", "full", "resume" };
 
-struct TestResults {
+struct LoadConfig {
+    std::string server_ip;
+    int port;
     int num_clients;
-    int messages_per_client;
-    double connection_time;
-    double message_latency;
+    int messages_per_client;  // Per connection; ignored when duration is set
+    int threads;
+    int depth;                // Closed loop: requests in flight per connection
+    double rate;              // Open loop: requests per second across all connections
+    double duration;          // Seconds; 0 means run until messages_per_client are echoed
+    int message_size;         // Bytes per request including the newline
+    int room_size;            // Room scenario: members per room, speaker included
+    int replay;               // Replay scenario: messages per /history
+    int metrics_port;         // Server's Prometheus port to read allocation counts from; 0 = don't
+    long long max_allocs;     // --max-allocs: fail if the server allocated more than this while running; -1 = don't check
+    bool binary;              // --protocol binary: framed requests, a user id instead of the welcome lines
+    Codec codec;              // --compress: asked for at connect; requests from COMPRESS_MIN bytes go compressed
+    PayloadKind payload_kind;
+    TlsMode tls;
+    LoadMode mode;
+    Scenario scenario;
+};
+
+LoadConfig config;
+struct sockaddr_in server_addr;
+std::string payload;
+std::vector<std::string> away_msgs;     // Store and replay: a message_size /msg to each away user
+std::vector<std::string> away_history;  // Replay: each connection's /history of its away user
+std::atomic<bool> history_missing(false);  // The server has no history store
+std::atomic<bool> codec_refused(false);    // The server has no such codec
+uint64_t test_start_ns;
+#ifdef HAVE_OPENSSL
+SSL_CTX* tls_ctx = NULL;
+#endif
+std::atomic<int> conns_running(0);   // Connections that have finished their setup
+std::atomic<int> conns_failed(0);    // ...and those that never will
+std::atomic<bool> sending_open(true);  // Cleared until the server's counters have been sampled
+std::atomic<int> workers_exited(0);
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Log-linear latency histogram in nanoseconds, in the style of HdrHistogram:
+// each power of two is split into 2^HIST_SUB_BITS equal buckets, so recording
+// is a couple of shifts and per-thread histograms merge by adding counts.
+struct Histogram {
+    std::vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t min_value;
+    uint64_t max_value;
+    double sum;
+
+    Histogram() : counts((size_t)(HIST_GROUPS + 1) << HIST_SUB_BITS, 0), total(0), min_value(UINT64_MAX), max_value(0), sum(0) {}
+
+    static size_t index_of(uint64_t value) {
+        if (value < (1ULL << HIST_SUB_BITS)) return (size_t)value;
+        int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+        return ((size_t)(shift + 1) << HIST_SUB_BITS) + (size_t)((value >> shift) - (1ULL << HIST_SUB_BITS));
+    }
+
+    // Largest value that lands in the same bucket
+    static uint64_t value_at(size_t index) {
+        if (index < (1ULL << HIST_SUB_BITS)) return index;
+        int shift = (int)(index >> HIST_SUB_BITS) - 1;
+        uint64_t sub = (index & ((1ULL << HIST_SUB_BITS) - 1)) + (1ULL << HIST_SUB_BITS);
+        return (sub << shift) + ((1ULL << shift) - 1);
+    }
+
+    void record(uint64_t value) {
+        counts[index_of(value)]++;
+        total++;
+        sum += value;
+        if (value < min_value) min_value = value;
+        if (value > max_value) max_value = value;
+    }
+
+    void merge(const Histogram& other) {
+        for (size_t i = 0; i < counts.size(); i++) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        sum += other.sum;
+        if (other.min_value < min_value) min_value = other.min_value;
+        if (other.max_value > max_value) max_value = other.max_value;
+    }
+
+    uint64_t percentile(double p) const {
+        if (total == 0) return 0;
+        uint64_t target = (uint64_t)std::ceil(p / 100.0 * total);
+        if (target == 0) target = 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if (seen >= target) return std::min(value_at(i), max_value);
+        }
+        return max_value;
+    }
+
+    double mean() const { return total ? sum / total : 0; }
+};
+
+enum ConnPhase { PHASE_CONNECTING, PHASE_TLS, PHASE_NAMING, PHASE_SETUP, PHASE_RUNNING, PHASE_RECYCLE, PHASE_DONE };
+
+struct LoadConn;
+
+// Room scenario: the members of one room, all driven by the same worker
+struct LoadRoom {
+    std::string name;
+    std::vector<LoadConn*> members;   // members[0] is the speaker
+    int joined;                       // Members the server has confirmed
+    std::deque<int> remaining;        // Per broadcast in flight: deliveries still expected
+    int completed;                    // Broadcasts delivered to every listener
+};
+
+struct LoadConn {
+    int fd;
+    int id;
+    int slot;                     // Index in the worker's conns
+    ConnPhase phase;
+    int welcome_left;             // Server lines still expected after the name
+    int sent;
+    int received;
+    int cycle;                    // Churn: sessions opened so far
+    uint64_t connect_start;
+    uint64_t tls_start;           // When the TCP connect completed and the TLS handshake began
+    uint64_t pair_start;          // Chat: when /chat was sent
+    uint64_t interval_ns;         // Open loop: time between requests on this connection
+    uint64_t next_send;           // Open loop: when the next request is due
+    std::deque<uint64_t> inflight;  // Start time of each request awaiting its reply
+    std::string out;              // Bytes not yet accepted by the socket
+    size_t out_offset;
+    std::string partial;          // Unterminated line (or binary frame) left over from the last read
+    LoadConn* peer;               // Chat: the partner; relayed lines start with relay_prefix (its id in binary)
+    std::string relay_prefix;
+    bool chat_ready;              // Chat: the server acknowledged /startchat
+    LoadRoom* room;               // Room: the room this connection joins
+    int seeds_left;               // Replay: /msg seeds not yet acknowledged
+    struct ssl_st* tls;           // --tls: the session on fd
+    struct ssl_session_st* tls_session;  // --tls resume: the newest ticket the server gave us
+};
+
+struct Worker {
+    int index;
+    int epoll_fd;
+    std::vector<LoadConn*> conns;
+    int open_conns;
+    Histogram latency;
+    Histogram connect_time;
+    Histogram handshake;          // Connect to the end of the welcome, per session
+    Histogram pairing;            // Chat: /chat to "Chat started"
+    Histogram tls_handshake;      // --tls: TCP connected to TLS handshake done
+    uint64_t tls_resumed;         // Handshakes the server accepted a ticket for
+    uint64_t messages_sent;
+    uint64_t messages_received;
+    uint64_t dropped;             // Chat: relays the server refused; store: messages it would not hold
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
     int successful_conns;
     int failed_conns;
-    int messages_sent;
-    int messages_received;
+    uint64_t replies;             // Every line received, handshakes included
+    uint64_t first_send_ns;
+    uint64_t last_recv_ns;
+    uint64_t last_handshake_ns;
+    uint64_t last_pairing_ns;
+    std::vector<LoadConn*> held;  // Set up before sending_open; they start sending once it is
+    std::string inflated;         // Payload of the compressed frame being handled
+#ifdef HAVE_ZSTD
+    ZSTD_DCtx* zstd_dctx;
+#endif
+    std::thread thread;
 };
 
-void simulate_client(const std::string& server_ip, int port, int client_id, int num_messages, TestResults& results) {
-    std::cout << "Client " << client_id << " starting connection..." << std::endl;
-    
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        std::cout << "Client " << client_id << " failed to create socket" << std::endl;
-        failed_connections++;
+typedef std::pair<uint64_t, LoadConn*> Due;
+typedef std::priority_queue<Due, std::vector<Due>, std::greater<Due> > DueQueue;
+
+int raise_fd_limit(int wanted) {
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) < 0) return wanted;
+    if (lim.rlim_cur < (rlim_t)wanted) {
+        lim.rlim_cur = (lim.rlim_max == RLIM_INFINITY || lim.rlim_max >= (rlim_t)wanted) ? wanted : lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+        getrlimit(RLIMIT_NOFILE, &lim);
+    }
+    return lim.rlim_cur < (rlim_t)wanted ? (int)lim.rlim_cur : wanted;
+}
+
+bool starts_with(const char* line, size_t len, const char* prefix, size_t prefix_len) {
+    return len >= prefix_len && memcmp(line, prefix, prefix_len) == 0;
+}
+
+#define STARTS_WITH(line, len, literal) starts_with(line, len, literal, sizeof(literal) - 1)
+
+// An untagged binary protocol frame
+std::string binary_frame(int op, const std::string& body, int flags = 0) {
+    char header[BINARY_HEADER] = { (char)op, (char)flags, 0, 0, (char)(body.size() >> 24), (char)(body.size() >> 16),
+                                   (char)(body.size() >> 8), (char)body.size() };
+    return std::string(header, sizeof(header)) + body;
+}
+
+bool codec_built(Codec codec) {
+#ifdef HAVE_LZ4
+    if (codec == CODEC_LZ4) return true;
+#endif
+#ifdef HAVE_ZSTD
+    if (codec == CODEC_ZSTD) return true;
+#endif
+    return codec == CODEC_NONE;
+}
+
+// text compressed with the --compress codec; empty if that would not shrink it
+std::string compress_text(const std::string& text) {
+    std::string out;
+#ifdef HAVE_LZ4
+    if (config.codec == CODEC_LZ4) {
+        out.resize(LZ4_compressBound((int)text.size()));
+        int n = LZ4_compress_default(text.data(), &out[0], (int)text.size(), (int)out.size());
+        out.resize(n > 0 ? n : 0);
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (config.codec == CODEC_ZSTD) {
+        out.resize(ZSTD_compressBound(text.size()));
+        size_t n = ZSTD_compress(&out[0], out.size(), text.data(), text.size(), ZSTD_LEVEL);
+        out.resize(ZSTD_isError(n) ? 0 : n);
+    }
+#endif
+    if (out.empty() || out.size() + 4 >= text.size()) return "";
+    return out;
+}
+
+// Decompress a compressed frame's payload into the worker's buffer; false if it is corrupt
+bool inflate_payload(Worker* w, const char* data, size_t len) {
+    if (len < 4) return false;
+    const unsigned char* h = (const unsigned char*)data;
+    size_t raw_len = ((size_t)h[0] << 24) | ((size_t)h[1] << 16) | ((size_t)h[2] << 8) | h[3];
+    w->inflated.resize(raw_len);
+#ifdef HAVE_LZ4
+    if (config.codec == CODEC_LZ4) {
+        return LZ4_decompress_safe(data + 4, &w->inflated[0], (int)(len - 4), (int)raw_len) == (int)raw_len;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (config.codec == CODEC_ZSTD) {
+        if (!w->zstd_dctx) w->zstd_dctx = ZSTD_createDCtx();
+        return ZSTD_decompressDCtx(w->zstd_dctx, &w->inflated[0], raw_len, data + 4, len - 4) == raw_len;
+    }
+#endif
+    return false;
+}
+
+// One line of the text protocol as the server expects it from us. Requests
+// are encoded once up front, so compressing them costs nothing per message.
+std::string encode_line(const std::string& line) {
+    if (!config.binary) return line + "\n";
+    if (config.codec != CODEC_NONE && line.size() >= COMPRESS_MIN) {
+        std::string packed = compress_text(line);
+        if (!packed.empty()) {
+            char raw_len[4] = { (char)(line.size() >> 24), (char)(line.size() >> 16), (char)(line.size() >> 8), (char)line.size() };
+            return binary_frame(OP_MESSAGE, std::string(raw_len, sizeof(raw_len)) + packed, BINARY_COMPRESSED);
+        }
+    }
+    return binary_frame(OP_MESSAGE, line);
+}
+
+// size bytes of the --payload kind; the same every run
+std::string make_payload(size_t size) {
+    static const char* words[] = { "the", "server", "echoes", "every", "message", "back", "to", "its", "sender",
+                                   "and", "relays", "chat", "between", "users", "in", "rooms", "while", "we",
+                                   "measure", "how", "long", "it", "takes", "under", "load" };
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    if (config.payload_kind == PAYLOAD_FILL) return std::string(size, 'x');
+    std::string out;
+    uint32_t seed = 1;
+    while (out.size() < size) {
+        seed = seed * 1103515245 + 12345;
+        if (config.payload_kind == PAYLOAD_RANDOM) {
+            out += alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
+        } else {
+            out += words[(seed >> 16) % (sizeof(words) / sizeof(words[0]))];
+            out += ' ';
+        }
+    }
+    out.resize(size);
+    return out;
+}
+
+// Churn sessions get fresh names so the server never sees a name still being released
+std::string conn_name(const LoadConn* conn) {
+    if (config.scenario == SCENARIO_CHURN) return "loadgen_" + std::to_string(conn->id) + "_" + std::to_string(conn->cycle);
+    return "loadgen_" + std::to_string(conn->id);
+}
+
+// No more requests are sent past the deadline
+bool sending_allowed(const LoadConn* conn, uint64_t now) {
+    if (config.duration > 0) return now < test_start_ns + (uint64_t)(config.duration * 1e9);
+    return conn->sent < config.messages_per_client;
+}
+
+void mark_done(Worker* w, LoadConn* conn, bool success) {
+    conn->phase = PHASE_DONE;
+    if (success) {
+        w->successful_conns++;
+    } else {
+        w->failed_conns++;
+        conns_failed.fetch_add(1, std::memory_order_relaxed);
+    }
+    w->open_conns--;
+}
+
+// The connection is up: log in with this session's name
+void send_name(LoadConn* conn) {
+    conn->phase = PHASE_NAMING;
+    if (config.binary) {
+        conn->welcome_left = 1;
+        conn->out = BINARY_MAGIC;
+        if (config.codec != CODEC_NONE) conn->out += binary_frame(OP_COMPRESS, std::string(1, (char)config.codec));
+        conn->out += binary_frame(OP_HELLO, conn_name(conn));
+    } else {
+        conn->welcome_left = WELCOME_LINES;
+        conn->out = conn_name(conn) + "\n";
+    }
+}
+
+#ifdef HAVE_OPENSSL
+// --tls resume: keep the newest ticket; the next session on this connection offers it
+int tls_new_session(SSL* ssl, SSL_SESSION* session) {
+    LoadConn* conn = (LoadConn*)SSL_get_app_data(ssl);
+    if (conn->tls_session) SSL_SESSION_free(conn->tls_session);
+    conn->tls_session = session;
+    return 1;  // We hold the reference now
+}
+#endif
+
+// The client context every --tls session is made from; false if OpenSSL refuses
+bool tls_setup() {
+#ifdef HAVE_OPENSSL
+    tls_ctx = SSL_CTX_new(TLS_client_method());
+    if (!tls_ctx) return false;
+    // The server under test usually has a self-signed certificate; it is the handshake cost we are after
+    SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_NONE, NULL);
+    SSL_CTX_set_options(tls_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if (config.tls == TLS_RESUME) {
+        SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(tls_ctx, tls_new_session);
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+// The TCP connect completed: start the TLS handshake on it; false if no session could be made
+bool tls_start(LoadConn* conn, uint64_t now) {
+#ifdef HAVE_OPENSSL
+    SSL* ssl = SSL_new(tls_ctx);
+    if (!ssl || !SSL_set_fd(ssl, conn->fd)) {
+        SSL_free(ssl);
+        return false;
+    }
+    SSL_set_connect_state(ssl);
+    SSL_set_app_data(ssl, conn);
+    if (conn->tls_session) SSL_set_session(ssl, conn->tls_session);
+    conn->tls = ssl;
+    conn->tls_start = now;
+    conn->phase = PHASE_TLS;
+    return true;
+#else
+    (void)conn;
+    (void)now;
+    return false;
+#endif
+}
+
+// Drive the handshake as far as the socket allows; false if it failed
+bool tls_step(Worker* w, LoadConn* conn, uint64_t now) {
+#ifdef HAVE_OPENSSL
+    int rc = SSL_do_handshake(conn->tls);
+    if (rc <= 0) {
+        int err = SSL_get_error(conn->tls, rc);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) return true;
+        ERR_clear_error();
+        return false;
+    }
+    w->tls_handshake.record(now - conn->tls_start);
+    if (SSL_session_reused(conn->tls)) w->tls_resumed++;
+    send_name(conn);
+    return true;
+#else
+    (void)w;
+    (void)conn;
+    (void)now;
+    return false;
+#endif
+}
+
+// SSL_read / SSL_write with the return conventions of recv / send
+ssize_t tls_io(LoadConn* conn, void* buf, size_t len, bool write) {
+#ifdef HAVE_OPENSSL
+    int rc = write ? SSL_write(conn->tls, buf, (int)len) : SSL_read(conn->tls, buf, (int)len);
+    if (rc > 0) return rc;
+    int err = SSL_get_error(conn->tls, rc);
+    ERR_clear_error();
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (err == SSL_ERROR_ZERO_RETURN) return 0;
+    errno = ECONNRESET;
+    return -1;
+#else
+    (void)conn;
+    (void)buf;
+    (void)len;
+    (void)write;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+// Before the socket closes: say goodbye and count what the session put on the
+// wire, records and handshakes included, instead of the plaintext
+void tls_close(Worker* w, LoadConn* conn) {
+#ifdef HAVE_OPENSSL
+    if (!conn->tls) return;
+    if (SSL_is_init_finished(conn->tls)) SSL_shutdown(conn->tls);
+    w->bytes_sent += BIO_number_written(SSL_get_wbio(conn->tls));
+    w->bytes_received += BIO_number_read(SSL_get_rbio(conn->tls));
+    SSL_free(conn->tls);
+    ERR_clear_error();
+    conn->tls = NULL;
+#else
+    (void)w;
+    (void)conn;
+#endif
+}
+
+void close_conn(Worker* w, LoadConn* conn) {
+    if (conn->phase == PHASE_DONE) return;
+    tls_close(w, conn);
+    close(conn->fd);
+    mark_done(w, conn, conn->phase == PHASE_RUNNING || conn->phase == PHASE_RECYCLE);
+    // A chat partner that never got its pair has nothing left to do
+    if (conn->peer && conn->peer->phase != PHASE_RUNNING) close_conn(w, conn->peer);
+}
+
+// Open a non-blocking connection; the name is sent once it completes
+void start_connect(Worker* w, LoadConn* conn, uint64_t now) {
+    conn->connect_start = now;
+    conn->phase = PHASE_CONNECTING;
+    conn->partial.clear();
+    conn->out.clear();
+    conn->out_offset = 0;
+    if (config.scenario == SCENARIO_CHURN) {
+        conn->sent++;
+        w->messages_sent++;
+        if (w->first_send_ns == 0) w->first_send_ns = now;
+    }
+    conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (conn->fd < 0) {
+        mark_done(w, conn, false);
+        return;
+    }
+    int one = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(conn->fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS) {
+        close(conn->fd);
+        mark_done(w, conn, false);
         return;
     }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    // Tagged with the session so events left over from a recycled socket are ignored
+    ev.data.u64 = ((uint64_t)conn->cycle << 32) | (uint32_t)conn->slot;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev);
+}
+
+// Churn: a session completed its name registration; close it and start the next one
+void recycle_conn(Worker* w, LoadConn* conn, uint64_t now) {
+    tls_close(w, conn);
+    close(conn->fd);
+    conn->cycle++;
+    if (sending_allowed(conn, now)) {
+        start_connect(w, conn, now);
+    } else {
+        mark_done(w, conn, true);
+    }
+}
 
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    inet_pton(AF_INET, server_ip.c_str(), &server_addr.sin_addr);
-
-    auto start_time = std::chrono::high_resolution_clock::now();
-    
-    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        std::cout << "Client " << client_id << " failed to connect" << std::endl;
-        failed_connections++;
-        close(sock);
+// Write as much pending output as the socket takes; false on a socket error
+bool flush_conn(Worker* w, LoadConn* conn) {
+    while (conn->out_offset < conn->out.size()) {
+        ssize_t n;
+        if (conn->tls) {
+            n = tls_io(conn, &conn->out[conn->out_offset], conn->out.size() - conn->out_offset, true);
+        } else {
+            n = send(conn->fd, conn->out.data() + conn->out_offset, conn->out.size() - conn->out_offset, MSG_NOSIGNAL);
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        conn->out_offset += n;
+        if (!conn->tls) w->bytes_sent += n;
+    }
+    conn->out.clear();
+    conn->out_offset = 0;
+    return true;
+}
+
+// Store requests take turns among the connection's away users (id, id +
+// num_clients, ...) so none of them fills up; replay asks for its own one
+const std::string& request_for(const LoadConn* conn) {
+    if (config.scenario == SCENARIO_STORE) {
+        return away_msgs[(conn->id + (size_t)conn->sent * config.num_clients) % away_msgs.size()];
+    }
+    if (config.scenario == SCENARIO_REPLAY) return away_history[conn->id];
+    return payload;
+}
+
+// Queue one request; start is the time its latency is measured from
+void queue_request(Worker* w, LoadConn* conn, uint64_t start) {
+    conn->out += request_for(conn);
+    if (conn->room) conn->room->remaining.push_back((int)conn->room->members.size() - 1);
+    conn->inflight.push_back(start);
+    conn->sent++;
+    w->messages_sent++;
+    if (w->first_send_ns == 0) w->first_send_ns = start;
+}
+
+// The oldest request from sender got its reply (or, for a refused relay, its refusal)
+void complete_request(Worker* w, LoadConn* sender, uint64_t now, bool delivered) {
+    if (sender->inflight.empty()) return;
+    if (delivered) {
+        w->latency.record(now - sender->inflight.front());
+        sender->received++;
+        w->messages_received++;
+        w->last_recv_ns = now;
+    } else {
+        w->dropped++;
+    }
+    sender->inflight.pop_front();
+    if (config.mode == MODE_CLOSED && sending_allowed(sender, now)) {
+        queue_request(w, sender, now);
+    }
+}
+
+// Start the request stream
+void start_sending(Worker* w, LoadConn* conn, DueQueue& due, uint64_t now) {
+    if (config.mode == MODE_CLOSED) {
+        for (int i = 0; i < config.depth && sending_allowed(conn, now); i++) {
+            queue_request(w, conn, now);
+        }
+    } else {
+        // Spread the connections evenly over one interval
+        conn->next_send = now + conn->interval_ns * conn->id / config.num_clients;
+        due.push(Due(conn->next_send, conn));
+    }
+}
+
+// The session is set up: start sending, or wait for the server baseline
+void start_running(Worker* w, LoadConn* conn, DueQueue& due, uint64_t now) {
+    conn->phase = PHASE_RUNNING;
+    conns_running.fetch_add(1, std::memory_order_relaxed);
+    if (conn->room && conn != conn->room->members[0]) return;  // Listeners only receive
+    if (!sending_open.load(std::memory_order_acquire)) {
+        w->held.push_back(conn);
         return;
     }
+    start_sending(w, conn, due, now);
+}
+
+// Nothing more will be sent on this connection or arrive for it
+bool conn_idle(const LoadConn* conn, uint64_t now) {
+    return conn->phase == PHASE_RUNNING && conn->inflight.empty() && !sending_allowed(conn, now);
+}
+
+// A chat partner keeps reading until the other side's relays have all arrived;
+// a room listener until its speaker has nothing left in flight
+bool conn_finished(const LoadConn* conn, uint64_t now) {
+    if (conn->room && conn != conn->room->members[0]) {
+        const LoadConn* speaker = conn->room->members[0];
+        return conn->phase == PHASE_RUNNING && (speaker->phase == PHASE_DONE || conn_idle(speaker, now));
+    }
+    if (!conn_idle(conn, now)) return false;
+    return !conn->peer || conn->peer->phase == PHASE_DONE || conn_idle(conn->peer, now);
+}
+
+void finish_conn(Worker* w, LoadConn* conn) {
+    LoadConn* peer = conn->peer;
+    close_conn(w, conn);
+    if (peer) close_conn(w, peer);
+    // Once the speaker is done, so is everyone listening to it
+    if (conn->room && conn == conn->room->members[0]) {
+        for (size_t i = 1; i < conn->room->members.size(); i++) {
+            close_conn(w, conn->room->members[i]);
+        }
+    }
+}
 
-    auto connect_time = std::chrono::high_resolution_clock::now();
-    auto connection_duration = std::chrono::duration_cast<std::chrono::microseconds>(connect_time - start_time);
-    std::cout << "Client " << client_id << " connected in " << connection_duration.count() << " microseconds" << std::endl;
-    results.connection_time += connection_duration.count();
-    
-    successful_connections++;
+// Room: a listener got the broadcast it was waiting for. Broadcasts arrive in
+// order, so the listener's count says which one; the speaker's request
+// completes once every listener has it.
+void room_delivery(Worker* w, LoadConn* listener, uint64_t now) {
+    LoadRoom* room = listener->room;
+    LoadConn* speaker = room->members[0];
+    size_t offset = (size_t)(listener->received - room->completed);
+    if (offset >= speaker->inflight.size()) return;
+    w->latency.record(now - speaker->inflight[offset]);
+    listener->received++;
+    w->messages_received++;
+    w->last_recv_ns = now;
+    room->remaining[offset]--;
+    while (!room->remaining.empty() && room->remaining.front() == 0) {
+        room->remaining.pop_front();
+        room->completed++;
+        speaker->inflight.pop_front();
+        speaker->received++;
+        if (config.mode == MODE_CLOSED && sending_allowed(speaker, now)) {
+            queue_request(w, speaker, now);
+        }
+    }
+    if (speaker->phase == PHASE_RUNNING && !flush_conn(w, speaker)) close_conn(w, speaker);
+}
 
-    // Send client name
-    std::string client_name = "test_client_" + std::to_string(client_id);
-    std::cout << "Client " << client_id << " sending name: " << client_name << std::endl;
-    send(sock, client_name.c_str(), client_name.length(), 0);
+// Chat: both partners are in chat mode, so the even one of the pair asks for the chat
+void request_pairing(Worker* w, LoadConn* initiator, uint64_t now) {
+    initiator->out += encode_line("/chat " + conn_name(initiator->peer));
+    initiator->pair_start = now;
+    if (!flush_conn(w, initiator)) close_conn(w, initiator);
+}
 
-    // Wait for server response
+// The server's answer to a /msg to an away user: held, refused because too
+// much is held, or (if its login has not quite ended yet) delivered
+bool away_reply(const char* line, size_t len) {
+    return STARTS_WITH(line, len, AWAY_PREFIX) || STARTS_WITH(line, len, "Sent to " AWAY_PREFIX);
+}
+
+// Handle one line from the server
+void handle_line(Worker* w, LoadConn* conn, const char* line, size_t len, uint64_t now, DueQueue& due) {
+    w->replies++;
+    // Without --history-dir the server answers /msg and /history with an error
+    if ((config.scenario == SCENARIO_STORE || config.scenario == SCENARIO_REPLAY) && conn->phase != PHASE_NAMING &&
+        (STARTS_WITH(line, len, "History is not enabled") || STARTS_WITH(line, len, "Client not found"))) {
+        history_missing.store(true, std::memory_order_relaxed);
+        close_conn(w, conn);
+        return;
+    }
+    switch (conn->phase) {
+    case PHASE_NAMING:
+        // In binary the welcome is our id, and the partner's relays from us will start with it
+        if (config.binary && conn->peer) conn->peer->relay_prefix.assign(line, len);
+        if (--conn->welcome_left > 0) return;
+        w->handshake.record(now - conn->connect_start);
+        w->last_handshake_ns = now;
+        if (config.scenario == SCENARIO_CHURN) {
+            w->latency.record(now - conn->connect_start);
+            conn->received++;
+            w->messages_received++;
+            w->last_recv_ns = now;
+            conn->phase = PHASE_RECYCLE;
+        } else if (config.scenario == SCENARIO_CHAT) {
+            conn->phase = PHASE_SETUP;
+            conn->out += encode_line("/startchat");
+        } else if (config.scenario == SCENARIO_ROOM) {
+            conn->phase = PHASE_SETUP;
+            conn->out += encode_line("/join " + conn->room->name);
+        } else if (config.scenario == SCENARIO_REPLAY) {
+            // Give the conversation enough messages for every /history to return them all
+            conn->phase = PHASE_SETUP;
+            conn->seeds_left = config.replay;
+            for (int i = 0; i < config.replay; i++) {
+                conn->out += away_msgs[conn->id];
+            }
+        } else {
+            start_running(w, conn, due, now);
+        }
+        return;
+    case PHASE_SETUP:
+        if (config.scenario == SCENARIO_REPLAY) {
+            if (away_reply(line, len) && --conn->seeds_left == 0) start_running(w, conn, due, now);
+        } else if (config.scenario == SCENARIO_ROOM) {
+            if (!STARTS_WITH(line, len, "Joined room")) return;
+            // The speaker starts once the whole room is there to hear it
+            LoadRoom* room = conn->room;
+            if (conn != room->members[0]) start_running(w, conn, due, now);
+            if (++room->joined == (int)room->members.size()) {
+                w->pairing.record(now - room->members[0]->connect_start);
+                w->last_pairing_ns = now;
+                start_running(w, room->members[0], due, now);
+                if (!flush_conn(w, room->members[0])) close_conn(w, room->members[0]);
+            }
+        } else if (STARTS_WITH(line, len, "Switched to chat mode")) {
+            conn->chat_ready = true;
+            if (conn->peer->chat_ready) request_pairing(w, conn->id % 2 == 0 ? conn : conn->peer, now);
+        } else if (STARTS_WITH(line, len, "Chat started with")) {
+            if (conn->id % 2 == 0) {
+                w->pairing.record(now - conn->pair_start);
+                w->last_pairing_ns = now;
+            }
+            start_running(w, conn, due, now);
+        }
+        return;
+    case PHASE_RUNNING:
+        break;
+    default:
+        return;
+    }
+
+    switch (config.scenario) {
+    case SCENARIO_ECHO:
+        complete_request(w, conn, now, true);
+        break;
+    case SCENARIO_LIST:
+        // Latency is taken at the header line; the user lines follow in the same write
+        if (STARTS_WITH(line, len, "Connected users:")) complete_request(w, conn, now, true);
+        break;
+    case SCENARIO_CHAT:
+        if (starts_with(line, len, conn->relay_prefix.data(), conn->relay_prefix.size())) {
+            LoadConn* sender = conn->peer;
+            complete_request(w, sender, now, true);
+            if (sender->phase == PHASE_RUNNING && !flush_conn(w, sender)) close_conn(w, sender);
+        } else if (STARTS_WITH(line, len, "Message not delivered")) {
+            complete_request(w, conn, now, false);
+        }
+        break;
+    case SCENARIO_ROOM:
+        if (starts_with(line, len, conn->relay_prefix.data(), conn->relay_prefix.size())) room_delivery(w, conn, now);
+        break;
+    case SCENARIO_STORE:
+        if (away_reply(line, len)) complete_request(w, conn, now, memmem(line, len, " is away;", 9) || STARTS_WITH(line, len, "Sent to"));
+        break;
+    case SCENARIO_REPLAY:
+        // Timed to the header; the messages follow in the same write
+        if (STARTS_WITH(line, len, "History with")) complete_request(w, conn, now, true);
+        break;
+    default:
+        break;
+    }
+}
+
+// Hand the payload of each complete binary frame in [start, end) to
+// handle_line, decompressed if need be; returns where the incomplete
+// remainder begins
+const char* handle_frames(Worker* w, LoadConn* conn, const char* start, const char* end, uint64_t now, DueQueue& due) {
+    while (end - start >= BINARY_HEADER) {
+        const unsigned char* h = (const unsigned char*)start;
+        size_t len = ((size_t)h[4] << 24) | ((size_t)h[5] << 16) | ((size_t)h[6] << 8) | h[7];
+        if ((size_t)(end - start) < BINARY_HEADER + len) break;
+        const char* body = start + BINARY_HEADER;
+        start += BINARY_HEADER + len;
+        if (h[0] == OP_COMPRESS) {
+            // The answer to our offer, before the welcome: the codec, or nothing
+            if (len != 1 || (unsigned char)body[0] != config.codec) {
+                codec_refused.store(true, std::memory_order_relaxed);
+                close_conn(w, conn);
+                break;
+            }
+        } else if (h[1] & BINARY_COMPRESSED) {
+            if (!inflate_payload(w, body, len)) {
+                close_conn(w, conn);
+                break;
+            }
+            handle_line(w, conn, w->inflated.data(), w->inflated.size(), now, due);
+        } else {
+            handle_line(w, conn, body, len, now, due);
+        }
+    }
+    return start;
+}
+
+// Read everything available and hand each complete line (or frame) to
+// handle_line; false when the connection is gone
+bool read_conn(Worker* w, LoadConn* conn, DueQueue& due) {
     char buffer[BUFFER_SIZE];
-    int bytes = recv(sock, buffer, BUFFER_SIZE - 1, 0);
-    if (bytes > 0) {
-        buffer[bytes] = '\0';
-        std::cout << "Client " << client_id << " received response: " << buffer << std::endl;
+    while (conn->phase != PHASE_RECYCLE && conn->phase != PHASE_DONE) {
+        ssize_t n = conn->tls ? tls_io(conn, buffer, sizeof(buffer), false) : recv(conn->fd, buffer, sizeof(buffer), 0);
+        if (n == 0) return false;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        if (!conn->tls) w->bytes_received += n;
+        uint64_t now = now_ns();
+        const char* start = buffer;
+        const char* end = buffer + n;
+        if (config.binary) {
+            if (conn->partial.empty()) {
+                start = handle_frames(w, conn, start, end, now, due);
+                conn->partial.append(start, end - start);
+            } else {
+                conn->partial.append(start, end - start);
+                const char* data = conn->partial.data();
+                start = handle_frames(w, conn, data, data + conn->partial.size(), now, due);
+                conn->partial.erase(0, start - data);
+            }
+            continue;
+        }
+        const char* newline;
+        while ((newline = (const char*)memchr(start, '\n', end - start)) != NULL) {
+            if (conn->partial.empty()) {
+                handle_line(w, conn, start, newline - start, now, due);
+            } else {
+                conn->partial.append(start, newline - start);
+                handle_line(w, conn, conn->partial.data(), conn->partial.size(), now, due);
+                conn->partial.clear();
+            }
+            start = newline + 1;
+        }
+        conn->partial.append(start, end - start);
     }
+    return true;
+}
+
+// One event loop drives every connection assigned to this worker
+void run_worker(Worker* w) {
+    w->epoll_fd = epoll_create1(0);
+    w->open_conns = (int)w->conns.size();
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < w->conns.size(); i++) {
+        w->conns[i]->slot = (int)i;
+        start_connect(w, w->conns[i], start);
+    }
+
+    DueQueue due;
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t last_progress = now_ns();
+    uint64_t last_replies = 0;
 
-    // Send messages and measure latency
-    for (int i = 0; i < num_messages; i++) {
-        auto msg_start = std::chrono::high_resolution_clock::now();
-        
-        std::string message = "Test message " + std::to_string(i) + " from client " + std::to_string(client_id);
-        send(sock, message.c_str(), message.length(), 0);
-        total_messages_sent++;
+    while (w->open_conns > 0) {
+        uint64_t now = now_ns();
+        int timeout = w->held.empty() ? 100 : 1;
+        if (!due.empty()) {
+            timeout = due.top().first > now ? (int)((due.top().first - now + 999999) / 1000000) : 0;
+            if (timeout > 100) timeout = 100;
+        }
+        int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait failed");
+            break;
+        }
+        now = now_ns();
+
+        for (int i = 0; i < n; i++) {
+            LoadConn* conn = w->conns[(uint32_t)events[i].data.u64];
+            if (conn->phase == PHASE_DONE || conn->cycle != (int)(events[i].data.u64 >> 32)) continue;
+            bool alive = !(events[i].events & EPOLLERR);
+            if (alive && conn->phase == PHASE_CONNECTING && (events[i].events & EPOLLOUT)) {
+                w->connect_time.record(now - conn->connect_start);
+                if (config.tls != TLS_OFF) {
+                    alive = tls_start(conn, now);
+                } else {
+                    send_name(conn);
+                }
+            }
+            if (alive && conn->phase == PHASE_TLS) alive = tls_step(w, conn, now);
+            if (alive && conn->phase != PHASE_TLS && (events[i].events & (EPOLLIN | EPOLLRDHUP))) {
+                alive = read_conn(w, conn, due);
+            }
+            if (conn->phase == PHASE_DONE) continue;
+            if (conn->phase == PHASE_RECYCLE) {
+                recycle_conn(w, conn, now);
+                continue;
+            }
+            if (alive) alive = flush_conn(w, conn);
+            if (!alive) {
+                close_conn(w, conn);
+            } else if (conn_finished(conn, now)) {
+                finish_conn(w, conn);
+            }
+        }
 
-        // Receive echo
-        int bytes = recv(sock, buffer, BUFFER_SIZE - 1, 0);
-        if (bytes > 0) {
-            total_messages_received++;
-            auto msg_end = std::chrono::high_resolution_clock::now();
-            auto msg_duration = std::chrono::duration_cast<std::chrono::microseconds>(msg_end - msg_start);
-            results.message_latency += msg_duration.count();
+        // The server baseline is sampled: start everyone who was held back
+        if (!w->held.empty() && sending_open.load(std::memory_order_acquire)) {
+            for (size_t i = 0; i < w->held.size(); i++) {
+                LoadConn* conn = w->held[i];
+                if (conn->phase != PHASE_RUNNING) continue;
+                start_sending(w, conn, due, now);
+                if (!flush_conn(w, conn)) close_conn(w, conn);
+            }
+            w->held.clear();
         }
 
-        // Small delay between messages
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        // Open loop: send every request whose time has come. Latency is measured
+        // from the scheduled time, so a stalled server cannot hide its backlog
+        // (coordinated omission).
+        while (!due.empty() && due.top().first <= now) {
+            LoadConn* conn = due.top().second;
+            due.pop();
+            if (conn->phase != PHASE_RUNNING) continue;
+            if (sending_allowed(conn, now)) {
+                while (conn->next_send <= now && sending_allowed(conn, now)) {
+                    queue_request(w, conn, conn->next_send);
+                    conn->next_send += conn->interval_ns;
+                }
+                if (!flush_conn(w, conn)) {
+                    close_conn(w, conn);
+                    continue;
+                }
+                due.push(Due(conn->next_send, conn));
+            } else if (conn_finished(conn, now)) {
+                finish_conn(w, conn);
+            }
+        }
+
+        // Connections that stopped sending with nothing in flight never see
+        // another event, and a server that stopped answering must not hang the run
+        if (w->replies != last_replies || !w->held.empty()) {
+            last_replies = w->replies;
+            last_progress = now;
+        }
+        uint64_t deadline = test_start_ns + (uint64_t)(config.duration * 1e9);
+        bool drained = config.duration > 0 && now > deadline + DRAIN_GRACE_NS;
+        if (drained || now - last_progress > STALL_TIMEOUT_NS) {
+            for (size_t i = 0; i < w->conns.size(); i++) {
+                close_conn(w, w->conns[i]);
+            }
+        } else if ((config.mode == MODE_OPEN && due.empty()) || (config.duration > 0 && now >= deadline)) {
+            for (size_t i = 0; i < w->conns.size(); i++) {
+                if (conn_finished(w->conns[i], now)) finish_conn(w, w->conns[i]);
+            }
+        }
     }
+    close(w->epoll_fd);
+#ifdef HAVE_ZSTD
+    if (w->zstd_dctx) ZSTD_freeDCtx(w->zstd_dctx);
+#endif
+#ifdef HAVE_OPENSSL
+    for (size_t i = 0; i < w->conns.size(); i++) {
+        if (w->conns[i]->tls_session) SSL_SESSION_free(w->conns[i]->tls_session);
+    }
+#endif
+    workers_exited.fetch_add(1, std::memory_order_relaxed);
+}
 
-    std::cout << "Client " << client_id << " finished sending messages" << std::endl;
-    close(sock);
+void write_json_histogram(std::ostream& json, const char* name, const Histogram& h, double per_sec_span, bool last) {
+    json << "  \"" << name << "\": {\"count\": " << h.total;
+    if (per_sec_span > 0) json << ", \"per_sec\": " << h.total / per_sec_span;
+    json << ", \"min\": " << (h.total ? h.min_value : 0) / 1e3
+         << ", \"mean\": " << h.mean() / 1e3
+         << ", \"p50\": " << h.percentile(50) / 1e3
+         << ", \"p90\": " << h.percentile(90) / 1e3
+         << ", \"p99\": " << h.percentile(99) / 1e3
+         << ", \"p99_9\": " << h.percentile(99.9) / 1e3
+         << ", \"max\": " << h.max_value / 1e3 << "}" << (last ? "\n" : ",\n");
 }
 
-void run_performance_test(const std::string& server_ip, int port, int num_clients, int messages_per_client) {
-    std::vector<std::thread> client_threads;
-    TestResults results = {0};
-    results.num_clients = num_clients;
-    results.messages_per_client = messages_per_client;
+// Everything the workers measured, merged after they finish
+struct Totals {
+    Histogram latency;
+    Histogram connect_time;
+    Histogram handshake;
+    Histogram tls_handshake;
+    uint64_t tls_resumed;
+    Histogram pairing;
+    uint64_t sent;
+    uint64_t received;
+    uint64_t dropped;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    int successful;
+    int failed;
+    double elapsed;               // Seconds from the first request to the last reply
+    double total;                 // Seconds for the whole run, connects included
+    double handshake_span;        // Seconds from the start until the last registration
+    double pairing_span;          // Seconds from the start until the last chat pairing
+    long long server_allocs;      // Server heap allocations while requests flowed; -1 if not measured
+    double client_cpu;            // CPU seconds this load generator spent, user and system
+    double server_cpu;            // Server CPU seconds while requests flowed; -1 if not measured
+    double server_raw;            // Bytes the server compressed and what they came to; -1 if not measured
+    double server_wire;
+    double server_compress_s;     // Server seconds spent compressing and decompressing
+    double server_decompress_s;
 
-    auto test_start = std::chrono::high_resolution_clock::now();
+    Totals() : tls_resumed(0), sent(0), received(0), dropped(0), bytes_sent(0), bytes_received(0), successful(0), failed(0),
+               elapsed(0), total(0), handshake_span(0), pairing_span(0), server_allocs(-1), client_cpu(0),
+               server_cpu(-1), server_raw(-1), server_wire(0), server_compress_s(0), server_decompress_s(0) {}
+};
+
+// Server counters read from its metrics endpoint before and after a run;
+// each is -1 if it cannot be had
+struct ServerSample {
+    double allocs;
+    double cpu;
+    double raw;
+    double wire;
+    double compress_s;
+    double decompress_s;
+};
 
-    // Create and start client threads
-    for (int i = 0; i < num_clients; i++) {
-        client_threads.emplace_back(simulate_client, server_ip, port, i, messages_per_client, std::ref(results));
+// One sample from a metrics page; -1 if it is not there
+double metric_value(const std::string& page, const char* name) {
+    std::string key = std::string("\n") + name + " ";
+    size_t at = page.find(key);
+    return at == std::string::npos ? -1 : strtod(page.c_str() + at + key.size(), NULL);
+}
+
+ServerSample sample_server() {
+    std::string body;
+    struct sockaddr_in addr = server_addr;
+    addr.sin_port = htons(config.metrics_port);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+        if (send(fd, request, sizeof(request) - 1, MSG_NOSIGNAL) == (ssize_t)sizeof(request) - 1) {
+            char buf[4096];
+            ssize_t n;
+            while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+                body.append(buf, n);
+            }
+        }
     }
+    if (fd >= 0) close(fd);
+    ServerSample sample;
+    sample.allocs = metric_value(body, "echo_heap_allocations_total");
+    sample.cpu = metric_value(body, "process_cpu_seconds_total");
+    sample.raw = metric_value(body, "echo_compression_bytes_total{stage=\"raw\"}");
+    sample.wire = metric_value(body, "echo_compression_bytes_total{stage=\"wire\"}");
+    sample.compress_s = metric_value(body, "echo_compression_seconds_total{op=\"compress\"}");
+    sample.decompress_s = metric_value(body, "echo_compression_seconds_total{op=\"decompress\"}");
+    return sample;
+}
 
-    // Wait for all clients to finish
-    for (auto& thread : client_threads) {
-        thread.join();
+// User and system CPU seconds this process has used so far
+double process_cpu_seconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+void write_json(const char* path, const Totals& t) {
+    std::ofstream json(path);
+    json << std::fixed << std::setprecision(3);
+    json << "{\n";
+    json << "  \"config\": {\"server\": \"" << config.server_ip << "\", \"port\": " << config.port
+         << ", \"scenario\": \"" << scenario_names[config.scenario] << "\""
+         << ", \"clients\": " << config.num_clients << ", \"threads\": " << config.threads
+         << ", \"mode\": \"" << (config.mode == MODE_OPEN ? "open" : "closed") << "\""
+         << ", \"depth\": " << config.depth << ", \"rate\": " << config.rate
+         << ", \"duration_s\": " << config.duration << ", \"messages_per_client\": " << config.messages_per_client
+         << ", \"message_size\": " << config.message_size << ", \"room_size\": " << config.room_size
+         << ", \"replay\": " << config.replay << ", \"protocol\": \"" << (config.binary ? "binary" : "text") << "\""
+         << ", \"compression\": \"" << codec_names[config.codec] << "\", \"payload\": \"" << payload_names[config.payload_kind] << "\""
+         << ", \"tls\": \"" << tls_names[config.tls] << "\"},\n";
+    json << "  \"connections\": {\"successful\": " << t.successful << ", \"failed\": " << t.failed
+         << ", \"connect_p50_us\": " << t.connect_time.percentile(50) / 1e3
+         << ", \"connect_p99_us\": " << t.connect_time.percentile(99) / 1e3
+         << ", \"connect_max_us\": " << t.connect_time.max_value / 1e3 << "},\n";
+    json << "  \"elapsed_s\": " << t.elapsed << ",\n";
+    json << "  \"total_s\": " << t.total << ",\n";
+    json << "  \"messages_sent\": " << t.sent << ",\n";
+    json << "  \"messages_received\": " << t.received << ",\n";
+    json << "  \"messages_dropped\": " << t.dropped << ",\n";
+    json << "  \"bytes_sent\": " << t.bytes_sent << ",\n";
+    json << "  \"bytes_received\": " << t.bytes_received << ",\n";
+    json << "  \"msgs_per_sec\": " << (t.elapsed > 0 ? t.received / t.elapsed : 0) << ",\n";
+    json << "  \"bytes_per_sec\": " << (t.elapsed > 0 ? (t.bytes_sent + t.bytes_received) / t.elapsed : 0) << ",\n";
+    if (config.scenario == SCENARIO_REPLAY) {
+        json << "  \"replayed_per_sec\": " << (t.elapsed > 0 ? (double)t.received * config.replay / t.elapsed : 0) << ",\n";
+    }
+    write_json_histogram(json, "handshake_us", t.handshake, t.handshake_span, false);
+    if (config.tls != TLS_OFF) {
+        json << "  \"tls_resumed\": " << t.tls_resumed << ",\n";
+        write_json_histogram(json, "tls_handshake_us", t.tls_handshake, t.handshake_span, false);
+    }
+    if (config.scenario == SCENARIO_CHAT) write_json_histogram(json, "pairing_us", t.pairing, t.pairing_span, false);
+    if (config.scenario == SCENARIO_ROOM) write_json_histogram(json, "room_assembly_us", t.pairing, t.pairing_span, false);
+    if (t.server_allocs >= 0) {
+        json << "  \"server_heap_allocations\": " << t.server_allocs << ",\n";
+        json << "  \"server_allocations_per_request\": " << (t.received ? (double)t.server_allocs / t.received : 0) << ",\n";
     }
+    json << "  \"wire_bytes_sent_per_message\": " << (t.received ? (double)t.bytes_sent / t.received : 0) << ",\n";
+    json << "  \"wire_bytes_received_per_message\": " << (t.received ? (double)t.bytes_received / t.received : 0) << ",\n";
+    json << "  \"client_cpu_s\": " << t.client_cpu << ",\n";
+    if (t.server_cpu >= 0) json << "  \"server_cpu_s\": " << t.server_cpu << ",\n";
+    if (t.server_raw >= 0) {
+        json << "  \"server_compression\": {\"raw_bytes\": " << (uint64_t)t.server_raw << ", \"wire_bytes\": " << (uint64_t)t.server_wire
+             << ", \"compress_s\": " << t.server_compress_s << ", \"decompress_s\": " << t.server_decompress_s << "},\n";
+    }
+    write_json_histogram(json, "latency_us", t.latency, 0, true);
+    json << "}\n";
+}
 
-    auto test_end = std::chrono::high_resolution_clock::now();
-    auto total_duration = std::chrono::duration_cast<std::chrono::microseconds>(test_end - test_start);
+void print_histogram(std::ostream& out, const char* label, const Histogram& h) {
+    out << label << " p50/p99/p99.9/max: " << h.percentile(50) / 1e3 << " / " << h.percentile(99) / 1e3 << " / "
+        << h.percentile(99.9) / 1e3 << " / " << h.max_value / 1e3 << " microseconds\n";
+}
 
-    // Calculate final results
-    results.successful_conns = successful_connections;
-    results.failed_conns = failed_connections;
-    results.messages_sent = total_messages_sent;
-    results.messages_received = total_messages_received;
-    
-    if (results.successful_conns > 0) {
-        results.connection_time /= results.successful_conns;
+void print_results(std::ostream& out, const Totals& t) {
+    const char* unit = scenario_units[config.scenario];
+    out << std::fixed << std::setprecision(2);
+    out << "======================\n";
+    out << "Scenario: " << scenario_names[config.scenario] << "\n";
+    out << "Mode: " << (config.mode == MODE_OPEN ? "open loop" : "closed loop");
+    if (config.mode == MODE_OPEN) {
+        out << " at " << config.rate << " " << unit << "/sec\n";
+    } else {
+        out << ", depth " << config.depth << "\n";
+    }
+    out << "Protocol: " << (config.binary ? "binary" : "text");
+    if (config.codec != CODEC_NONE) out << ", " << codec_names[config.codec] << " compression";
+    if (config.tls != TLS_OFF) out << ", TLS (" << (config.tls == TLS_RESUME ? "resuming sessions" : "full handshakes") << ")";
+    out << "\n";
+    out << "Number of clients: " << config.num_clients << " over " << config.threads << " threads\n";
+    if (config.duration > 0) {
+        out << "Duration: " << config.duration << " seconds\n";
+    } else {
+        out << "Messages per client: " << config.messages_per_client << "\n";
     }
-    if (results.messages_received > 0) {
-        results.message_latency /= results.messages_received;
+    if (config.scenario == SCENARIO_ECHO || config.scenario == SCENARIO_CHAT || config.scenario == SCENARIO_ROOM ||
+        config.scenario == SCENARIO_STORE) {
+        out << "Message size: " << config.message_size << " bytes (" << payload_names[config.payload_kind] << " payload)\n";
+    }
+    if (config.scenario == SCENARIO_REPLAY) out << "Messages per /history: " << config.replay << "\n";
+    if (config.scenario == SCENARIO_ROOM) {
+        out << "Room size: " << config.room_size << " (" << config.num_clients / config.room_size
+            << " rooms, each broadcast fans out to " << config.room_size - 1 << ")\n";
+    }
+    out << "Total test duration: " << t.total * 1e6 << " microseconds\n";
+    out << "Successful connections: " << t.successful << "\n";
+    out << "Failed connections: " << t.failed << "\n";
+    out << "Connection time p50/p99/max: " << t.connect_time.percentile(50) / 1e3 << " / "
+        << t.connect_time.percentile(99) / 1e3 << " / " << t.connect_time.max_value / 1e3 << " microseconds\n";
+    out << "Name registrations: " << t.handshake.total << " ("
+        << (t.handshake_span > 0 ? t.handshake.total / t.handshake_span : 0) << " handshakes/sec)\n";
+    if (config.tls != TLS_OFF) {
+        out << "TLS handshakes: " << t.tls_handshake.total << " (" << t.tls_resumed << " resumed, "
+            << (t.handshake_span > 0 ? t.tls_handshake.total / t.handshake_span : 0) << " handshakes/sec)\n";
+        print_histogram(out, "TLS handshake time", t.tls_handshake);
+    }
+    print_histogram(out, "Registration time", t.handshake);
+    if (config.scenario == SCENARIO_CHAT) {
+        out << "Chat pairings: " << t.pairing.total << " (" << (t.pairing_span > 0 ? t.pairing.total / t.pairing_span : 0) << " handshakes/sec)\n";
+        print_histogram(out, "Pairing time", t.pairing);
+    }
+    if (config.scenario == SCENARIO_ROOM) {
+        out << "Rooms assembled: " << t.pairing.total << "\n";
+        print_histogram(out, "Room assembly time (speaker connect to last join)", t.pairing);
+    }
+    out << (config.scenario == SCENARIO_ROOM ? "Total broadcasts sent: " : "Total messages sent: ") << t.sent << "\n";
+    out << "Total messages received: " << t.received << "\n";
+    if (config.scenario == SCENARIO_CHAT) out << "Relays refused by the server: " << t.dropped << "\n";
+    if (config.scenario == SCENARIO_STORE && t.dropped) {
+        out << "Messages the server would not hold (an away user had " << AWAY_HELD_MAX << " waiting; set --rate to plan for more): "
+            << t.dropped << "\n";
+    }
+    if (config.scenario == SCENARIO_REPLAY) {
+        out << "Replay rate: " << (t.elapsed > 0 ? (double)t.received * config.replay / t.elapsed : 0) << " messages/sec\n";
+    }
+    if (config.scenario == SCENARIO_ROOM) {
+        out << "Broadcast rate: " << (t.elapsed > 0 ? t.received / (config.room_size - 1) / t.elapsed : 0) << " broadcasts/sec\n";
+    }
+    out << "Throughput: " << (t.elapsed > 0 ? t.received / t.elapsed : 0) << " " << unit << "/sec, "
+        << (t.elapsed > 0 ? (t.bytes_sent + t.bytes_received) / t.elapsed / 1e6 : 0) << " MB/sec\n";
+    const char* label = "Latency";
+    if (config.scenario == SCENARIO_CHAT) label = "Relay latency (sender to partner)";
+    if (config.scenario == SCENARIO_LIST || config.scenario == SCENARIO_REPLAY) label = "Latency (to the first reply line)";
+    if (config.scenario == SCENARIO_STORE) label = "Latency (/msg to its acknowledgment)";
+    if (config.scenario == SCENARIO_CHURN) label = "Session time (connect to welcome)";
+    if (config.scenario == SCENARIO_ROOM) label = "Delivery latency (speaker to each member)";
+    out << label << " mean: " << t.latency.mean() / 1e3 << " microseconds\n";
+    print_histogram(out, label, t.latency);
+    const char* per = config.scenario == SCENARIO_ROOM ? "delivery" : "request";
+    double share = t.received ? 1.0 / t.received : 0;
+    out << "Bytes on the wire per " << per << ": " << t.bytes_sent * share << " sent, " << t.bytes_received * share << " received\n";
+    out << "Load generator CPU: " << t.client_cpu << " seconds (" << t.client_cpu * 1e6 * share << " microseconds per " << per << ")\n";
+    if (t.server_cpu >= 0) {
+        out << "Server CPU while running: " << t.server_cpu << " seconds (" << t.server_cpu * 1e6 * share
+            << " microseconds per " << per << ")\n";
+    }
+    if (t.server_raw > 0) {
+        out << "Server compression: " << t.server_raw / 1e6 << " MB -> " << t.server_wire / 1e6 << " MB ("
+            << 100 * t.server_wire / t.server_raw << "%), " << t.server_compress_s << " seconds compressing, "
+            << t.server_decompress_s << " seconds decompressing\n";
+    }
+    if (t.server_allocs >= 0) {
+        out << "Server heap allocations while running: " << t.server_allocs << " ("
+            << std::setprecision(4) << (t.received ? (double)t.server_allocs / t.received : 0) << " per " << per << ")\n";
+    }
+}
+
+// Read from a blocking helper connection until the reply holds want; false if it ends first
+bool read_until(int fd, void* tls, std::string& reply, const char* want) {
+    char buf[4096];
+    while (reply.find(want) == std::string::npos) {
+#ifdef HAVE_OPENSSL
+        int n = tls ? SSL_read((SSL*)tls, buf, sizeof(buf)) : (int)recv(fd, buf, sizeof(buf), 0);
+#else
+        int n = (int)recv(fd, buf, sizeof(buf), 0);
+#endif
+        if (n <= 0) return false;
+        reply.append(buf, n);
+    }
+    return true;
+}
+
+bool write_all(int fd, void* tls, const std::string& data) {
+#ifdef HAVE_OPENSSL
+    if (tls) return SSL_write((SSL*)tls, data.data(), (int)data.size()) == (int)data.size();
+#endif
+    return send(fd, data.data(), data.size(), MSG_NOSIGNAL) == (ssize_t)data.size();
+}
+
+// Log in as name and leave. The server holds mail only for names it has
+// seen, and hands over whatever an earlier run left waiting, so the name
+// starts with nothing held. The /list reply shows the login was recorded.
+bool visit_as(const std::string& name) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    struct timeval limit = { 5, 0 };  // A taken name gets no welcome: don't wait for it forever
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+    bool ok = connect(fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) == 0;
+    void* tls = NULL;
+#ifdef HAVE_OPENSSL
+    LoadConn holder;  // Where tls_new_session puts a resumption ticket
+    holder.tls_session = NULL;
+    if (ok && config.tls != TLS_OFF) {
+        SSL* ssl = SSL_new(tls_ctx);
+        tls = ssl;
+        ok = ssl && SSL_set_fd(ssl, fd);
+        if (ok) SSL_set_app_data(ssl, &holder);
+        ok = ok && SSL_connect(ssl) == 1;
+    }
+#endif
+    std::string reply;
+    ok = ok && write_all(fd, tls, name + "\n") && read_until(fd, tls, reply, "Type '/startchat'") &&
+         write_all(fd, tls, "/list\n") && read_until(fd, tls, reply, "Connected users:");
+#ifdef HAVE_OPENSSL
+    if (tls) SSL_free((SSL*)tls);
+    if (holder.tls_session) SSL_SESSION_free(holder.tls_session);
+#endif
+    close(fd);
+    return ok;
+}
+
+// Store and replay: log every away user in once and encode the requests to
+// them. In store each connection gets enough away users that none is sent
+// more than AWAY_HELD_MAX messages; replay needs one per connection.
+bool plan_away_users() {
+    size_t per_conn = 1;
+    if (config.scenario == SCENARIO_STORE) {
+        double requests = config.messages_per_client;
+        if (config.duration > 0) {
+            requests = config.rate > 0 ? config.rate * config.duration / config.num_clients : AWAY_DURATION_REQUESTS;
+        }
+        per_conn = (size_t)std::max(1.0, std::ceil(requests / AWAY_HELD_MAX));
+    }
+    for (size_t k = 0; k < per_conn * config.num_clients; k++) {
+        std::string name = AWAY_PREFIX + std::to_string(k);
+        if (!visit_as(name)) {
+            std::cout << "Could not log in as " << name << " to prepare the " << scenario_names[config.scenario] << " scenario\n";
+            return false;
+        }
+        std::string msg = "/msg " + name + " ";
+        msg.append(std::max(1, config.message_size - (int)msg.size() - 1), 'x');
+        away_msgs.push_back(encode_line(msg));
+        if (config.scenario == SCENARIO_REPLAY) away_history.push_back(encode_line("/history " + name + " " + std::to_string(config.replay)));
+    }
+    return true;
+}
+
+bool run_performance_test() {
+    if (config.scenario == SCENARIO_STORE || config.scenario == SCENARIO_REPLAY) {
+        if (!plan_away_users()) return false;
+    } else if (config.scenario == SCENARIO_LIST) {
+        payload = encode_line("/list");
+    } else {
+        payload = encode_line(make_payload(config.message_size - 1));
+    }
+
+    std::vector<Worker*> workers;
+    for (int t = 0; t < config.threads; t++) {
+        Worker* w = new Worker();
+        w->index = t;
+        workers.push_back(w);
+    }
+    // Per-connection interval so the senders add up to the requested rate
+    int senders = config.scenario == SCENARIO_ROOM ? config.num_clients / config.room_size : config.num_clients;
+    uint64_t interval_ns = config.rate > 0 ? (uint64_t)(1e9 * senders / config.rate) : 0;
+    std::vector<LoadConn*> conns;
+    for (int i = 0; i < config.num_clients; i++) {
+        LoadConn* conn = new LoadConn();
+        conn->id = i;
+        conn->interval_ns = interval_ns;
+        conns.push_back(conn);
+        // Chat partners and room members share a worker so deliveries are matched without locking
+        int owner = i % config.threads;
+        if (config.scenario == SCENARIO_CHAT) owner = (i / 2) % config.threads;
+        if (config.scenario == SCENARIO_ROOM) owner = (i / config.room_size) % config.threads;
+        workers[owner]->conns.push_back(conn);
+    }
+    if (config.scenario == SCENARIO_CHAT) {
+        for (int i = 0; i + 1 < config.num_clients; i += 2) {
+            conns[i]->peer = conns[i + 1];
+            conns[i + 1]->peer = conns[i];
+            conns[i]->relay_prefix = conn_name(conns[i + 1]) + ": ";
+            conns[i + 1]->relay_prefix = conn_name(conns[i]) + ": ";
+        }
+    }
+    if (config.scenario == SCENARIO_ROOM) {
+        for (int i = 0; i < config.num_clients; i += config.room_size) {
+            LoadRoom* room = new LoadRoom();
+            room->name = "loadroom_" + std::to_string(i / config.room_size);
+            room->joined = 0;
+            room->completed = 0;
+            for (int j = i; j < i + config.room_size; j++) {
+                room->members.push_back(conns[j]);
+                conns[j]->room = room;
+                conns[j]->relay_prefix = "[" + room->name + "] " + conn_name(conns[i]) + ": ";
+            }
+        }
+    }
+
+    // Server counters start once every connection is set up, so names,
+    // pairings and room joins are left out (churn counts whole sessions).
+    // Nobody sends until then: every request counted is one the server
+    // handled after the baseline.
+    ServerSample before = { -1, -1, -1, -1, -1, -1 };
+    if (config.metrics_port && config.scenario == SCENARIO_CHURN) {
+        before = sample_server();
+    } else if (config.metrics_port) {
+        sending_open.store(false, std::memory_order_release);
+    }
+
+    double cpu_start = process_cpu_seconds();
+    test_start_ns = now_ns();
+    for (size_t t = 0; t < workers.size(); t++) {
+        workers[t]->thread = std::thread(run_worker, workers[t]);
+    }
+    if (config.metrics_port && config.scenario != SCENARIO_CHURN) {
+        while (conns_running.load(std::memory_order_relaxed) + conns_failed.load(std::memory_order_relaxed) < config.num_clients &&
+               workers_exited.load(std::memory_order_relaxed) < config.threads) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        before = sample_server();
+        sending_open.store(true, std::memory_order_release);
+    }
+    for (size_t t = 0; t < workers.size(); t++) {
+        workers[t]->thread.join();
+    }
+    uint64_t test_end_ns = now_ns();
+    double cpu_end = process_cpu_seconds();
+
+    Totals totals;
+    uint64_t first_send = UINT64_MAX, last_recv = 0, last_handshake = 0, last_pairing = 0;
+    for (size_t t = 0; t < workers.size(); t++) {
+        Worker* w = workers[t];
+        totals.latency.merge(w->latency);
+        totals.connect_time.merge(w->connect_time);
+        totals.handshake.merge(w->handshake);
+        totals.tls_handshake.merge(w->tls_handshake);
+        totals.tls_resumed += w->tls_resumed;
+        totals.pairing.merge(w->pairing);
+        totals.sent += w->messages_sent;
+        totals.received += w->messages_received;
+        totals.dropped += w->dropped;
+        totals.bytes_sent += w->bytes_sent;
+        totals.bytes_received += w->bytes_received;
+        totals.successful += w->successful_conns;
+        totals.failed += w->failed_conns;
+        if (w->first_send_ns && w->first_send_ns < first_send) first_send = w->first_send_ns;
+        if (w->last_recv_ns > last_recv) last_recv = w->last_recv_ns;
+        if (w->last_handshake_ns > last_handshake) last_handshake = w->last_handshake_ns;
+        if (w->last_pairing_ns > last_pairing) last_pairing = w->last_pairing_ns;
+    }
+    // Throughput covers the span in which requests were actually flowing
+    totals.elapsed = last_recv > first_send ? (last_recv - first_send) / 1e9 : 0;
+    totals.total = (test_end_ns - test_start_ns) / 1e9;
+    if (last_handshake) totals.handshake_span = (last_handshake - test_start_ns) / 1e9;
+    if (last_pairing) totals.pairing_span = (last_pairing - test_start_ns) / 1e9;
+    totals.client_cpu = cpu_end - cpu_start;
+    if (config.metrics_port) {
+        ServerSample after = sample_server();
+        if (before.allocs >= 0 && after.allocs >= before.allocs) totals.server_allocs = (long long)(after.allocs - before.allocs);
+        if (before.cpu >= 0 && after.cpu >= before.cpu) totals.server_cpu = after.cpu - before.cpu;
+        if (before.raw >= 0 && after.raw >= before.raw) {
+            totals.server_raw = after.raw - before.raw;
+            totals.server_wire = after.wire - before.wire;
+            totals.server_compress_s = after.compress_s - before.compress_s;
+            totals.server_decompress_s = after.decompress_s - before.decompress_s;
+        }
     }
 
-    // Save results to file
     std::ofstream results_file("performance_results.txt");
     results_file << "Performance Test Results\n";
-    results_file << "======================\n";
-    results_file << "Number of clients: " << results.num_clients << "\n";
-    results_file << "Messages per client: " << results.messages_per_client << "\n";
-    results_file << "Total test duration: " << total_duration.count() << " microseconds\n";
-    results_file << "Successful connections: " << results.successful_conns << "\n";
-    results_file << "Failed connections: " << results.failed_conns << "\n";
-    results_file << "Average connection time: " << std::fixed << std::setprecision(2) << results.connection_time << " microseconds\n";
-    results_file << "Average message latency: " << std::fixed << std::setprecision(2) << results.message_latency << " microseconds\n";
-    results_file << "Total messages sent: " << results.messages_sent << "\n";
-    results_file << "Total messages received: " << results.messages_received << "\n";
+    print_results(results_file, totals);
     results_file.close();
-
-    // Print results to console
     std::cout << "\nPerformance Test Results:\n";
-    std::cout << "======================\n";
-    std::cout << "Number of clients: " << results.num_clients << "\n";
-    std::cout << "Messages per client: " << results.messages_per_client << "\n";
-    std::cout << "Total test duration: " << total_duration.count() << " microseconds\n";
-    std::cout << "Successful connections: " << results.successful_conns << "\n";
-    std::cout << "Failed connections: " << results.failed_conns << "\n";
-    std::cout << "Average connection time: " << std::fixed << std::setprecision(2) << results.connection_time << " microseconds\n";
-    std::cout << "Average message latency: " << std::fixed << std::setprecision(2) << results.message_latency << " microseconds\n";
-    std::cout << "Total messages sent: " << results.messages_sent << "\n";
-    std::cout << "Total messages received: " << results.messages_received << "\n";
-    std::cout << "\nDetailed results have been saved to 'performance_results.txt'\n";
+    print_results(std::cout, totals);
+    write_json("performance_results.json", totals);
+    std::cout << "\nDetailed results have been saved to 'performance_results.txt' and 'performance_results.json'\n";
+    if (history_missing.load(std::memory_order_relaxed)) {
+        std::cout << "The server has no history store; start it with --history-dir DIR\n";
+    }
+    if (codec_refused.load(std::memory_order_relaxed)) {
+        std::cout << "The server does not offer " << codec_names[config.codec] << " compression; rebuild it with make COMPRESSION="
+                  << codec_names[config.codec] << "\n";
+    }
+    if (config.max_allocs >= 0 && totals.server_allocs < 0) {
+        std::cout << "FAIL: the server reports no heap allocations; build it with make ALLOC_COUNT=1\n";
+        return false;
+    }
+    if (config.max_allocs >= 0 && totals.received == 0) {
+        std::cout << "FAIL: no requests completed, so the allocation count proves nothing\n";
+        return false;
+    }
+    if (config.max_allocs >= 0 && totals.server_allocs > config.max_allocs) {
+        std::cout << "FAIL: the server made " << totals.server_allocs << " heap allocations while running (at most "
+                  << config.max_allocs << " allowed)\n";
+        return false;
+    }
+    return true;
+}
+
+void usage(const char* prog) {
+    std::cout << "Usage: " << prog << " <server_ip> [port] [num_clients] [messages_per_client] [options]\n";
+    std::cout << "Options:\n";
+    std::cout << "  --scenario S    echo (default), chat (pairs relay to each other), list (/list storm)\n";
+    std::cout << "                  churn (connect, register, disconnect; messages_per_client is sessions)\n";
+    std::cout << "                  room (one speaker per room broadcasts to the other members),\n";
+    std::cout << "                  store (/msg to a user who is away: history store appends)\n";
+    std::cout << "                  or replay (/history of --replay messages); store and replay need --history-dir\n";
+    std::cout << "  --threads N     Event-loop threads driving the connections (default " << DEFAULT_THREADS << ")\n";
+    std::cout << "  --depth N       Closed loop: requests in flight per connection (default 1)\n";
+    std::cout << "  --rate R        Open loop: R requests/sec in total, latency corrected for coordinated omission\n";
+    std::cout << "  --duration S    Run for S seconds instead of a fixed message count\n";
+    std::cout << "  --size B        Request size in bytes including the newline; binary sends the same text framed (default " << DEFAULT_MESSAGE_SIZE << ")\n";
+    std::cout << "  --room-size N   Room scenario: members per room, speaker included (default " << DEFAULT_ROOM_SIZE << ")\n";
+    std::cout << "  --replay N      Replay scenario: messages each /history returns, up to 1000 (default " << DEFAULT_REPLAY << ")\n";
+    std::cout << "  --protocol P    text (default) or binary: framed requests, logging in with OP_HELLO\n";
+    std::cout << "  --compress C    none (default), lz4 or zstd with --protocol binary: requests of " << COMPRESS_MIN << " bytes or more\n";
+    std::cout << "                  go compressed and the server compresses large replies (codecs in this build:";
+    for (int c = CODEC_LZ4; c < CODEC_COUNT; c++) {
+        if (codec_built((Codec)c)) std::cout << " " << codec_names[c];
+    }
+    std::cout << ")\n";
+    std::cout << "  --tls M         full or resume: connect over TLS, with a full handshake every session or offering the\n";
+    std::cout << "                  server's last ticket; port is then the server's --tls-port (TLS in this build: "
+#ifdef HAVE_OPENSSL
+              << "yes"
+#else
+              << "no, make TLS=1"
+#endif
+              << ")\n";
+    std::cout << "  --payload P     fill (default: one repeated letter), text (chat-like words) or random: how well requests compress\n";
+    std::cout << "  --server-metrics PORT  Report the server's heap allocations, CPU and compression per request, read from its metrics port\n";
+    std::cout << "                  (heap allocations need a server built with make ALLOC_COUNT=1)\n";
+    std::cout << "  --max-allocs N  Exit with status 1 if the server made more than N heap allocations while running (needs --server-metrics)\n";
+    std::cout << "Example: " << prog << " 127.0.0.1 8989 1000 100 --depth 8\n";
 }
 
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        std::cout << "Usage: " << argv[0] << " <server_ip> [port] [num_clients] [messages_per_client]\n";
-        std::cout << "Example: " << argv[0] << " 127.0.0.1 8989 10 100\n";
+    config.port = DEFAULT_PORT;
+    config.num_clients = 5;
+    config.messages_per_client = 50;
+    config.threads = DEFAULT_THREADS;
+    config.depth = 1;
+    config.rate = 0;
+    config.duration = 0;
+    config.message_size = DEFAULT_MESSAGE_SIZE;
+    config.scenario = SCENARIO_ECHO;
+    config.room_size = DEFAULT_ROOM_SIZE;
+    config.replay = DEFAULT_REPLAY;
+    config.metrics_port = 0;
+    config.max_allocs = -1;
+    config.binary = false;
+    config.codec = CODEC_NONE;
+    config.payload_kind = PAYLOAD_FILL;
+    config.tls = TLS_OFF;
+
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0) {
+            positional.push_back(arg);
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (arg == "--threads") {
+            config.threads = atoi(value.c_str());
+        } else if (arg == "--depth") {
+            config.depth = atoi(value.c_str());
+        } else if (arg == "--rate") {
+            config.rate = atof(value.c_str());
+        } else if (arg == "--duration") {
+            config.duration = atof(value.c_str());
+        } else if (arg == "--size") {
+            config.message_size = atoi(value.c_str());
+        } else if (arg == "--room-size") {
+            config.room_size = atoi(value.c_str());
+        } else if (arg == "--replay") {
+            config.replay = atoi(value.c_str());
+        } else if (arg == "--protocol") {
+            if (value != "text" && value != "binary") {
+                usage(argv[0]);
+                return 1;
+            }
+            config.binary = value == "binary";
+        } else if (arg == "--compress") {
+            int found = -1;
+            for (int c = 0; c < CODEC_COUNT; c++) {
+                if (value == codec_names[c]) found = c;
+            }
+            if (found < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            config.codec = (Codec)found;
+        } else if (arg == "--payload") {
+            int found = -1;
+            for (int k = 0; k < (int)(sizeof(payload_names) / sizeof(payload_names[0])); k++) {
+                if (value == payload_names[k]) found = k;
+            }
+            if (found < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            config.payload_kind = (PayloadKind)found;
+        } else if (arg == "--tls") {
+            if (value != "full" && value != "resume") {
+                usage(argv[0]);
+                return 1;
+            }
+            config.tls = value == "full" ? TLS_FULL : TLS_RESUME;
+        } else if (arg == "--server-metrics") {
+            config.metrics_port = atoi(value.c_str());
+        } else if (arg == "--max-allocs") {
+            config.max_allocs = atoll(value.c_str());
+        } else if (arg == "--scenario") {
+            int found = -1;
+            for (int s = 0; s < (int)(sizeof(scenario_names) / sizeof(scenario_names[0])); s++) {
+                if (value == scenario_names[s]) found = s;
+            }
+            if (found < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            config.scenario = (Scenario)found;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (positional.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+    config.server_ip = positional[0];
+    if (positional.size() > 1) config.port = std::stoi(positional[1]);
+    if (positional.size() > 2) config.num_clients = std::stoi(positional[2]);
+    if (positional.size() > 3) config.messages_per_client = std::stoi(positional[3]);
+    config.mode = config.rate > 0 ? MODE_OPEN : MODE_CLOSED;
+    if (config.scenario == SCENARIO_CHURN && config.mode == MODE_OPEN) {
+        std::cout << "The churn scenario runs closed loop only; drop --rate\n";
+        return 1;
+    }
+    if (config.max_allocs >= 0 && (config.metrics_port == 0 || config.scenario == SCENARIO_CHURN)) {
+        std::cout << "--max-allocs needs --server-metrics, and counts requests, not churn sessions\n";
+        return 1;
+    }
+    if (config.codec != CODEC_NONE && !config.binary) {
+        std::cout << "Compression is part of the binary protocol; add --protocol binary\n";
+        return 1;
+    }
+    if (!codec_built(config.codec)) {
+        std::cout << "This load generator was built without " << codec_names[config.codec] << "; rebuild it with make COMPRESSION="
+                  << codec_names[config.codec] << "\n";
+        return 1;
+    }
+    if (config.tls != TLS_OFF && !tls_setup()) {
+#ifdef HAVE_OPENSSL
+        std::cout << "Could not set up TLS\n";
+#else
+        std::cout << "This load generator was built without TLS; rebuild it with make TLS=1\n";
+#endif
+        return 1;
+    }
+    if (config.scenario == SCENARIO_CHAT && config.num_clients % 2) {
+        config.num_clients++;  // Everyone needs a partner
+    }
+    if (config.scenario == SCENARIO_ROOM) {
+        if (config.room_size < 2) config.room_size = 2;
+        if (config.num_clients < config.room_size) config.num_clients = config.room_size;
+        config.num_clients -= config.num_clients % config.room_size;  // Whole rooms only
+    }
+    if (config.replay < 1) config.replay = 1;
+    if (config.replay > 1000) config.replay = 1000;  // The most one /history returns
+    if (config.threads < 1) config.threads = 1;
+    if (config.threads > config.num_clients) config.threads = config.num_clients;
+    if (config.depth < 1) config.depth = 1;
+    if (config.message_size < 2) config.message_size = 2;
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.server_ip.c_str(), &server_addr.sin_addr) != 1) {
+        std::cout << "Invalid server address: " << config.server_ip << "\n";
         return 1;
     }
 
-    std::string server_ip = argv[1];
-    int port = (argc > 2) ? std::stoi(argv[2]) : DEFAULT_PORT;
-    int num_clients = (argc > 3) ? std::stoi(argv[3]) : 5;
-    int messages_per_client = (argc > 4) ? std::stoi(argv[4]) : 50;
+    int fd_limit = raise_fd_limit(config.num_clients + 64);
+    if (fd_limit < config.num_clients + 64) {
+        std::cout << "Descriptor limit is " << fd_limit << "; raise it (ulimit -n) to open " << config.num_clients << " connections\n";
+        return 1;
+    }
 
     std::cout << "Starting performance test with:\n";
-    std::cout << "Server IP: " << server_ip << "\n";
-    std::cout << "Port: " << port << "\n";
-    std::cout << "Number of clients: " << num_clients << "\n";
-    std::cout << "Messages per client: " << messages_per_client << "\n\n";
-
-    run_performance_test(server_ip, port, num_clients, messages_per_client);
+    std::cout << "Server IP: " << config.server_ip << "\n";
+    std::cout << "Port: " << config.port << "\n";
+    std::cout << "Scenario: " << scenario_names[config.scenario] << "\n";
+    if (config.binary) {
+        std::cout << "Protocol: binary";
+        if (config.codec != CODEC_NONE) std::cout << ", " << codec_names[config.codec] << " compression";
+        std::cout << "\n";
+    }
+    if (config.tls != TLS_OFF) std::cout << "TLS: " << (config.tls == TLS_RESUME ? "resuming sessions" : "full handshakes") << "\n";
+    if (config.payload_kind != PAYLOAD_FILL) std::cout << "Payload: " << payload_names[config.payload_kind] << "\n";
+    if (config.scenario == SCENARIO_ROOM) std::cout << "Room size: " << config.room_size << "\n";
+    if (config.scenario == SCENARIO_REPLAY) std::cout << "Messages per /history: " << config.replay << "\n";
+    std::cout << "Number of clients: " << config.num_clients << "\n";
+    if (config.duration > 0) {
+        std::cout << "Duration: " << config.duration << " seconds\n";
+    } else {
+        std::cout << "Messages per client: " << config.messages_per_client << "\n";
+    }
+    std::cout << "Load: " << (config.mode == MODE_OPEN ? "open loop, " + std::to_string((long long)config.rate) + " requests/sec"
+                                                      : "closed loop, depth " + std::to_string(config.depth)) << "\n\n";
 
-    return 0;
-} 
\ No newline at end of file
+    return run_performance_test() ? 0 : 1;
+}